@@ -4,7 +4,7 @@ CFLAGS = -g -Dsolaris2
 
 LIBPATH = 
 
-LIBS = -lsocket -lnsl -lm -lelf -lpthread
+LIBS = -lsocket -lnsl -lm -lelf -lrt -lpthread
 
 CPPFLAGS = 
 
@@ -12,27 +12,74 @@ CC = gcc -g -D_REENTRANT $(CPPFLAGS)
 
 
 DOBJS=\
+addrstat.o \
 errexit.o \
+hdrhist.o \
 passivesock.o \
+passiveTCP.o \
 passiveUDP.o \
+pktring.o \
+statseg.o \
 tthread.o \
+uring.o \
 UDPechod.o
 
 EOBJS=\
+bert.o \
 errexit.o \
 connectsock.o \
 connectUDP.o \
+hdrhist.o \
+nsclock.o \
+pktsize.o \
+probe.o \
+rto.o \
+runlog.o \
+statseg.o \
+timerheap.o \
 tthread.o \
 UDPecho.o
 
 E2OBJS=\
+addrstat.o \
+bert.o \
+epoch.o \
 errexit.o \
+hdrhist.o \
+nsclock.o \
+pacer.o \
+pktsize.o \
 passivesock.o \
 passiveUDP.o \
+probe.o \
+provision.o \
+rto.o \
+runlog.o \
+seqwin.o \
+statseg.o \
 tthread.o \
+uring.o \
 UDPecho2.o
 
-all: UDPechod UDPecho UDPecho2
+SOBJS=\
+errexit.o \
+hdrhist.o \
+statseg.o \
+statdump.o
+
+ROBJS=\
+errexit.o \
+hdrhist.o \
+runlog.o \
+runlog2csv.o
+
+TOBJS=\
+addrstat.o \
+errexit.o \
+nsclock.o \
+tablebench.o
+
+all: UDPechod UDPecho UDPecho2 statdump runlog2csv
 
 UDPechod:	$(DOBJS)
 	${CC} -o $@ $(DOBJS) ${LIBS}
@@ -43,5 +90,20 @@ UDPecho:	$(EOBJS)
 UDPecho2:	$(E2OBJS)
 	${CC} -o $@ $(E2OBJS) ${LIBS}
 
+statdump:	$(SOBJS)
+	${CC} -o $@ $(SOBJS) ${LIBS}
+
+runlog2csv:	$(ROBJS)
+	${CC} -o $@ $(ROBJS) ${LIBS}
+
+bench:	UDPechod UDPecho2 statdump
+	sh bench.sh
+
+tablebench:	$(TOBJS)
+	${CC} -o $@ $(TOBJS) ${LIBS}
+
+microbench:	tablebench
+	./tablebench
+
 clean:
 	rm *.o *~ sessiontable
@@ -1,4 +1,9 @@
+#ifdef linux
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
@@ -7,8 +12,23 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef linux
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 
 #include "tthread.h"
+#include "nsclock.h"
+#include "hdrhist.h"
+#include "probe.h"
+#include "pktsize.h"
+#include "bert.h"
+#include "timerheap.h"
+#include "statseg.h"
+#include "runlog.h"
+#include "rto.h"
 
 extern int  connectUDP(const char *host, const char *service);
 extern int  errexit(const char *format, ...);
@@ -20,46 +40,161 @@ extern int  errexit(const char *format, ...);
 #define MICROSEC 1000000
 #endif
 
-#define BUFSIZE 1024
+#define BUFSIZE PKTSIZE_MAXPAYLOAD    /* largest probe */
+
+#define ENGINE_THREAD   0  /* a thread per endpoint */
+#define ENGINE_EPOLL    1  /* endpoints multiplexed over -w epoll loops */
+
+#define MAXLOOPS     64    /* largest -w we accept */
+#define MAXWINDOW    4096  /* largest -n we accept */
+#define LOOPEVENTS   256   /* epoll events taken per wait */
+
+/* a probe awaiting its echo, in EchoInfo.inflight slot seq % window */
+typedef struct _InFlight {
+   unsigned          seq;        /* 0 = free */
+   unsigned          answered;   /* last probe answered from this slot */
+   unsigned long long due;       /* ns when it times out */
+} InFlight;
 
 typedef struct _EchoInfo {
    int               sock;
    unsigned          addr;
    unsigned          port;
    time_t            start;      /* time this thread began */
-   unsigned          rt_time;    /* cumulative round trip measured in ms */
    unsigned          sent;       /* number of packets sent */
    unsigned          rcvd;       /* number of packets rcvd */
-   unsigned          timeout;    /* ms */
+   unsigned long long sentbytes; /* frame bytes, as on the wire */
+   unsigned long long rcvdbytes;
+   PktSize           size;       /* probe sizes to draw from */
+   unsigned          timeout;    /* ms, until the first round trip is known */
    unsigned          running;    /* thread still running */
    unsigned          load;       /* target send load in kbps */
    struct _EchoInfo  *next;      /* linked list */
+   HdrHist           rtt;        /* round trips in ns */
+   unsigned long long bertbits;  /* payload bits checked, -B */
+   unsigned long long biterrs;   /* of those, wrong */
+   unsigned          errored;    /* probes with any bit wrong */
+   unsigned          rnd;        /* size generator */
+   unsigned          seq;        /* last probe sent */
+   unsigned          timeouts;   /* probes that got no reply in time */
+   unsigned          late;       /* echoes that came after their timeout */
+   unsigned          duplicate;  /* second echoes of an answered probe */
+   InFlight          *inflight;  /* -n slots */
+   unsigned          oldest;     /* lowest seq that may be in flight */
+   Rto               rto;        /* timeout for the next probe */
+   unsigned long long nextsend;  /* ns when the load allows another */
+   TimerNode         timer;      /* -e epoll: next send or timeout */
+   unsigned          statidx;    /* -S record, and the id its probes carry */
+   RunTrack          *track;     /* -I/-R samples, sampler only */
 } EchoInfo;
 
+#ifdef linux
+/*
+ * -e epoll: one thread running a share of the endpoints.  Each endpoint
+ * runs the same window as echoThread, but instead of blocking it sits in
+ * 'timers' until its oldest probe times out or the load lets it send
+ * again, and its socket sits in the epoll set for the echoes.  New
+ * endpoints are passed in as pointers written to 'pipe', which also
+ * wakes the loop up.  The earliest deadline is set on a timerfd in the
+ * same epoll set, since epoll_wait's own timeout only counts whole ms
+ * and probe spacing at -l rates is often far less.
+ */
+typedef struct _Loop {
+   int               id;
+   int               ep;
+   int               pipe[2];
+   int               tfd;
+   unsigned long long armed;     /* deadline tfd is set for, 0 = none */
+   TimerHeap         timers;
+} Loop;
+#endif
+
 static EchoInfo   *echoList = NULL;
+static unsigned   echoCount = 0;
+static StatSeg    statSeg;          /* -S */
+static RunLog     runLog;           /* -R */
 
-static void       addThread(char *addr, char *port);
+static void       addThread(char *addr, char *port, char *size);
 static void       *echoThread(EchoInfo *);
+static unsigned long long pump(EchoInfo *ei, char *buf, unsigned long long now);
+static unsigned   sendProbe(EchoInfo *ei, char *buf);
+static int        gotReply(EchoInfo *ei, char *buf, int n);
+#ifdef linux
+static void       *loopThread(Loop *lp);
+static void       loopAdopt(Loop *lp);
+static void       loopTimer(Loop *lp, EchoInfo *ei, char *buf,
+                            unsigned long long now);
+static void       loopRecv(Loop *lp, EchoInfo *ei, char *buf);
+static void       loopDrop(Loop *lp, EchoInfo *ei);
+#endif
 static EchoInfo   *getInfo(char *addr, char *port);
 static void       showStats(char *what);
+static void       *publishThread(void *arg);
+static void       *sampleThread(void *arg);
+static void       *logThread(void *arg);
+static void       showHistory(char *what);
 static void       printhelp(void);
-static unsigned   subtract_timeval(struct timeval *tv1, struct timeval *tv2);
+static void       printLatency(HdrHist *h);
+static void       printBert(unsigned long long bits, unsigned long long errs,
+                            unsigned errored);
+static unsigned   kbps(unsigned long long bytes, time_t secs);
 
 static unsigned timeout = MILLISEC;        /* 1 sec */
 static unsigned loadkpbs = 1024 * 10;  /* 10 mbits/sec  */
+static char     *sizespec = "1070";     /* -s, 1024 byte payloads */
+static int      bertmode = BERT_NONE;
+static int      engine = ENGINE_THREAD;
+static unsigned nloops = 1;             /* -w, epoll loop threads */
+static unsigned window = 1;             /* -n, probes in flight per endpoint */
+static char     *statpath = NULL;       /* -S, stats file to publish in */
+static char     *runpath = NULL;        /* -R, run log to append samples to */
+static unsigned interval = 0;           /* -I, ms per sample, 0 = none */
+#ifdef linux
+static Loop     *loops;
+#endif
 
 int main(int argc, char *argv[])
 {
    char     hostname[100], prompt[100], rbuf[500], *s;
-   char     addrstr[100], portstr[100];
-   int      i, n;
+   char     addrstr[100], portstr[100], sizestr[100];
+   int      i, n, nfiles = 0;
    Thread   thr;
    FILE     *fp;
    unsigned tout, load;
+   char     **files;
+#ifdef linux
+   struct epoll_event ev;
+#endif
 
+   files = (char **)calloc(argc, sizeof(char *));
    for (i = 1; i < argc; i++) {
       if (strncmp(argv[i], "-h", 2) == 0) {
-         errexit("usage: UDPecho [-t timeout(ms)] [-l load(kbs)] [addressfile ...]\n");
+         errexit("usage: UDPecho [-t timeout(ms)] [-l load(kbs)] [-s size|lo-hi|size:weight,...|imix] [-B prbs23|prbs31] [-n inflight] [-e thread|epoll] [-w loops] [-S statsfile] [-R runlog] [-I interval(ms)] [addressfile ...]\n");
+      }
+      else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "thread") == 0)
+            engine = ENGINE_THREAD;
+#ifdef linux
+         else if (strcmp(argv[i], "epoll") == 0)
+            engine = ENGINE_EPOLL;
+#endif
+         else
+            printf("Bogus engine: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+         load = strtoul(argv[++i], (char **)NULL, 10);
+         if (load > 0 && load <= MAXWINDOW)
+            window = load;
+         else
+            printf("Bogus inflight value: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+         load = strtoul(argv[++i], (char **)NULL, 10);
+         if (load > 0 && load <= MAXLOOPS)
+            nloops = load;
+         else
+            printf("Bogus loops value: %s\n", argv[i]);
       }
       else if (strcmp(argv[i], "-t") == 0) {
          tout = strtoul(argv[++i], (char **)NULL, 10);
@@ -75,18 +210,87 @@ int main(int argc, char *argv[])
          else
             printf("Bogus load value: %s\n", argv[i]);
       }
+      else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+         statpath = argv[++i];
+      }
+      else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+         runpath = argv[++i];
+      }
+      else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+         interval = strtoul(argv[++i], (char **)NULL, 10);
+         if (interval == 0 || interval == ULONG_MAX) {
+            printf("Bogus interval: %s\n", argv[i]);
+            interval = 0;
+         }
+      }
+      else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+         sizespec = argv[++i];
+      }
+      else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "prbs23") == 0)
+            bertmode = BERT_PRBS23;
+         else if (strcmp(argv[i], "prbs31") == 0)
+            bertmode = BERT_PRBS31;
+         else
+            printf("Bogus BERT pattern: %s\n", argv[i]);
+         bert_init();
+      }
       else {
-         fp = fopen(argv[i], "r");
-         if (fp == NULL)
-            errexit("Can't open file %s\n", argv[i]);
-         do {
-            n = fscanf(fp, "%s %s", &addrstr, &portstr);
-            if (n == 2)
-               addThread(addrstr, portstr);
-         } while (n != EOF);
-         fclose(fp);
+         files[nfiles++] = argv[i];
+      }
+   }
+   if (runpath && interval == 0)
+      interval = MILLISEC;
+
+#ifdef linux
+   if (engine == ENGINE_EPOLL) {
+      loops = (Loop *)calloc(nloops, sizeof(Loop));
+      if (loops == NULL)
+         errexit("Can't allocate %d loops\n", nloops);
+      for (i = 0; i < nloops; i++) {
+         loops[i].id = i;
+         loops[i].ep = epoll_create1(0);
+         if (loops[i].ep < 0 || pipe(loops[i].pipe) < 0)
+            errexit("Can't set up loop %d: %s\n", i, strerror(errno));
+         fcntl(loops[i].pipe[0], F_SETFL, O_NONBLOCK);
+         if (!timerheap_init(&loops[i].timers, 1024))
+            errexit("Can't allocate timers\n");
+         ev.events = EPOLLIN;
+         ev.data.ptr = NULL;     /* the pipe, endpoints have their EchoInfo */
+         epoll_ctl(loops[i].ep, EPOLL_CTL_ADD, loops[i].pipe[0], &ev);
+         thread_create(&thr, (ThreadRunFunc)loopThread, &loops[i]);
+      }
+   }
+#endif
+
+   for (i = 0; i < nfiles; i++) {
+      fp = fopen(files[i], "r");
+      if (fp == NULL)
+         errexit("Can't open file %s\n", files[i]);
+      while (fgets(rbuf, sizeof(rbuf), fp)) {
+         n = sscanf(rbuf, "%99s %99s %99s", addrstr, portstr, sizestr);
+         if (n >= 2)
+            addThread(addrstr, portstr, n == 3 ? sizestr : NULL);
       }
+      fclose(fp);
    }
+   free(files);
+
+   if (statpath) {
+      if (!statseg_create(&statSeg, statpath, STATSEG_GENERATOR, "UDPecho",
+                          STATSEG_RECS))
+         errexit("Can't create stats file %s: %s\n", statpath,
+                 strerror(errno));
+      thread_create(&thr, (ThreadRunFunc)publishThread, NULL);
+   }
+   if (runpath) {
+      if (!runlog_open(&runLog, runpath, "UDPecho", interval))
+         errexit("Can't create run log %s: %s\n", runpath, strerror(errno));
+      thread_create(&thr, (ThreadRunFunc)logThread, NULL);
+   }
+   if (interval)
+      thread_create(&thr, (ThreadRunFunc)sampleThread, NULL);
 
    if (gethostname(hostname, 100) < 0) {
       strcpy(hostname, "unknown");
@@ -111,10 +315,13 @@ int main(int argc, char *argv[])
       else if (strncmp(rbuf, "stat ", 5) == 0) {
          showStats(rbuf + 5);
       }
+      else if (strncmp(rbuf, "hist ", 5) == 0) {
+         showHistory(rbuf + 5);
+      }
       else if (strncmp(rbuf, "add ", 4) == 0) {
-         n = sscanf(rbuf + 4, "%s %s", &addrstr, &portstr);
-         if (n == 2)
-            addThread(addrstr, portstr);
+         n = sscanf(rbuf + 4, "%99s %99s %99s", addrstr, portstr, sizestr);
+         if (n >= 2)
+            addThread(addrstr, portstr, n == 3 ? sizestr : NULL);
          else {
             printf("scanned only %d\n", n);
             printhelp();
@@ -127,10 +334,11 @@ int main(int argc, char *argv[])
    return 0;
 }
 
-static void addThread(char *addrstr, char *portstr)
+static void addThread(char *addrstr, char *portstr, char *sizestr)
 {
    int            sock;
    unsigned       addr, port;
+   PktSize        size;
    unsigned char  *bp;
    EchoInfo       *ei;
    Thread         thr;
@@ -145,6 +353,11 @@ static void addThread(char *addrstr, char *portstr)
       printf("Totally bogus port %s\n", portstr);
       return;
    }
+   if (!pktsize_parse(&size, sizestr ? sizestr : sizespec,
+                      sizeof(ProbeHead))) {
+      printf("Bogus size %s\n", sizestr ? sizestr : sizespec);
+      return;
+   }
    sock = connectUDP(addrstr, portstr);
    
    ei = (EchoInfo *)malloc(sizeof(EchoInfo));
@@ -154,103 +367,317 @@ static void addThread(char *addrstr, char *portstr)
    ei->port = port;
    ei->timeout = timeout;
    ei->load = loadkpbs;
+   ei->size = size;
+   ei->rnd = (addr * 0x9e3779b1U) ^ port;
+   ei->inflight = (InFlight *)calloc(window, sizeof(InFlight));
+   if (ei->inflight == NULL)
+      errexit("Can't allocate %u probe slots\n", window);
+   ei->oldest = 1;
+   rto_init(&ei->rto, (unsigned long long)timeout * (NSEC / MILLISEC));
+   hdrhist_init(&ei->rtt);
+   if (interval && (ei->track = runlog_track()) == NULL)
+      printf("No memory to sample %s %s\n", addrstr, portstr);
+   ei->statidx = ++echoCount;
    ei->next = echoList;
-   echoList = ei;
+   __atomic_store_n(&echoList, ei, __ATOMIC_RELEASE);  /* publishThread */
+
+#ifdef linux
+   if (engine == ENGINE_EPOLL) {
+      static unsigned   next = 0;
+      Loop              *lp = &loops[next++ % nloops];
 
+      if (write(lp->pipe[1], &ei, sizeof(ei)) != sizeof(ei))
+         printf("Can't pass %s to loop %d: %s\n", addrstr, lp->id,
+                strerror(errno));
+      return;
+   }
+#endif
    thread_create(&thr, (ThreadRunFunc)echoThread, ei);
 }
 
 static void *echoThread(EchoInfo *ei)
 {
    char              buf[BUFSIZE];
-   struct timeval    tv, stv;
-   struct timezone   tz;
+   struct timeval    stv;
    struct in_addr    iaddr;
-   unsigned          seq = 0, *uptr, rttime;
+   unsigned long long due, now;
    fd_set            rfds;
    int               ret, n;
-   int               outofseq = 0;
-   unsigned          ltime, wtime;
-   Mutex             mutex;   /* for pausing */
-   Condition         cond;    /* for pausing */
-   struct timespec   waittime;
    
-   uptr = (unsigned *)buf;
-
-   mutex_create(&mutex);
-   mutex_lock(&mutex);
-   cond_create(&cond);
+   memset(buf, 0, BUFSIZE);
 
    ei->running = 1;
    ei->start = time(NULL);
 
+   due = 0;
    while (ei->running) {
-      if (!outofseq) {
-         *uptr = ++seq;
-         gettimeofday(&tv, &tz);
-         memcpy(uptr + 1, &tv, sizeof(struct timeval));
-         send(ei->sock, buf, BUFSIZE, 0);
-         ei->sent++;
+      now = nsclock_now();
+      if (due <= now) {
+         due = pump(ei, buf, now);
+         continue;
       }
       FD_ZERO(&rfds);
       FD_SET(ei->sock, &rfds);
-      stv.tv_sec = ei->timeout / MILLISEC;
-      stv.tv_usec = (ei->timeout % MILLISEC) * MILLISEC;
+      stv.tv_sec = (due - now) / NSEC;
+      stv.tv_usec = (due - now) % NSEC / (NSEC / MICROSEC);
       ret = select(ei->sock + 1, &rfds, NULL, NULL, &stv);
       if (ret > 0) {
-         n = 0;
-         while (n < BUFSIZE) {
-            ret = recv(ei->sock, buf + n, BUFSIZE - n, 0);
-            if (ret < 0) {
-               iaddr.s_addr = ei->addr;
-               printf("Error reading sock for %s\n", inet_ntoa(iaddr));
-               ei->running = 0;
-               break;
-            }
-            n += ret;
-         }
-         if (n == BUFSIZE) {
-            outofseq = (*uptr < seq) ? 1 : 0;
-            memcpy(&tv, uptr + 1, sizeof(struct timeval));
-            gettimeofday(&stv, &tz);
-            rttime = subtract_timeval(&stv, &tv);
-            ei->rt_time += rttime;
-            ei->rcvd++;
+         while ((n = recv(ei->sock, buf, BUFSIZE, MSG_DONTWAIT)) >= 0)
+            if (gotReply(ei, buf, n))
+               due = 0;          /* room in the window, send again */
+         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            iaddr.s_addr = ei->addr;
+            printf("Error reading sock for %s\n", inet_ntoa(iaddr));
+            ei->running = 0;
          }
       }
-      else if (ret == 0) {
-         printf("Timeout\n");
+      else if (ret < 0 && errno != EINTR) {
+         fprintf(stderr, "select: %s\n", strerror(errno));
       }
-      else {
-         fprintf(stderr, strerror(errno));
+   }
+   iaddr.s_addr = ei->addr;
+   printf("... closing sock and exiting thread for %s\n", inet_ntoa(iaddr));
+   close(ei->sock);
+   return NULL;
+}
+
+/*
+ * Drives ei's window: gives up on probes whose timeout has passed, then
+ * sends as many as the window and the load allow.  Timeouts are taken
+ * oldest first, so a probe never times out ahead of an older one.
+ * Returns when to call again, the next timeout or the next send.
+ */
+static unsigned long long pump(EchoInfo *ei, char *buf, unsigned long long now)
+{
+   InFlight             *f;
+   unsigned long long   due = 0;
+   unsigned             bytes, expired = 0;
+
+   for (; ei->oldest <= ei->seq; ei->oldest++) {
+      f = &ei->inflight[ei->oldest % window];
+      if (f->seq != ei->oldest)
+         continue;               /* answered */
+      if (f->due > now) {
+         due = f->due;
+         break;
+      }
+      f->seq = 0;
+      ei->timeouts++;
+      expired++;
+   }
+   if (expired)
+      rto_backoff(&ei->rto);
+
+   while (ei->inflight[(ei->seq + 1) % window].seq == 0 &&
+          ei->nextsend <= now) {
+      bytes = sendProbe(ei, buf);
+      ei->inflight[ei->seq % window].seq = ei->seq;
+      ei->inflight[ei->seq % window].due = now + ei->rto.rto;
+      if (due == 0)
+         due = now + ei->rto.rto;
+      if (ei->nextsend < now)
+         ei->nextsend = now;
+      if (ei->load)
+         ei->nextsend += (unsigned long long)bytes * 8 * MICROSEC / ei->load;
+      else
+         ei->nextsend = now;
+   }
+   if (ei->inflight[(ei->seq + 1) % window].seq == 0 &&
+       (due == 0 || ei->nextsend < due))
+      due = ei->nextsend;
+   return due;
+}
+
+/*
+ * Sends ei its next probe, built in buf.  Returns the bytes it takes on
+ * the wire.
+ */
+static unsigned sendProbe(EchoInfo *ei, char *buf)
+{
+   ProbeHead   ph;
+   unsigned    size;
+
+   size = pktsize_next(&ei->size, &ei->rnd);
+   probe_init(&ph, ei->statidx, size,
+              (bertmode == BERT_PRBS23 ? PROBE_PRBS23 : 0) |
+              (bertmode == BERT_PRBS31 ? PROBE_PRBS31 : 0));
+   ph.seq = ++ei->seq;
+   if (bertmode)
+      bert_fill(bertmode, bert_seed(bertmode, ei->statidx, ph.seq),
+                (unsigned char *)buf + sizeof(ph), size - sizeof(ph));
+   ph.txns = nsclock_now();
+   probe_seal(&ph);
+   memcpy(buf, &ph, sizeof(ph));
+   send(ei->sock, buf, size, 0);
+   ei->sent++;
+   ei->sentbytes += size + PKTSIZE_OVERHEAD;
+   return size + PKTSIZE_OVERHEAD;
+}
+
+/*
+ * Accounts an echo of n bytes.  Returns 1 if it answered a probe still
+ * in flight, which leaves room in the window; an echo that shows up
+ * after its probe timed out is counted as late.  A second echo of a
+ * probe already answered is only counted as a duplicate.
+ */
+static int gotReply(EchoInfo *ei, char *buf, int n)
+{
+   unsigned long long errs, rtt;
+   ProbeHead         rh;
+   InFlight          *f;
+
+   if (!probe_parse(buf, n, &rh))
+      return 0;
+   f = &ei->inflight[rh.seq % window];
+   if (f->seq != rh.seq && f->answered == rh.seq) {
+      ei->duplicate++;
+      return 0;
+   }
+   rtt = nsclock_now() - rh.txns;
+   hdrhist_record(&ei->rtt, rtt);
+   rto_sample(&ei->rto, rtt);
+   ei->rcvd++;
+   ei->rcvdbytes += n + PKTSIZE_OVERHEAD;
+   if (bertmode) {
+      /* seeded with our own id, so another endpoint's echo shows up */
+      errs = bert_check(bertmode, bert_seed(bertmode, ei->statidx, rh.seq),
+                        (unsigned char *)buf + sizeof(rh), n - sizeof(rh));
+      ei->bertbits += (unsigned long long)(n - sizeof(rh)) * 8;
+      ei->biterrs += errs;
+      if (errs)
+         ei->errored++;
+   }
+   if (f->seq != rh.seq) {
+      ei->late++;
+      return 0;
+   }
+   f->answered = rh.seq;
+   f->seq = 0;
+   return 1;
+}
+
+#ifdef linux
+static void *loopThread(Loop *lp)
+{
+   struct epoll_event   ev[LOOPEVENTS];
+   char                 buf[BUFSIZE];
+   struct itimerspec    its;
+   TimerNode            *tn;
+   unsigned long long   now, fired;
+   int                  i, n;
+
+   if (nloops > 1)
+      thread_bindcpu(lp->id);
+   memset(buf, 0, BUFSIZE);
+   memset(&its, 0, sizeof(its));
+   lp->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+   if (lp->tfd < 0)
+      errexit("timerfd_create: %s\n", strerror(errno));
+   ev[0].events = EPOLLIN;
+   ev[0].data.ptr = lp;
+   epoll_ctl(lp->ep, EPOLL_CTL_ADD, lp->tfd, &ev[0]);
+
+   while (1) {
+      now = nsclock_now();
+      while ((tn = timerheap_top(&lp->timers)) != NULL && tn->due <= now)
+         loopTimer(lp, (EchoInfo *)tn->data, buf, now);
+      if ((tn ? tn->due : 0) != lp->armed) {
+         lp->armed = tn ? tn->due : 0;
+         its.it_value.tv_sec = lp->armed / NSEC;
+         its.it_value.tv_nsec = lp->armed % NSEC;
+         timerfd_settime(lp->tfd, TFD_TIMER_ABSTIME, &its, NULL);
       }
-      ltime = time(NULL) - ei->start;
-      if (ltime && (((ei->sent * 8) / ltime) > ei->load)) {
-         wtime = ((ei->sent * 8) / ei->load) - ltime;
-         if (wtime > 0) {
-            waittime.tv_sec = wtime;
-            waittime.tv_nsec = 0;
-            printf("waiting for %d seconds\n", wtime);
-            sleep(wtime);
-            /* cond_timedwait(&cond, &mutex, &waittime); */
-            printf("done waiting\n", wtime);
+
+      n = epoll_wait(lp->ep, ev, LOOPEVENTS, -1);
+      if (n < 0 && errno != EINTR)
+         errexit("epoll_wait: %s\n", strerror(errno));
+      for (i = 0; i < n; i++) {
+         if (ev[i].data.ptr == lp) {
+            read(lp->tfd, &fired, sizeof(fired));
+            lp->armed = 0;
          }
+         else if (ev[i].data.ptr == NULL)
+            loopAdopt(lp);
+         else
+            loopRecv(lp, (EchoInfo *)ev[i].data.ptr, buf);
       }
    }
+   return NULL;
+}
+
+/*
+ * Takes on the endpoints addThread passed in.  Their first probes are
+ * spread over one probe interval, so endpoints added together don't
+ * stay in lockstep and hit the reflector in bursts.
+ */
+static void loopAdopt(Loop *lp)
+{
+   struct epoll_event   ev;
+   EchoInfo             *ei;
+   unsigned long long   due;
+
+   while (read(lp->pipe[0], &ei, sizeof(ei)) == sizeof(ei)) {
+      ei->running = 1;
+      ei->start = time(NULL);
+      ei->timer.data = ei;
+      due = nsclock_now();
+      if (ei->load)
+         due += (unsigned long long)ei->size.mean * 8 * MICROSEC / ei->load *
+                (ei->rnd & 0xffff) / 0x10000;
+      ev.events = EPOLLIN;
+      ev.data.ptr = ei;
+      if (epoll_ctl(lp->ep, EPOLL_CTL_ADD, ei->sock, &ev) < 0 ||
+          !timerheap_set(&lp->timers, &ei->timer, due))
+         loopDrop(lp, ei);
+   }
+}
+
+/* ei's next send or timeout came up */
+static void loopTimer(Loop *lp, EchoInfo *ei, char *buf,
+                      unsigned long long now)
+{
+   timerheap_set(&lp->timers, &ei->timer, pump(ei, buf, now));
+}
+
+/* reads every echo queued for ei, any that open the window send again */
+static void loopRecv(Loop *lp, EchoInfo *ei, char *buf)
+{
+   struct in_addr       iaddr;
+   int                  n, room = 0;
+
+   while ((n = recv(ei->sock, buf, BUFSIZE, MSG_DONTWAIT)) >= 0)
+      room |= gotReply(ei, buf, n);
+   if (room)
+      timerheap_set(&lp->timers, &ei->timer, pump(ei, buf, nsclock_now()));
+   if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
    iaddr.s_addr = ei->addr;
-   printf("... closing sock and exiting thread for %s\n", inet_ntoa(iaddr));
+   printf("Error reading sock for %s\n", inet_ntoa(iaddr));
+   loopDrop(lp, ei);
+}
+
+/* stops running ei, the way echoThread ends on a socket error */
+static void loopDrop(Loop *lp, EchoInfo *ei)
+{
+   struct in_addr       iaddr;
+
+   iaddr.s_addr = ei->addr;
+   printf("... closing sock for %s\n", inet_ntoa(iaddr));
+   timerheap_del(&lp->timers, &ei->timer);
+   epoll_ctl(lp->ep, EPOLL_CTL_DEL, ei->sock, NULL);
    close(ei->sock);
-   mutex_destroy(&mutex);
-   cond_destroy(&cond);
+   ei->running = 0;
 }
+#endif
       
    
 static void printhelp(void)
 {
-   printf("add ipaddress port    - adds a thread\n");
+   printf("add ipaddress port [size] - adds a thread\n");
    printf("stat ipaddress port   - shows stats for an ipaddress port\n");
    printf("stat sum              - summary stats\n");
    printf("stat all              - shows stats for all \n");
+   printf("hist ipaddress port   - shows the last intervals, with -I or -R\n");
    printf("help                  - shows this\n");
    printf("aksjdfhlaksd          - shows this\n");
    printf("exit                  - exits\n");
@@ -261,42 +688,58 @@ static void showStats(char *what)
    EchoInfo *ei;
    int      all, bps, count;
    time_t   ttime, atime, mintime, cumtime;
-   unsigned addr, packets_sent, packets_rcvd, latency, totlatency;
+   unsigned addr, packets_sent, packets_rcvd;
+   unsigned long long bytes_rcvd, bertbits, biterrs;
+   unsigned errored, timeouts, late, duplicate;
    struct in_addr iaddr;
    char     *s, addrbuf[100], portbuf[100];
+   static HdrHist rtt;
    
    if (strcmp(what, "all") == 0 || strcmp(what, "sum") == 0) {
+      hdrhist_init(&rtt);
       all = strcmp(what, "all") == 0;
       count = 0;
       mintime = LONG_MAX;
       packets_sent = packets_rcvd = 0;
+      bytes_rcvd = bertbits = biterrs = 0;
+      errored = timeouts = late = duplicate = 0;
       cumtime = 0;
       for (ei = echoList; ei; ei = ei->next) {
          count++;
          atime = time(NULL) - ei->start;
          packets_sent += ei->sent;
          packets_rcvd += ei->rcvd;
+         bytes_rcvd += ei->rcvdbytes;
+         bertbits += ei->bertbits;
+         biterrs += ei->biterrs;
+         errored += ei->errored;
+         timeouts += ei->timeouts;
+         late += ei->late;
+         duplicate += ei->duplicate;
          cumtime += atime;
-         if (ei->rt_time && ei->rcvd)
-            totlatency += ei->rt_time / ei->rcvd;
+         hdrhist_merge(&rtt, &ei->rtt);
          if (ei->start < mintime)
             mintime = ei->start;
          if (all) {
             iaddr.s_addr = ei->addr;
-            latency = ei->rcvd ? ei->rt_time / ei->rcvd : 0;
-            printf("%15s sent %10d rcvd %10d latency %5d ms rate %d kbps\n",
+            printf("%15s sent %10d rcvd %10d p50 %9.1f p99 %9.1f us rate %d kbps\n",
                    inet_ntoa(iaddr), ei->sent, ei->rcvd,
-                   latency,
-                   ((ei->rcvd * 8)/ atime));
+                   hdrhist_percentile(&ei->rtt, 50) / 1000.0,
+                   hdrhist_percentile(&ei->rtt, 99) / 1000.0,
+                   kbps(ei->rcvdbytes, atime));
          }
       }
-      latency = packets_rcvd ? totlatency / packets_rcvd : 0;
       printf("---------------------------------------------------\n");
       printf("Number of addresses:  %d\n", count);
       printf("Packets sent:         %d\n", packets_sent);
       printf("Packets rcvd:         %d\n", packets_rcvd);
-      printf("Average latency:      %d\n", latency);
-      printf("Average kbps:         %d\n", (packets_rcvd * 8) / cumtime);
+      printf("Timeouts:             %u (%u echoes late)\n", timeouts, late);
+      printf("Duplicated:           %u\n", duplicate);
+      printf("Average latency:      %.1f us\n", hdrhist_mean(&rtt) / 1000.0);
+      printLatency(&rtt);
+      if (bertmode)
+         printBert(bertbits, biterrs, errored);
+      printf("Average kbps:         %d\n", kbps(bytes_rcvd, cumtime));
    }
    else {
       sscanf(what, "%s %s", addrbuf, portbuf);
@@ -309,11 +752,16 @@ static void showStats(char *what)
          if (ei) {
             iaddr.s_addr = ei->addr;
             atime = time(NULL) - ei->start;
-            latency = ei->rcvd ? ei->rt_time / ei->rcvd : 0;
-            printf("%15s sent %10d rcvd %10d latency %5d ms rate %d kbps\n",
+            printf("%15s sent %10d rcvd %10d rate %d kbps mean frame %u\n",
                    inet_ntoa(iaddr), ei->sent, ei->rcvd,
-                   latency,
-                   ((ei->rcvd * 8)/ atime));
+                   kbps(ei->rcvdbytes, atime), ei->size.mean);
+            printf("srtt %.1f rttvar %.1f rto %.1f us, %u timeouts, %u late, "
+                   "%u duplicated\n", ei->rto.srtt / 1000.0,
+                   ei->rto.rttvar / 1000.0, ei->rto.rto / 1000.0,
+                   ei->timeouts, ei->late, ei->duplicate);
+            printLatency(&ei->rtt);
+            if (bertmode)
+               printBert(ei->bertbits, ei->biterrs, ei->errored);
          }
          else {
             printf("Don't know nothin bout no address %s\n", what);
@@ -344,19 +792,154 @@ static EchoInfo *getInfo(char *addrstr, char *portstr)
    return ei;
 }
 
-/* subtracts tv2 from tv1 and returns the result in milliseconds */
-static unsigned subtract_timeval(struct timeval *tv1, struct timeval *tv2)
+/* round trip percentiles, in microseconds */
+static void printLatency(HdrHist *h)
 {
-   unsigned us;
-   unsigned ms = (tv1->tv_sec - tv2->tv_sec) * MILLISEC;
-   
+   printf("Latency p50/p90/p99:  %.1f / %.1f / %.1f us\n",
+          hdrhist_percentile(h, 50) / 1000.0,
+          hdrhist_percentile(h, 90) / 1000.0,
+          hdrhist_percentile(h, 99) / 1000.0);
+   printf("Latency p99.9/max:    %.1f / %.1f us\n",
+          hdrhist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
+
+static void printBert(unsigned long long bits, unsigned long long errs,
+                      unsigned errored)
+{
+   printf("Bit errors:           %llu in %llu bits, BER %.3g\n", errs, bits,
+          bits ? (double)errs / bits : 0.0);
+   printf("Errored probes:       %u\n", errored);
+}
 
-   if (tv1->tv_usec < tv2->tv_usec) {
-      us = (tv1->tv_usec + MICROSEC) - tv2->tv_usec;
-      ms = (ms - MILLISEC) + (us / MILLISEC);
+/*
+ * -S: every STATSEG_PERIOD ms, copies each endpoint's counters into its
+ * record and the sums into record 0.  It reads them unlocked as
+ * showStats does; endpoints are only ever added, at the head of the
+ * list, so the walk is safe from here too.
+ */
+static void *publishThread(void *arg)
+{
+   static HdrHist rtt;
+   StatRec     r, total;
+   EchoInfo    *ei;
+   unsigned    used;
+
+   while (1) {
+      usleep(STATSEG_PERIOD * 1000);
+      memset(&total, 0, sizeof(total));
+      hdrhist_init(&rtt);
+      used = 1;
+      for (ei = __atomic_load_n(&echoList, __ATOMIC_ACQUIRE); ei;
+           ei = ei->next) {
+         memset(&r, 0, sizeof(r));
+         r.addr = ei->addr;
+         r.port = ei->port;
+         r.flags = STATREC_USED;
+         r.start = ei->start;
+         r.sent = ei->sent;
+         r.rcvd = ei->rcvd;
+         r.sentbytes = ei->sentbytes;
+         r.rcvdbytes = ei->rcvdbytes;
+         r.lost = ei->timeouts > ei->late ? ei->timeouts - ei->late : 0;
+         r.late = ei->late;
+         r.duplicate = ei->duplicate;
+         r.timeouts = ei->timeouts;
+         r.bertbits = ei->bertbits;
+         r.biterrs = ei->biterrs;
+         r.errored = ei->errored;
+         statseg_rtt(&r, &ei->rtt);
+         statseg_write(&statSeg, ei->statidx, &r);
+         statseg_sum(&total, &r);
+         hdrhist_merge(&rtt, &ei->rtt);
+         if (ei->statidx >= used)
+            used = ei->statidx + 1;
+      }
+      total.flags = STATREC_USED;
+      statseg_rtt(&total, &rtt);
+      statseg_write(&statSeg, 0, &total);
+      statseg_publish(&statSeg, used);
    }
-   else {
-      ms += (tv1->tv_usec - tv2->tv_usec) / MILLISEC;
+   return NULL;
+}
+
+/*
+ * -I/-R: closes an interval for every endpoint each 'interval' ms,
+ * reading the counters unlocked the way publishThread does.  The samples
+ * go to each endpoint's ring and, with -R, to the queue logThread drains.
+ */
+static void *sampleThread(void *arg)
+{
+   unsigned long long   next, ms;
+   EchoInfo             *ei;
+   RunTotals            now;
+
+   next = nsclock_now();
+   while (1) {
+      next += (unsigned long long)interval * (NSEC / MILLISEC);
+      nsclock_sleepuntil(next);
+      ms = runlog_ms();
+      for (ei = __atomic_load_n(&echoList, __ATOMIC_ACQUIRE); ei;
+           ei = ei->next) {
+         if (ei->track == NULL)
+            continue;
+         now.sent = ei->sent;
+         now.rcvd = ei->rcvd;
+         now.lost = ei->timeouts > ei->late ? ei->timeouts - ei->late : 0;
+         now.bytes = ei->rcvdbytes;
+         runlog_sample(runpath ? &runLog : NULL, ei->track, ms, ei->addr,
+                       ei->port, &now, &ei->rtt);
+      }
    }
-   return ms;
+   return NULL;
+}
+
+/* -R: moves queued samples to disk, off the sampler's thread */
+static void *logThread(void *arg)
+{
+   while (1) {
+      usleep(RUNLOG_FLUSH * 1000);
+      runlog_flush(&runLog);
+   }
+   return NULL;
+}
+
+/* the ring of one endpoint, oldest interval first */
+static void showHistory(char *what)
+{
+   char        addrbuf[100], portbuf[100];
+   EchoInfo    *ei;
+   RunTrack    *tr;
+   RunSample   *rs;
+   unsigned    i, n;
+
+   if (sscanf(what, "%99s %99s", addrbuf, portbuf) != 2 ||
+       (ei = getInfo(addrbuf, portbuf)) == NULL) {
+      printf("Don't know nothin bout no address %s\n", what);
+      return;
+   }
+   tr = ei->track;
+   if (tr == NULL) {
+      printf("No samples, run with -I or -R\n");
+      return;
+   }
+   n = tr->count < RUNLOG_RING ? tr->count : RUNLOG_RING;
+   printf("%8s %8s %8s %8s %9s %9s %9s %9s\n", "ms ago", "sent", "rcvd",
+          "lost", "kbps", "p50 us", "p99 us", "max us");
+   for (i = tr->count - n; i != tr->count; i++) {
+      rs = &tr->ring[i % RUNLOG_RING];
+      printf("%8llu %8u %8u %8u %9llu %9.1f %9.1f %9.1f\n",
+             runlog_ms() - rs->t, rs->sent, rs->rcvd, rs->lost,
+             rs->bytes * 8 / interval, rs->rtt50 / 1000.0,
+             rs->rtt99 / 1000.0, rs->rttmax / 1000.0);
+   }
+   if (runpath && runLog.dropped)
+      printf("%llu samples dropped on the way to %s\n", runLog.dropped,
+             runpath);
+}
+
+static unsigned kbps(unsigned long long bytes, time_t secs)
+{
+   if (secs <= 0)
+      secs = 1;
+   return (unsigned)((bytes * 8) / 1000 / secs);
 }
@@ -1,4 +1,9 @@
+#ifdef linux
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
@@ -8,11 +13,37 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef linux
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/sockios.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#endif
 
 #include "tthread.h"
+#include "uring.h"
+#include "nsclock.h"
+#include "pacer.h"
+#include "epoch.h"
+#include "hdrhist.h"
+#include "seqwin.h"
+#include "rto.h"
+#include "probe.h"
+#include "pktsize.h"
+#include "bert.h"
+#include "statseg.h"
+#include "runlog.h"
+#include "provision.h"
+#include "addrstat.h"
 
 extern int  connectUDP(const char *host, const char *service);
 extern int  errexit(const char *format, ...);
+extern int  passiveUDP(const char *service);
+extern int  reuseport;
 
 #ifndef MILLISEC
 #define MILLISEC 1000
@@ -21,66 +52,334 @@ extern int  errexit(const char *format, ...);
 #define MICROSEC 1000000
 #endif
 
-#define BUFSIZE   1024
+#define BUFSIZE   PKTSIZE_MAXPAYLOAD  /* largest probe */
+
+#define ENGINE_SOCKET   0  /* sendto/recvfrom */
+#define ENGINE_URING    1  /* io_uring, falls back to sockets */
+
+#define TSTAMP_NONE     0  /* round trips from our own clock reads */
+#define TSTAMP_SW       1  /* kernel software tx/rx timestamps */
+#define TSTAMP_HW       2  /* nic hardware timestamps */
+#define TSRING          65536 /* tx timestamps kept per sender, power of 2 */
+
+#define URINGSLOTS   256   /* io_uring submission queue entries */
+#define URINGBUFS    1024  /* provided receive buffers, power of 2 */
+#define URINGTAG     (~0ULL)
+
+#define MAXBATCH     1024  /* largest -b we accept */
+#define MAXSHARDS    64    /* largest -w we accept */
+#define MAXSEGS      63    /* probes per GSO train */
+#define MAXTRAIN     65000 /* GSO train must fit one 64k datagram */
+#define GROSIZE      65536 /* largest coalesced datagram we receive */
+#define CTLSIZE      CMSG_SPACE(sizeof(unsigned short))
+#define HEADSIZE     sizeof(ProbeHead)
+#define SLOTBITS     20    /* endpoint slot in a probe id, the rest is a tag */
+#define SLOTMASK     ((1U << SLOTBITS) - 1)
+#define TCPEVENTS    256   /* epoll events taken per wait */
+#define TCPIDLE      10    /* ms to wait when no connection can send */
+#define TCPRETRY     NSEC  /* before reconnecting a dropped connection */
+#define PROVBATCH    256   /* finished up scripts taken per table swap */
+
+#ifndef linux
+struct mmsghdr {
+   struct msghdr     msg_hdr;
+   unsigned          msg_len;
+};
+#endif
 
 typedef struct _EchoInfo {
    unsigned          addr;
    unsigned          port;
    time_t            start;      /* time sending began */
-   unsigned          rt_time;    /* cumulative round trip measured in ms */
    unsigned          sent;       /* number of packets sent */
    unsigned          rcvd;       /* number of packets rcvd */
-   unsigned          seq;        /* latest sequence received */
-   unsigned          outOfseq;   /* packets received out of sequence */
-   struct _EchoInfo  *next;      /* for hash */
-   struct _EchoInfo  *nextlink;  /* global linked list */
+   unsigned long long sentbytes; /* frame bytes, as on the wire */
+   unsigned long long rcvdbytes;
+   PktSize           size;       /* probe sizes to draw from */
+   unsigned          rnd;        /* size generator, sender only */
+   unsigned          txseq;      /* last sequence sent, sender only */
+   SeqWin            win;        /* arrivals, receiver only */
+   Rto               rto;        /* when win gives up on a probe, ditto */
+   unsigned          untimed;    /* echoes with no kernel tx timestamp */
+   int               shard;      /* sender that owns it */
+   unsigned          id;         /* slot in EchoTable.byid, plus a tag */
+   HdrHist           rtt;        /* round trips in ns */
+   unsigned long long bertbits;  /* payload bits checked, -B */
+   unsigned long long biterrs;   /* of those, wrong */
+   unsigned          errored;    /* probes with any bit wrong */
+   unsigned          drops;      /* connections lost, -P tcp */
+   RunTrack          *track;     /* -I/-R samples, sampler only */
 } EchoInfo;
 
-static EchoInfo   *echoHash[256][256];
-static EchoInfo   *echoList = NULL;
-static Mutex      recvMutex;
-static Mutex      sendMutex;
-static Condition  sendStart;
+/*
+ * The published endpoint set.  A table never changes once published:
+ * add and del build a changed copy and swap it in, and the old copy (and
+ * a deleted EchoInfo) is released through echoEpoch once no sender or
+ * receiver can still be looking at it.  The data path never locks.
+ */
+typedef struct _EchoTable {
+   unsigned          version;
+   unsigned          count;
+   EchoInfo          **list;     /* newest first */
+   EchoInfo          **index;    /* open addressing on addr and port */
+   unsigned          mask;       /* index slots - 1 */
+   EchoInfo          **byid;     /* by id & SLOTMASK, for received probes */
+   unsigned          nids;
+} EchoTable;
+
+/*
+ * Everything a sweep needs, prebuilt from the table whenever it changes:
+ * one message per endpoint with its address filled in, and an iovec pair
+ * per probe pointing at the probe's own head and a shared body.  A sweep
+ * only draws sizes, patches the heads and hands slices to sendmmsg, so
+ * nothing is allocated per packet.  With -g a message carries up to
+ * 'gsosegs' probes of one size, which the kernel splits into separate
+ * datagrams at the UDP_SEGMENT boundary in the message's 'ctls' slot.
+ */
+typedef struct _SendVec {
+   unsigned             gen;        /* table version this was built from */
+   int                  count;
+   EchoInfo             **eps;
+   struct mmsghdr       *msgs;
+   struct iovec         *iovs;      /* two per probe */
+   struct sockaddr_in   *addrs;
+   ProbeHead            *heads;     /* one per probe */
+   unsigned char        *bodies;    /* BUFSIZE per probe with -B, else NULL */
+   char                 *ctls;      /* UDP_SEGMENT cmsg per message, -g */
+   unsigned char        *nsegs;     /* probes in each message this sweep */
+   unsigned char        *inflight;  /* io_uring sends not yet completed */
+   unsigned             meanbits;   /* average probe on the wire */
+} SendVec;
+
+/*
+ * Kernel tx timestamp of probe 'seq' to endpoint 'id', looked up by the
+ * receive side.  Every endpoint numbers its own probes, so the slot is
+ * hashed from both.  seq is written last and checked again after the
+ * rest is read, so a slot being reused underneath a reader reads as
+ * missing.
+ */
+typedef struct _TxStamp {
+   unsigned             seq;
+   unsigned             id;
+   unsigned long long   ns;
+} TxStamp;
 
-static void       addEcho(char *addrstr, char *portstr);
+/*
+ * What the sender's 'key'th message carried: 'count' probes to endpoint
+ * 'id' from 'seq' on.  The kernel numbers the messages of a socket from
+ * 0 (SOF_TIMESTAMPING_OPT_ID) and hands that number back with the stamp
+ * instead of a copy of the packet.  'key' is written last, so a reader
+ * that finds it can trust the rest.
+ */
+typedef struct _TxKey {
+   unsigned             key;
+   unsigned             id;
+   unsigned             seq;
+   unsigned             count;
+} TxKey;
+
+/*
+ * One sender: its own socket and receive thread, and the endpoints whose
+ * 'shard' names it.  'rate' is its share of -l, in proportion to how many
+ * endpoints it owns.  A sender with nothing to send sleeps on 'start'.
+ */
+typedef struct _Shard {
+   int                  id;
+   int                  sock;
+   int                  txreader;   /* echoEpoch slots */
+   int                  rxreader;
+   unsigned             count;      /* endpoints placed here */
+   unsigned long long   rate;       /* bits per second */
+   TxStamp              *stamps;    /* TSRING slots, see stampSlot */
+   TxKey                *keys;      /* TSRING messages, by kernel key */
+   unsigned             txkey;      /* key of the next message sent */
+   Mutex                mutex;
+   Condition            start;      /* signalled when it gets an endpoint */
+} Shard;
+
+#ifdef linux
+/*
+ * One -P tcp connection, owned by a single tcpThread.  It has at most one
+ * probe to write at a time, so a slow reflector holds back only its own
+ * stream.  'rbuf' holds what has arrived of the echoes, which may end in
+ * the middle of a probe.
+ */
+typedef struct _TcpConn {
+   int                  sock;       /* -1 while waiting to reconnect */
+   unsigned             id;         /* endpoint it belongs to */
+   struct sockaddr_in   addr;
+   int                  connected;
+   unsigned long long   retry;      /* ns when to reconnect */
+   unsigned             events;     /* what epoll is watching for */
+   unsigned             rlen;
+   unsigned             wlen;
+   unsigned             woff;       /* written so far of wbuf */
+   char                 rbuf[4 * BUFSIZE];
+   char                 wbuf[BUFSIZE];
+} TcpConn;
+#endif
+
+static EchoTable  *echoTable;       /* current version */
+static Epoch      echoEpoch;
+static Shard      *shards;
+static Mutex      echoMutex;        /* serializes add/del */
+static unsigned   idtag;            /* bumped for every endpoint added */
+static unsigned long long rejected; /* received packets that aren't ours */
+static StatSeg    statSeg;          /* -S */
+static RunLog     runLog;           /* -R */
+static Provision  prov;             /* runs the up and down scripts */
+static EchoInfo   **pending;        /* waiting for their up script */
+static unsigned   npending, maxpending;
+static int        paused;           /* "pause": senders hold, echoes still count */
+
+static void       addEcho(char *addrstr, char *portstr, char *sizestr);
 static void       delEcho(char *addrstr, char *portstr);
-static void       *sendThread(int sock);
-static void       *recvThread(int sock);
+static void       pauseSend(int on);
+static void       addEchos(EchoInfo **add, unsigned n);
+static EchoInfo   *findPending(unsigned addr, unsigned port);
+static void       *provisionThread(void *arg);
+static void       *sendThread(Shard *sh);
+static void       buildSendVec(Shard *sh, EchoTable *t, SendVec *sv);
+static unsigned   fillProbes(SendVec *sv, int j);
+static void       sendBatch(Shard *sh, struct mmsghdr *msgs, int n);
+static void       *recvThread(Shard *sh);
+static void       gotProbe(char *buf, int n, unsigned long long rxns);
+#ifdef linux
+static void       recvCmsg(Shard *sh);
+static int        recvUring(int sock, int reader);
+static void       setStamps(int sock);
+static void       drainStamps(Shard *sh);
+static TxStamp    *stampSlot(Shard *sh, unsigned id, unsigned seq);
+static unsigned long long getStamp(Shard *sh, unsigned id, unsigned seq);
+static unsigned long long tsns(struct scm_timestamping *ts);
+static void       *tcpThread(Shard *sh);
+static void       tcpSync(Shard *sh, EchoTable *t, TcpConn ***conns,
+                          unsigned *nconns, int ep);
+static void       tcpOpen(TcpConn *c, unsigned slot, int ep);
+static int        tcpConnected(TcpConn *c, unsigned slot, int ep);
+static void       tcpClose(TcpConn *c, EchoInfo *ei, int ep);
+static void       tcpEvents(TcpConn *c, unsigned slot, int ep,
+                            unsigned events);
+static unsigned   tcpProbe(TcpConn *c, EchoInfo *ei);
+static int        tcpFlush(TcpConn *c, unsigned slot, int ep);
+static int        tcpRead(TcpConn *c);
+#endif
+static EchoTable  *newTable(EchoTable *old, EchoInfo **add, unsigned nadd,
+                             EchoInfo *del);
+static void       freeTable(void *t);
+static void       freeInfo(void *ei);
+static EchoInfo   *lookup(EchoTable *t, unsigned addr, unsigned port);
 static EchoInfo   *findInfo(char *addrstr, char *portstr);
-static EchoInfo   *getInfo(struct sockaddr_in  *fsin);
 static void       showStats(char *what);
+static void       *publishThread(void *arg);
+static void       *sampleThread(void *arg);
+static void       *logThread(void *arg);
+static void       showHistory(char *what);
 static void       printhelp(void);
-static unsigned   subtract_timeval(struct timeval *tv1, struct timeval *tv2);
-static int        up(char *addrstr);
+static void       printLatency(HdrHist *h);
+static void       printBert(unsigned long long bits, unsigned long long errs,
+                            unsigned errored);
+static unsigned   kbps(unsigned long long bytes, time_t secs);
+static int        up(char *addrstr, EchoInfo *ei);
 static int        down(char *addrstr);
 static void       downall(void);
-static int        launch(char *argv[]);
 
 static unsigned timeout = MILLISEC;        /* 1 sec */
 static unsigned loadkpbs = 1024 * 10;  /* 10 mbits/sec  */
 static char     *bind_port = "3333";
+static int      engine = ENGINE_SOCKET;
+static unsigned sendbatch = 64;     /* messages per sendmmsg */
+static unsigned gsosegs = 1;        /* probes per message, >1 uses GSO */
+static unsigned nshards = 1;        /* sender threads, one socket each */
+static int      tstamp = TSTAMP_NONE;
+static char     *ifname = NULL;     /* nic to turn hardware stamping on */
+static char     *sizespec = "1070"; /* -s, 1024 byte payloads */
+static char     *statpath = NULL;   /* -S, stats file to publish in */
+static char     *runpath = NULL;    /* -R, run log to append samples to */
+static unsigned interval = 0;       /* -I, ms per sample, 0 = no sampling */
+static int      bertmode = BERT_NONE;
+static int      usetcp = 0;         /* -P tcp, a stream per endpoint */
+static unsigned overhead = PKTSIZE_OVERHEAD; /* per probe, none on tcp */
+static char     body[BUFSIZE];      /* payload after the head, never changes */
 
 int main(int argc, char *argv[])
 {
    char     hostname[100], prompt[100], rbuf[500], *s;
-   char     addrstr[100], portstr[100];
-   int      i, n, sock;
+   char     addrstr[100], portstr[100], sizestr[100];
+   int      i, n, sock, nfiles = 0;
    Thread   thr;
    FILE     *fp;
    unsigned tout, load;
+   char     **files;
    EchoInfo *ei;
+   PktSize  size;
    struct sockaddr_in sin; /* an Internet endpoint address  */
 
 
-   memset(echoHash, 0, sizeof(echoHash));
-
-   mutex_create(&sendMutex);
-   mutex_create(&recvMutex);
-   cond_create(&sendStart);
+   mutex_create(&echoMutex);
+   echoTable = newTable(NULL, NULL, 0, NULL);
 
+   files = (char **)calloc(argc, sizeof(char *));
    for (i = 1; i < argc; i++) {
       if (strncmp(argv[i], "-h", 2) == 0) {
-         errexit("usage: UDPecho [-p localport] [-t timeout(ms)] [-l load(kbs)] [addressfile ...]\n");
+         errexit("usage: UDPecho [-p localport] [-t timeout(ms)] [-l load(kbs)] [-s size|lo-hi|size:weight,...|imix] [-B prbs23|prbs31] [-P udp|tcp] [-S statsfile] [-R runlog] [-I interval(ms)] [-b batch] [-g segs] [-w senders] [-e socket|uring] [-T sw|hw] [-i ifname] [addressfile ...]\n");
+      }
+#ifdef linux
+      else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "sw") == 0)
+            tstamp = TSTAMP_SW;
+         else if (strcmp(argv[i], "hw") == 0)
+            tstamp = TSTAMP_HW;
+         else
+            printf("Bogus timestamp mode: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+         ifname = argv[++i];
+      }
+      else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "udp") == 0)
+            usetcp = 0;
+         else if (strcmp(argv[i], "tcp") == 0)
+            usetcp = 1;
+         else
+            printf("Bogus protocol: %s\n", argv[i]);
+      }
+#endif
+      else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+         load = strtoul(argv[++i], (char **)NULL, 10);
+         if (load > 0 && load <= MAXSHARDS)
+            nshards = load;
+         else
+            printf("Bogus senders value: %s\n", argv[i]);
+      }
+#ifdef linux
+      else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+         load = strtoul(argv[++i], (char **)NULL, 10);
+         if (load > 0 && load <= MAXSEGS)
+            gsosegs = load;
+         else
+            printf("Bogus segs value: %s\n", argv[i]);
+      }
+#endif
+      else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+         load = strtoul(argv[++i], (char **)NULL, 10);
+         if (load > 0 && load <= MAXBATCH)
+            sendbatch = load;
+         else
+            printf("Bogus batch value: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "socket") == 0)
+            engine = ENGINE_SOCKET;
+#ifdef linux
+         else if (strcmp(argv[i], "uring") == 0)
+            engine = ENGINE_URING;
+#endif
+         else
+            printf("Bogus engine: %s\n", argv[i]);
       }
       else if (strcmp(argv[i], "-t") == 0) {
          tout = strtoul(argv[++i], (char **)NULL, 10);
@@ -92,6 +391,31 @@ int main(int argc, char *argv[])
       else if (strcmp(argv[i], "-p") == 0) {
          bind_port = argv[++i];
       }
+      else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+         sizespec = argv[++i];
+      }
+      else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+         statpath = argv[++i];
+      }
+      else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+         runpath = argv[++i];
+      }
+      else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+         interval = strtoul(argv[++i], (char **)NULL, 10);
+         if (interval == 0 || interval == ULONG_MAX) {
+            printf("Bogus interval: %s\n", argv[i]);
+            interval = 0;
+         }
+      }
+      else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "prbs23") == 0)
+            bertmode = BERT_PRBS23;
+         else if (strcmp(argv[i], "prbs31") == 0)
+            bertmode = BERT_PRBS31;
+         else
+            printf("Bogus BERT pattern: %s\n", argv[i]);
+      }
       else if (strcmp(argv[i], "-l") == 0) {
          load = strtoul(argv[++i], (char **)NULL, 10);
          if (load != ULONG_MAX)
@@ -100,21 +424,134 @@ int main(int argc, char *argv[])
             printf("Bogus load value: %s\n", argv[i]);
       }
       else {
-         fp = fopen(argv[i], "r");
-         if (fp == NULL)
-            errexit("Can't open file %s\n", argv[i]);
-         do {
-            n = fscanf(fp, "%s %s", &addrstr, &portstr);
-            if (n == 2)
-               addEcho(addrstr, portstr);
-         } while (n != EOF);
-         fclose(fp);
-      }
-   }
-   sock = passiveUDP(bind_port);
-   
-   thread_create(&thr, (ThreadRunFunc)sendThread, (void *)sock);
-   thread_create(&thr, (ThreadRunFunc)recvThread, (void *)sock);
+         files[nfiles++] = argv[i];
+      }
+   }
+
+   if (!pktsize_parse(&size, sizespec, HEADSIZE))
+      errexit("Bogus size %s\n", sizespec);
+   if (runpath && interval == 0)
+      interval = MILLISEC;
+
+   /* before any socket or thread, so the helper stays small */
+   if (!provision_start(&prov, PROVISION_JOBS))
+      errexit("Can't start the provisioning helper: %s\n", strerror(errno));
+   thread_create(&thr, (ThreadRunFunc)provisionThread, NULL);
+   if (bertmode) {
+      bert_init();
+      printf("BERT with PRBS-%d, checked with %s\n", bertmode, bert_impl());
+   }
+
+#ifdef linux
+   if (usetcp) {
+      /* byte counts are what the streams carry, the kernel does the rest */
+      if (tstamp || gsosegs > 1 || engine != ENGINE_SOCKET)
+         printf("-T, -g and -e are for udp, ignored with -P tcp\n");
+      tstamp = TSTAMP_NONE;
+      gsosegs = 1;
+      engine = ENGINE_SOCKET;
+      overhead = 0;
+   }
+#endif
+
+   /* every sender gets its own socket on the same port */
+   shards = (Shard *)calloc(nshards, sizeof(Shard));
+   if (shards == NULL)
+      errexit("Can't allocate %d senders\n", nshards);
+   if (!epoch_init(&echoEpoch, 2 * nshards + 2))
+      errexit("Can't allocate epoch readers\n");
+#ifdef linux
+   if (tstamp == TSTAMP_HW) {
+      struct hwtstamp_config  hw;
+      struct ifreq            ifr;
+
+      /* the nic only stamps once it's told to, which needs CAP_NET_ADMIN */
+      memset(&hw, 0, sizeof(hw));
+      hw.tx_type = HWTSTAMP_TX_ON;
+      hw.rx_filter = HWTSTAMP_FILTER_ALL;
+      memset(&ifr, 0, sizeof(ifr));
+      strncpy(ifr.ifr_name, ifname ? ifname : "", IFNAMSIZ - 1);
+      ifr.ifr_data = (char *)&hw;
+      sock = socket(AF_INET, SOCK_DGRAM, 0);
+      if (!ifname || ioctl(sock, SIOCSHWTSTAMP, &ifr) < 0) {
+         printf("No hardware timestamps on %s: %s, using software\n",
+                ifname ? ifname : "(no -i)",
+                ifname ? strerror(errno) : "need an interface");
+         tstamp = TSTAMP_SW;
+      }
+      close(sock);
+   }
+#endif
+   reuseport = nshards > 1;
+   for (i = 0; i < nshards; i++) {
+      shards[i].id = i;
+      shards[i].sock = sock = usetcp ? -1 : passiveUDP(bind_port);
+      shards[i].txreader = epoch_register(&echoEpoch);
+      shards[i].rxreader = epoch_register(&echoEpoch);
+      mutex_create(&shards[i].mutex);
+      cond_create(&shards[i].start);
+#ifdef linux
+      if (tstamp) {
+         shards[i].stamps = (TxStamp *)calloc(TSRING, sizeof(TxStamp));
+         shards[i].keys = (TxKey *)calloc(TSRING, sizeof(TxKey));
+         if (shards[i].stamps == NULL || shards[i].keys == NULL)
+            errexit("Can't allocate timestamp ring\n");
+         setStamps(sock);
+      }
+      if (gsosegs > 1) {
+         /* checks for GSO; the segment size rides on every message */
+         n = BUFSIZE;
+         if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &n, sizeof(n)) < 0) {
+            printf("UDP_SEGMENT not supported: %s\n", strerror(errno));
+            gsosegs = 1;
+         }
+         n = 1;
+         if (engine == ENGINE_SOCKET &&
+             setsockopt(sock, SOL_UDP, UDP_GRO, &n, sizeof(n)) < 0)
+            printf("UDP_GRO not supported: %s\n", strerror(errno));
+      }
+#endif
+   }
+
+   for (i = 0; i < nfiles; i++) {
+      fp = fopen(files[i], "r");
+      if (fp == NULL)
+         errexit("Can't open file %s\n", files[i]);
+      while (fgets(rbuf, sizeof(rbuf), fp)) {
+         n = sscanf(rbuf, "%99s %99s %99s", addrstr, portstr, sizestr);
+         if (n >= 2)
+            addEcho(addrstr, portstr, n == 3 ? sizestr : NULL);
+      }
+      fclose(fp);
+   }
+   free(files);
+
+   for (i = 0; i < nshards; i++) {
+#ifdef linux
+      if (usetcp) {
+         thread_create(&thr, (ThreadRunFunc)tcpThread, &shards[i]);
+         continue;
+      }
+#endif
+      thread_create(&thr, (ThreadRunFunc)sendThread, &shards[i]);
+      thread_create(&thr, (ThreadRunFunc)recvThread, &shards[i]);
+   }
+   if (statpath) {
+      /* a record per endpoint slot, so none past the first STATSEG_RECS
+       * go unpublished; the file is sparse until slots get used */
+      if (!statseg_create(&statSeg, statpath, STATSEG_GENERATOR, "UDPecho2",
+                          (1U << SLOTBITS) + 1))
+         errexit("Can't create stats file %s: %s\n", statpath,
+                 strerror(errno));
+      thread_create(&thr, (ThreadRunFunc)publishThread, NULL);
+   }
+   if (runpath) {
+      if (!runlog_open(&runLog, runpath, "UDPecho2", interval))
+         errexit("Can't create run log %s: %s\n", runpath, strerror(errno));
+      thread_create(&thr, (ThreadRunFunc)logThread, NULL);
+   }
+   if (interval)
+      thread_create(&thr, (ThreadRunFunc)sampleThread, NULL);
 
    /* interactive loop */
    
@@ -134,23 +571,35 @@ int main(int argc, char *argv[])
          if (*s == '\r' || *s == '\n')
             *s = 0;
       
+      /* echoMutex keeps provisionThread from retiring the table */
       if (strcmp(rbuf, "exit") == 0 || strcmp(rbuf, "quit") == 0) {
+         mutex_lock(&echoMutex);
          showStats("all");
+         mutex_unlock(&echoMutex);
          downall();
          exit(0);
       }
       else if (strncmp(rbuf, "stat ", 5) == 0) {
+         mutex_lock(&echoMutex);
          showStats(rbuf + 5);
+         mutex_unlock(&echoMutex);
+      }
+      else if (strncmp(rbuf, "hist ", 5) == 0) {
+         mutex_lock(&echoMutex);
+         showHistory(rbuf + 5);
+         mutex_unlock(&echoMutex);
       }
       else if (strncmp(rbuf, "add ", 4) == 0) {
-         n = sscanf(rbuf + 4, "%s %s", &addrstr, &portstr);
-         if (n == 2)
-            addEcho(addrstr, portstr); 
+         n = sscanf(rbuf + 4, "%99s %99s %99s", addrstr, portstr, sizestr);
+         if (n >= 2)
+            addEcho(addrstr, portstr, n == 3 ? sizestr : NULL);
          else {
             printf("scanned only %d\n", n);
             printhelp();
          }
       }
+      else if (strcmp(rbuf, "pause") == 0 || strcmp(rbuf, "resume") == 0)
+         pauseSend(rbuf[0] == 'p');
       else if (strncmp(rbuf, "del ", 4) == 0) {
          n = sscanf(rbuf + 4, "%s %s", &addrstr, &portstr);
          if (n == 2)
@@ -167,13 +616,11 @@ int main(int argc, char *argv[])
    return 0;
 }
 
-static void addEcho(char *addrstr, char *portstr)
+static void addEcho(char *addrstr, char *portstr, char *sizestr)
 {
-   int            sock;
    unsigned       addr, port;
-   unsigned char  *bp;
-   EchoInfo       *ei, *eio;
-   Thread         thr;
+   PktSize        size;
+   EchoInfo       *ei;
 
    addr = inet_addr(addrstr);
    if (addr == -1) {
@@ -185,42 +632,136 @@ static void addEcho(char *addrstr, char *portstr)
       printf("Totally bogus port %s\n", portstr);
       return;
    }
-
-   up(addrstr);
+   if (!pktsize_parse(&size, sizestr ? sizestr : sizespec, HEADSIZE)) {
+      printf("Bogus size %s\n", sizestr);
+      return;
+   }
 
    ei = (EchoInfo *)malloc(sizeof(EchoInfo));
    memset(ei, 0, sizeof(EchoInfo));
    ei->addr = addr;
    ei->port = port;
+   ei->size = size;
+   ei->rnd = (addr * 0x9e3779b1U) ^ port;
+   hdrhist_init(&ei->rtt);
+   seqwin_init(&ei->win);
+   rto_init(&ei->rto, (unsigned long long)timeout * (NSEC / MILLISEC));
+   if (interval && (ei->track = runlog_track()) == NULL)
+      printf("No memory to sample %s %s\n", addrstr, portstr);
+
+   /* it goes live when its up script is done, see provisionThread */
+   mutex_lock(&echoMutex);
+   if (lookup(echoTable, addr, port) || findPending(addr, port)) {
+      mutex_unlock(&echoMutex);
+      printf("Already sending to %s %s\n", addrstr, portstr);
+      freeInfo(ei);
+      return;
+   }
+   if (npending == maxpending) {
+      maxpending = maxpending ? maxpending * 2 : 256;
+      pending = (EchoInfo **)realloc(pending, maxpending * sizeof(EchoInfo *));
+      if (pending == NULL)
+         errexit("Can't allocate %u pending endpoints\n", maxpending);
+   }
+   pending[npending++] = ei;
+   mutex_unlock(&echoMutex);
+
+   if (!up(addrstr, ei)) {
+      printf("Provisioning helper is gone, adding %s without up\n", addrstr);
+      addEchos(&ei, 1);
+   }
+}
 
-   mutex_lock(&sendMutex);
-   mutex_lock(&recvMutex);
+/*
+ * Puts endpoints whose up script has finished into service, all with
+ * one table swap however many there are.  One no longer pending was
+ * deleted while its script ran and is only freed.
+ */
+static void addEchos(EchoInfo **add, unsigned n)
+{
+   EchoInfo       *ei;
+   EchoTable      *old;
+   Shard          *sh;
+   unsigned       i, j, k;
 
-   ei->start = time(NULL);
-   ei->nextlink = echoList;
-   echoList = ei;
+   mutex_lock(&echoMutex);
+   for (i = k = 0; i < n; i++) {
+      ei = add[i];
+      for (j = 0; j < npending && pending[j] != ei; j++)
+         ;
+      if (j == npending) {
+         freeInfo(ei);
+         continue;
+      }
+      pending[j] = pending[--npending];
+      add[k++] = ei;
+      ei->start = time(NULL);
 
-   bp = (unsigned char *)&addr;
-   eio = echoHash[bp[2]][bp[3]];
-   if (eio) {
-      while (eio->next)
-         eio = eio->next;
-      eio->next = ei;
+      /* least loaded sender gets it */
+      sh = &shards[0];
+      for (j = 1; j < nshards; j++)
+         if (shards[j].count < sh->count)
+            sh = &shards[j];
+      ei->shard = sh->id;
+      __atomic_add_fetch(&sh->count, 1, __ATOMIC_RELAXED);
    }
-   else {
-      echoHash[bp[2]][bp[3]] = ei;
+   if (k == 0) {
+      mutex_unlock(&echoMutex);
+      return;
+   }
+
+   old = echoTable;
+   __atomic_store_n(&echoTable, newTable(old, add, k, NULL),
+                    __ATOMIC_RELEASE);
+   epoch_retire(&echoEpoch, old, freeTable);
+   epoch_reclaim(&echoEpoch);
+
+   for (j = 0; j < nshards; j++) {
+      mutex_lock(&shards[j].mutex);
+      cond_signal(&shards[j].start);
+      mutex_unlock(&shards[j].mutex);
    }
+   mutex_unlock(&echoMutex);
+}
+
+/* an endpoint still waiting for its up script, under echoMutex */
+static EchoInfo *findPending(unsigned addr, unsigned port)
+{
+   unsigned i;
 
-   cond_signal(&sendStart);
-   mutex_unlock(&sendMutex);
-   mutex_unlock(&recvMutex);
+   for (i = 0; i < npending; i++)
+      if (pending[i]->addr == addr && pending[i]->port == port)
+         return pending[i];
+   return NULL;
+}
+
+/*
+ * Takes finished scripts from the helper as they come in; the tag of an
+ * up is its EchoInfo, downs have none.  Traffic to everything already
+ * up keeps going while the rest are provisioned.
+ */
+static void *provisionThread(void *arg)
+{
+   unsigned long  tags[PROVBATCH];
+   int            status[PROVBATCH];
+   EchoInfo       *add[PROVBATCH];
+   int            i, n, k;
+
+   while ((n = provision_done(&prov, tags, status, PROVBATCH)) > 0) {
+      for (i = k = 0; i < n; i++)
+         if (tags[i])
+            add[k++] = (EchoInfo *)tags[i];
+      if (k)
+         addEchos(add, k);
+   }
+   return NULL;
 }
 
 static void delEcho(char *addrstr, char *portstr)
 {
-   unsigned       addr, port;
-   unsigned char  *bp;
-   EchoInfo       *ei, *eio;
+   unsigned       addr, port, i;
+   EchoInfo       *ei;
+   EchoTable      *old;
 
    addr = inet_addr(addrstr);
    if (addr == -1) {
@@ -233,178 +774,1088 @@ static void delEcho(char *addrstr, char *portstr)
       return;
    }
 
-   mutex_lock(&sendMutex);
-   mutex_lock(&recvMutex);
-   
-   bp = (unsigned char *)&addr;
-   ei = echoHash[bp[2]][bp[3]];
+   mutex_lock(&echoMutex);
+   ei = lookup(echoTable, addr, port);
+   if (!ei && (ei = findPending(addr, port)) != NULL) {
+      /* its up script is still running: addEchos frees it when done */
+      for (i = 0; pending[i] != ei; i++)
+         ;
+      pending[i] = pending[--npending];
+      mutex_unlock(&echoMutex);
+      down(addrstr);
+      return;
+   }
    if (!ei) {
-      printf("Can't find %s %s\n", addrstr, addrstr);
+      mutex_unlock(&echoMutex);
+      printf("Can't find %s %s\n", addrstr, portstr);
       return;
    }
-   if (ei->addr == addr && ei->port == port) {
-      echoHash[bp[2]][bp[3]] = NULL;
+
+   /* senders and receivers may be using either until the grace period */
+   __atomic_sub_fetch(&shards[ei->shard].count, 1, __ATOMIC_RELAXED);
+   old = echoTable;
+   __atomic_store_n(&echoTable, newTable(old, NULL, 0, ei), __ATOMIC_RELEASE);
+   epoch_retire(&echoEpoch, old, freeTable);
+   epoch_retire(&echoEpoch, ei, freeInfo);
+   epoch_reclaim(&echoEpoch);
+   mutex_unlock(&echoMutex);
+
+   down(addrstr);
+}
+
+/*
+ * "pause" holds every sender where it would wait for an endpoint, so the
+ * probes in flight can come back and be counted before the totals are
+ * read; "resume" lets them go again at their old rates.
+ */
+static void pauseSend(int on)
+{
+   int   i;
+
+   __atomic_store_n(&paused, on, __ATOMIC_RELAXED);
+   for (i = 0; !on && i < nshards; i++) {
+      mutex_lock(&shards[i].mutex);
+      cond_signal(&shards[i].start);
+      mutex_unlock(&shards[i].mutex);
    }
-   else {
-      int found = 0;
-      while(ei->next) {
-         eio = ei;
-         ei = ei->next;
-         if (ei->addr == addr && ei->port == port) {
-            eio->next = ei->next;
-            found = 1;
-            break;
+}
+
+/*
+ * Copy of 'old' (NULL for an empty table) with the 'nadd' endpoints in
+ * 'add' put in front and/or 'del' left out, indexed for lookup.  Ids keep
+ * their slots from one version to the next; each added endpoint takes the
+ * first free one and gets a new tag, so a late probe to a deleted
+ * endpoint can't land on its successor.  Only ever called by the writer.
+ */
+static EchoTable *newTable(EchoTable *old, EchoInfo **add, unsigned nadd,
+                           EchoInfo *del)
+{
+   EchoTable   *t;
+   EchoInfo    *ei;
+   unsigned    i, h, n, slot, size = 64;
+
+   n = (old ? old->count : 0) + nadd + 1;
+   while (size < n * 2)
+      size <<= 1;
+   t = (EchoTable *)calloc(1, sizeof(EchoTable));
+   if (t == NULL ||
+       (t->list = (EchoInfo **)calloc(n, sizeof(EchoInfo *))) == NULL ||
+       (t->index = (EchoInfo **)calloc(size, sizeof(EchoInfo *))) == NULL)
+      errexit("Can't allocate a table for %d endpoints\n", n);
+   t->mask = size - 1;
+   t->version = old ? old->version + 1 : 0;
+
+   t->nids = (old ? old->nids : 0) + nadd + 1;
+   t->byid = (EchoInfo **)calloc(t->nids, sizeof(EchoInfo *));
+   if (t->byid == NULL)
+      errexit("Can't allocate a table for %d endpoints\n", n);
+   if (old)
+      memcpy(t->byid, old->byid, old->nids * sizeof(EchoInfo *));
+   if (del)
+      t->byid[del->id & SLOTMASK] = NULL;
+   for (i = slot = 0; i < nadd; i++) {
+      while (t->byid[slot])
+         slot++;
+      if (slot > SLOTMASK)
+         errexit("More than %u endpoints\n", SLOTMASK + 1);
+      add[i]->id = slot | (++idtag << SLOTBITS);
+      t->byid[slot] = add[i];
+   }
+   while (t->nids > 1 && t->byid[t->nids - 1] == NULL)
+      t->nids--;
+
+   for (i = nadd; i > 0; i--)
+      t->list[t->count++] = add[i - 1];
+   for (i = 0; old && i < old->count; i++)
+      if (old->list[i] != del)
+         t->list[t->count++] = old->list[i];
+
+   for (i = 0; i < t->count; i++) {
+      ei = t->list[i];
+      h = addrstat_hash(ei->addr, ei->port);
+      while (t->index[h & t->mask])
+         h++;
+      t->index[h & t->mask] = ei;
+   }
+   return t;
+}
+
+static void freeTable(void *p)
+{
+   EchoTable   *t = (EchoTable *)p;
+
+   free(t->list);
+   free(t->index);
+   free(t->byid);
+   free(t);
+}
+
+static void freeInfo(void *p)
+{
+   EchoInfo    *ei = (EchoInfo *)p;
+
+   free(ei->track);
+   free(ei);
+}
+
+static EchoInfo *lookup(EchoTable *t, unsigned addr, unsigned port)
+{
+   EchoInfo    *ei;
+   unsigned    h = addrstat_hash(addr, port);
+
+   for (; (ei = t->index[h & t->mask]) != NULL; h++)
+      if (ei->addr == addr && ei->port == port)
+         return ei;
+   return NULL;
+}
+
+static void *sendThread(Shard *sh)
+{
+   unsigned long long   now;
+   unsigned             k;
+   int                  i, j, n, chunk;
+   Pacer                pacer;
+   SendVec              sv;
+   ProbeHead            *head;
+   EchoTable            *t;
+   unsigned             bits;
+#ifdef linux
+   Uring                u;
+   struct io_uring_cqe  *cqe;
+   int                  useUring = 0;
+   unsigned             inflight = 0;
+#endif
+   int                  sock = sh->sock;
+
+   memset(&sv, 0, sizeof(sv));
+   sv.gen = ~0U;
+   if (nshards > 1)
+      thread_bindcpu(sh->id);
+
+#ifdef linux
+   if (engine == ENGINE_URING && tstamp)
+      printf("io_uring sends can't be matched to their timestamps, "
+             "sending with sockets\n");
+   else if (engine == ENGINE_URING) {
+      useUring = uring_init(&u, URINGSLOTS);
+      if (!useUring)
+         printf("io_uring not available, sending with sockets\n");
+   }
+#endif
+
+   pacer_init(&pacer, 0);
+
+   while (1) {
+      if (__atomic_load_n(&sh->count, __ATOMIC_RELAXED) == 0 ||
+          __atomic_load_n(&paused, __ATOMIC_RELAXED)) {
+         sh->rate = 0;
+         mutex_lock(&sh->mutex);
+         while (__atomic_load_n(&sh->count, __ATOMIC_RELAXED) == 0 ||
+                __atomic_load_n(&paused, __ATOMIC_RELAXED))
+            cond_wait(&sh->start, &sh->mutex);
+         mutex_unlock(&sh->mutex);
+         sv.gen = ~0U;     /* works out the rate again */
+      }
+
+      /* the table and every EchoInfo in it stay put until we exit */
+      epoch_enter(&echoEpoch, sh->txreader);
+      t = __atomic_load_n(&echoTable, __ATOMIC_ACQUIRE);
+      if (sv.gen != t->version) {
+#ifdef linux
+         /* the kernel may still be reading the old vectors */
+         while (useUring && inflight) {
+            uring_submit(&u, 1);
+            while ((cqe = uring_cqe(&u)) != NULL) {
+               inflight--;
+               uring_cqe_seen(&u);
+            }
+         }
+#endif
+         buildSendVec(sh, t, &sv);
+         if (sh->rate != pacer.rate)
+            pacer_setrate(&pacer, sh->rate);
+      }
+
+      for (i = 0; i < sv.count; i += chunk) {
+         /*
+          * Send as big a slice as fits in one pacing spin, so sendmmsg
+          * batches at high rates without turning into microbursts.
+          */
+         chunk = sendbatch;
+         if (pacer.rate) {
+            n = (int)(pacer.rate * PACER_SPIN / NSEC /
+                      (sv.meanbits * gsosegs));
+            if (n < chunk)
+               chunk = n > 0 ? n : 1;
+         }
+         if (chunk > sv.count - i)
+            chunk = sv.count - i;
+
+#ifdef linux
+         /* io_uring: flush before a gap and wait out heads still in use */
+         if (useUring && inflight && pacer_due(&pacer))
+            uring_submit(&u, 0);
+         for (j = i; useUring && j < i + chunk; j++) {
+            while (sv.inflight[j]) {
+               while ((cqe = uring_cqe(&u)) != NULL) {
+                  sv.inflight[cqe->user_data] = 0;
+                  inflight--;
+                  uring_cqe_seen(&u);
+               }
+               if (sv.inflight[j])
+                  uring_submit(&u, 1);
+            }
+         }
+#endif
+         for (bits = 0, j = i; j < i + chunk; j++)
+            bits += fillProbes(&sv, j);
+         pacer_wait(&pacer, bits);
+
+         now = nsclock_now();
+         for (j = i; j < i + chunk; j++) {
+            head = sv.heads + j * gsosegs;
+            for (k = 0; k < sv.nsegs[j]; k++, head++) {
+               head->txns = now;
+               probe_seal(head);
+            }
+         }
+
+#ifdef linux
+         if (useUring) {
+            for (j = i; j < i + chunk; j++) {
+               uring_sendmsg(&u, sock, &sv.msgs[j].msg_hdr, j);
+               sv.inflight[j] = 1;
+            }
+            inflight += chunk;
+            uring_submit(&u, 0);
+            continue;
          }
+#endif
+         sendBatch(sh, sv.msgs + i, chunk);
+#ifdef linux
+         if (tstamp)
+            drainStamps(sh);
+#endif
+      }
+
+      epoch_exit(&echoEpoch, sh->txreader);
+   }
+   printf("... exiting send thread\n");
+}
+
+/*
+ * Rebuilds the sweep vectors from the shard's part of table t and works
+ * out its share of the load.
+ */
+static void buildSendVec(Shard *sh, EchoTable *t, SendVec *sv)
+{
+   EchoInfo *ei;
+   int      i, k, n = 0;
+   unsigned p, e, mean = 0;
+#ifdef linux
+   struct cmsghdr *cm;
+#endif
+
+   for (e = 0; e < t->count; e++)
+      if (t->list[e]->shard == sh->id) {
+         mean += t->list[e]->size.mean;
+         n++;
+      }
+   sh->rate = t->count ? (unsigned long long)loadkpbs * 1000 * n / t->count : 0;
+
+   free(sv->eps);
+   free(sv->msgs);
+   free(sv->iovs);
+   free(sv->addrs);
+   free(sv->heads);
+   free(sv->bodies);
+   free(sv->ctls);
+   free(sv->nsegs);
+   free(sv->inflight);
+   sv->eps = (EchoInfo **)calloc(n + 1, sizeof(EchoInfo *));
+   sv->msgs = (struct mmsghdr *)calloc(n + 1, sizeof(struct mmsghdr));
+   sv->iovs = (struct iovec *)calloc(2 * (n + 1) * gsosegs,
+                                     sizeof(struct iovec));
+   sv->addrs = (struct sockaddr_in *)calloc(n + 1, sizeof(struct sockaddr_in));
+   sv->heads = (ProbeHead *)calloc((n + 1) * gsosegs, HEADSIZE);
+   sv->bodies = NULL;
+   if (bertmode &&
+       (sv->bodies = (unsigned char *)malloc((size_t)(n + 1) * gsosegs *
+                                             BUFSIZE)) == NULL)
+      errexit("Can't allocate BERT payloads for %d endpoints\n", n);
+   sv->ctls = (char *)calloc(n + 1, CTLSIZE);
+   sv->nsegs = (unsigned char *)calloc(n + 1, 1);
+   sv->inflight = (unsigned char *)calloc(n + 1, 1);
+   if (!sv->eps || !sv->msgs || !sv->iovs || !sv->addrs || !sv->heads ||
+       !sv->ctls || !sv->nsegs || !sv->inflight)
+      errexit("Can't allocate send vectors for %d endpoints\n", n);
+
+   for (i = 0, e = 0; e < t->count; e++) {
+      ei = t->list[e];
+      if (ei->shard != sh->id)
+         continue;
+      sv->eps[i] = ei;
+      sv->addrs[i].sin_family = AF_INET;
+      sv->addrs[i].sin_addr.s_addr = ei->addr;
+      sv->addrs[i].sin_port = htons(ei->port);
+      for (k = 0; k < gsosegs; k++) {
+         p = i * gsosegs + k;
+         probe_init(&sv->heads[p], ei->id, HEADSIZE,
+                    (tstamp ? PROBE_KTX : 0) |
+                    (bertmode == BERT_PRBS23 ? PROBE_PRBS23 : 0) |
+                    (bertmode == BERT_PRBS31 ? PROBE_PRBS31 : 0));
+         sv->iovs[2 * p].iov_base = &sv->heads[p];
+         sv->iovs[2 * p].iov_len = HEADSIZE;
+         sv->iovs[2 * p + 1].iov_base = bertmode ?
+            sv->bodies + (size_t)p * BUFSIZE : (unsigned char *)body;
+      }
+      sv->msgs[i].msg_hdr.msg_name = &sv->addrs[i];
+      sv->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      sv->msgs[i].msg_hdr.msg_iov = &sv->iovs[2 * i * gsosegs];
+#ifdef linux
+      if (gsosegs > 1) {
+         sv->msgs[i].msg_hdr.msg_control = sv->ctls + i * CTLSIZE;
+         sv->msgs[i].msg_hdr.msg_controllen = CTLSIZE;
+         cm = CMSG_FIRSTHDR(&sv->msgs[i].msg_hdr);
+         cm->cmsg_level = SOL_UDP;
+         cm->cmsg_type = UDP_SEGMENT;
+         cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+      }
+#endif
+      i++;
+   }
+   sv->count = n;
+   sv->meanbits = n ? mean / n * 8 : 8 * PKTSIZE_MAXFRAME;
+   sv->gen = t->version;
+}
+
+/*
+ * Draws the size of the next probes to endpoint j and fits message j to
+ * it: with -g as many probes of that size as make one train, else one.
+ * Numbers them, and with -B fills their bodies with the PRBS their id
+ * and sequence select.  Counts them as sent and returns their bits on
+ * the wire, for the pacer.  Only the send time is left to stamp.
+ */
+static unsigned fillProbes(SendVec *sv, int j)
+{
+   EchoInfo       *ei = sv->eps[j];
+   ProbeHead      *head = sv->heads + j * gsosegs;
+   struct iovec   *iov = sv->iovs + 2 * j * gsosegs;
+   unsigned       size, segs = gsosegs, k;
+
+   size = pktsize_next(&ei->size, &ei->rnd);
+   if (segs > MAXTRAIN / size)
+      segs = MAXTRAIN / size;
+   for (k = 0; k < segs; k++) {
+      head[k].len = (unsigned short)size;
+      head[k].seq = ++ei->txseq;
+      iov[2 * k + 1].iov_len = size - HEADSIZE;
+      if (bertmode)
+         bert_fill(bertmode, bert_seed(bertmode, ei->id, head[k].seq),
+                   (unsigned char *)iov[2 * k + 1].iov_base, size - HEADSIZE);
+   }
+   sv->msgs[j].msg_hdr.msg_iovlen = 2 * segs;
+#ifdef linux
+   if (gsosegs > 1)
+      *(unsigned short *)CMSG_DATA(CMSG_FIRSTHDR(&sv->msgs[j].msg_hdr)) =
+         (unsigned short)size;
+#endif
+   sv->nsegs[j] = (unsigned char)segs;
+   ei->sent += segs;
+   ei->sentbytes += (unsigned long long)segs * (size + overhead);
+   return segs * (size + overhead) * 8;
+}
+
+/*
+ * Sends n prebuilt messages, one sendmmsg per call where the system has
+ * it.  A message that fails is skipped, like a failed sendto would be.
+ * With -T each message is entered under the key the kernel will give its
+ * stamp; only the ones sent use up a key, so a failed one is overwritten
+ * by those after it.
+ */
+static void sendBatch(Shard *sh, struct mmsghdr *msgs, int n)
+{
+   int   done = 0, ret, k;
+#ifdef linux
+   ProbeHead   *head;
+   TxKey       *e;
+
+   while (done < n) {
+      for (k = done; sh->keys && k < n; k++) {
+         head = (ProbeHead *)msgs[k].msg_hdr.msg_iov[0].iov_base;
+         e = &sh->keys[(sh->txkey + k - done) & (TSRING - 1)];
+         __atomic_store_n(&e->key, ~0U, __ATOMIC_RELAXED);
+         __atomic_thread_fence(__ATOMIC_RELEASE);
+         __atomic_store_n(&e->id, head->id, __ATOMIC_RELAXED);
+         __atomic_store_n(&e->seq, head->seq, __ATOMIC_RELAXED);
+         __atomic_store_n(&e->count, msgs[k].msg_hdr.msg_iovlen / 2,
+                          __ATOMIC_RELAXED);
+         __atomic_store_n(&e->key, sh->txkey + k - done, __ATOMIC_RELEASE);
+      }
+      ret = sendmmsg(sh->sock, msgs + done, n - done, 0);
+      if (ret < 0) {
+         if (errno == EINTR)
+            continue;
+         done++;
+         continue;
+      }
+      sh->txkey += ret;
+      done += ret;
+   }
+#else
+   for (; done < n; done++)
+      sendmsg(sh->sock, &msgs[done].msg_hdr, 0);
+#endif
+}
+
+static void *recvThread(Shard *sh)
+{
+   char                 buf[BUFSIZE];
+   int                  n;
+	struct sockaddr_in   fsin;	   /* the request from address	*/
+	int                  alen;    /* from-address length		*/
+   int                  sock = sh->sock;
+
+#ifdef linux
+   if (engine == ENGINE_URING && tstamp)
+      printf("io_uring receives carry no timestamps, using sockets\n");
+   else if (engine == ENGINE_URING && !recvUring(sock, sh->rxreader))
+      printf("io_uring not available, receiving with sockets\n");
+   if (gsosegs > 1 || tstamp)
+      recvCmsg(sh);
+#endif
+
+   while (1) {
+      alen = sizeof(fsin);
+      n = recvfrom(sock, buf, BUFSIZE, 0, (struct sockaddr *)&fsin, &alen);
+      if (n < 0) {
+         printf("Error reading sock for %s\n", inet_ntoa(fsin.sin_addr));
+         continue;
       }
-      if (!found) {
-         printf("Can't find %s %s\n", addrstr, addrstr);
+      epoch_enter(&echoEpoch, sh->rxreader);
+      gotProbe(buf, n, 0);
+      epoch_exit(&echoEpoch, sh->rxreader);
+   }
+}
+
+/*
+ * Accounts one echoed probe to the endpoint whose id it carries.  Called
+ * inside a read side section.  Anything that isn't an intact probe for an
+ * endpoint in the current table is counted and dropped.  Replies from one
+ * endpoint always land on the same socket, so each EchoInfo has a single
+ * receiver updating it.  With -T, rxns is the kernel's receive stamp and
+ * the round trip is taken against the kernel's transmit stamp instead of
+ * the one in the probe.  A BERT probe has its whole body checked against
+ * the pattern it was sent with.  Every round trip also feeds the
+ * endpoint's timeout, after which the window gives up on missing probes.
+ */
+static void gotProbe(char *buf, int n, unsigned long long rxns)
+{
+   unsigned long long   sent, now, errs;
+   int                  prbs;
+   ProbeHead            ph;
+   EchoTable            *t;
+   EchoInfo             *ei;
+
+   t = __atomic_load_n(&echoTable, __ATOMIC_ACQUIRE);
+   if (!probe_parse(buf, n, &ph) || (ph.id & SLOTMASK) >= t->nids ||
+       (ei = t->byid[ph.id & SLOTMASK]) == NULL || ei->id != ph.id) {
+      __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   seqwin_add(&ei->win, ph.seq);
+   ei->rcvd++;
+   ei->rcvdbytes += n + overhead;
+   if (ph.flags & (PROBE_PRBS23 | PROBE_PRBS31)) {
+      prbs = ph.flags & PROBE_PRBS23 ? BERT_PRBS23 : BERT_PRBS31;
+      errs = bert_check(prbs, bert_seed(prbs, ph.id, ph.seq),
+                        (unsigned char *)buf + HEADSIZE, n - HEADSIZE);
+      ei->bertbits += (unsigned long long)(n - HEADSIZE) * 8;
+      ei->biterrs += errs;
+      if (errs)
+         ei->errored++;
+   }
+   sent = ph.txns;
+   now = nsclock_now();
+#ifdef linux
+   if (ph.flags & PROBE_KTX) {
+      /* the stamp may still be sitting on the sender's error queue */
+      sent = getStamp(&shards[ei->shard], ei->id, ph.seq);
+      if (!sent) {
+         drainStamps(&shards[ei->shard]);
+         sent = getStamp(&shards[ei->shard], ei->id, ph.seq);
+      }
+      now = rxns;
+      if (!sent || now <= sent) {
+         ei->untimed++;
          return;
       }
    }
-   /* fix up the links */
-   if (ei == echoList) {
-      echoList = echoList->nextlink;
-      free(ei);
+#endif
+   hdrhist_record(&ei->rtt, now - sent);
+   rto_sample(&ei->rto, now - sent);
+   seqwin_age(&ei->win, ph.seq, sent, now, ei->rto.rto);
+}
+
+#ifdef linux
+/*
+ * recvmsg based receive loop, for when the socket hands us more than the
+ * datagram.  With -g the socket has UDP_GRO set, so echoes from one
+ * endpoint can arrive as a single train of equal sized datagrams (the
+ * last one may be shorter), and each one in the train is accounted as its
+ * own probe.  With -T every datagram
+ * carries the kernel's receive timestamp.
+ */
+static void recvCmsg(Shard *sh)
+{
+   char                 *buf;
+   char                 ctl[256];
+   struct sockaddr_in   fsin;
+   struct msghdr        msg;
+   struct iovec         iov;
+   struct cmsghdr       *cm;
+   struct scm_timestamping *ts;
+   unsigned long long   rxns;
+   int                  n, seg, off;
+
+   buf = (char *)malloc(GROSIZE);
+   if (buf == NULL)
+      errexit("Can't allocate a receive buffer\n");
+
+   while (1) {
+      iov.iov_base = buf;
+      iov.iov_len = GROSIZE;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &fsin;
+      msg.msg_namelen = sizeof(fsin);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = ctl;
+      msg.msg_controllen = sizeof(ctl);
+      n = recvmsg(sh->sock, &msg, 0);
+      if (n < 0) {
+         if (errno != EINTR)
+            printf("Error reading sock: %s\n", strerror(errno));
+         continue;
+      }
+
+      seg = n;
+      rxns = 0;
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+         if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            seg = *(int *)CMSG_DATA(cm);
+         else if (cm->cmsg_level == SOL_SOCKET &&
+                  cm->cmsg_type == SCM_TIMESTAMPING) {
+            ts = (struct scm_timestamping *)CMSG_DATA(cm);
+            rxns = tsns(ts);
+         }
+      }
+      epoch_enter(&echoEpoch, sh->rxreader);
+      for (off = 0; seg > 0 && off < n; off += seg)
+         gotProbe(buf + off, n - off < seg ? n - off : seg, rxns);
+      epoch_exit(&echoEpoch, sh->rxreader);
    }
-   else {
-      for (eio = echoList; eio; eio = eio->nextlink) {
-         if (eio->nextlink == ei) {
-            eio->nextlink = ei->nextlink;
-            free(ei);
+}
+
+/* the stamp -T asked for, ts[0] is software and ts[2] raw hardware */
+static unsigned long long tsns(struct scm_timestamping *ts)
+{
+   struct timespec *t = &ts->ts[tstamp == TSTAMP_HW ? 2 : 0];
+
+   return (unsigned long long)t->tv_sec * NSEC + t->tv_nsec;
+}
+
+static void setStamps(int sock)
+{
+   int   flags;
+
+   if (tstamp == TSTAMP_HW)
+      flags = SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+              SOF_TIMESTAMPING_RAW_HARDWARE;
+   else
+      flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+              SOF_TIMESTAMPING_SOFTWARE;
+   /* a message number per stamp rather than a copy of the packet */
+   flags |= SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+   if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+      errexit("SO_TIMESTAMPING: %s\n", strerror(errno));
+}
+
+/*
+ * Moves every tx timestamp waiting on the sender's error queue into its
+ * ring.  Each comes with the key of the message it stamps, which
+ * sendBatch entered with the probes that message carried; a GSO train
+ * gets one stamp for all of them.  The sender calls this after every
+ * batch so the queue never fills the socket's receive buffer, and a
+ * receive thread that finds a stamp missing may call it too.
+ */
+static void drainStamps(Shard *sh)
+{
+   char                 ctl[256];
+   struct msghdr        msg;
+   struct cmsghdr       *cm;
+   struct sock_extended_err *ee;
+   unsigned long long   ns;
+   unsigned             key, id, seq, count, k;
+   TxKey                *t;
+   TxStamp              *e;
+   int                  n, haskey;
+
+   while (1) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = ctl;
+      msg.msg_controllen = sizeof(ctl);
+      n = recvmsg(sh->sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+      if (n < 0)
+         return;
+
+      ns = 0;
+      key = 0;
+      haskey = 0;
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+         if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+            ns = tsns((struct scm_timestamping *)CMSG_DATA(cm));
+         else if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) {
+            ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+               key = ee->ee_data;
+               haskey = 1;
+            }
          }
       }
+      if (ns == 0 || !haskey)
+         continue;
+
+      t = &sh->keys[key & (TSRING - 1)];
+      if (__atomic_load_n(&t->key, __ATOMIC_ACQUIRE) != key)
+         continue;
+      id = __atomic_load_n(&t->id, __ATOMIC_RELAXED);
+      seq = __atomic_load_n(&t->seq, __ATOMIC_RELAXED);
+      count = __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&t->key, __ATOMIC_RELAXED) != key)
+         continue;
+
+      for (k = 0; k < count; k++, seq++) {
+         e = stampSlot(sh, id, seq);
+         __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+         __atomic_thread_fence(__ATOMIC_RELEASE);
+         __atomic_store_n(&e->id, id, __ATOMIC_RELAXED);
+         __atomic_store_n(&e->ns, ns, __ATOMIC_RELAXED);
+         __atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
+      }
    }
-   mutex_unlock(&sendMutex);
-   mutex_unlock(&recvMutex);
+}
 
-   down(addrstr);
+/* consecutive probes to one endpoint land in consecutive slots */
+static TxStamp *stampSlot(Shard *sh, unsigned id, unsigned seq)
+{
+   return &sh->stamps[(id * 0x9e3779b1U + seq) & (TSRING - 1)];
 }
 
-static void *sendThread(int sock)
+/* tx timestamp of probe seq to endpoint id, 0 if we don't have it (yet) */
+static unsigned long long getStamp(Shard *sh, unsigned id, unsigned seq)
 {
-   char                 buf[BUFSIZE];
-   struct timeval       tv;
-   struct timezone      tz;
-	struct sockaddr_in   toaddr;
-   unsigned             seq = 0, *uptr, rttime;
-   int                  ret, n;
-   unsigned             start, ltime, wtime, packets;
-   struct timespec      waittime;
-   EchoInfo             *ei;
-   
-   uptr = (unsigned *)buf;
+   TxStamp              *e = stampSlot(sh, id, seq);
+   unsigned long long   ns;
+   unsigned             eid;
 
-   mutex_lock(&sendMutex);
-   if (!echoList)
-      cond_wait(&sendStart, &sendMutex);
-   start = time(NULL);
-   packets = 0;
+   if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq)
+      return 0;
+   eid = __atomic_load_n(&e->id, __ATOMIC_RELAXED);
+   ns = __atomic_load_n(&e->ns, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq || eid != id)
+      return 0;
+   return ns;
+}
+
+/*
+ * io_uring receive loop: a multishot recvmsg keeps filling registered
+ * provided buffers, and each buffer goes straight back to the kernel once
+ * the probe in it is accounted.  Returns 0 only if io_uring is missing.
+ */
+static int recvUring(int sock, int reader)
+{
+   Uring                      u;
+   struct io_uring_cqe        *cqe;
+   struct io_uring_recvmsg_out *out;
+   struct msghdr              tmpl;
+   unsigned                   bid, flags;
+   int                        res, rearm;
+   char                       *rbuf;
+
+   if (!uring_init(&u, 256))
+      return 0;
+   if (!uring_bufring(&u, URINGBUFS, sizeof(struct io_uring_recvmsg_out) +
+                      sizeof(struct sockaddr_in) + BUFSIZE, 1)) {
+      uring_exit(&u);
+      return 0;
+   }
+
+   memset(&tmpl, 0, sizeof(tmpl));
+   tmpl.msg_namelen = sizeof(struct sockaddr_in);
+   uring_recvmsg_multi(&u, sock, &tmpl, URINGTAG);
 
    while (1) {
-      for (ei = echoList; ei; ei = ei->nextlink) {
-         *uptr = ++seq;
-         gettimeofday(&tv, &tz);
-         memcpy(uptr + 1, &tv, sizeof(struct timeval));
-         toaddr.sin_addr.s_addr = ei->addr;
-         toaddr.sin_port = htons(ei->port);
-         toaddr.sin_family = AF_INET;
-         sendto(sock, buf, BUFSIZE, 0,
-                (struct sockaddr *)&toaddr, sizeof(toaddr));
-         ei->sent++;
-      }
-      packets++;
-      mutex_unlock(&sendMutex);
-      
-      ltime = time(NULL) - start;
-      if (ltime == 0)
-         ltime = 1;  /* force a compare */
-      if (((packets * 8) / ltime) > loadkpbs) {
-         wtime = ((packets * 8) / loadkpbs) - ltime;
-         if (wtime > 0) {
-            /* printf("waiting for %d seconds ... sent %d\n", wtime, packets);
-             */
-            sleep(wtime);
-            /* printf("done waiting\n", wtime);
-             */
+      uring_submit(&u, 1);
+      rearm = 0;
+      epoch_enter(&echoEpoch, reader);
+      while ((cqe = uring_cqe(&u)) != NULL) {
+         res = cqe->res;
+         flags = cqe->flags;
+         uring_cqe_seen(&u);
+         if (!(flags & IORING_CQE_F_MORE))
+            rearm = 1;
+         if (res < 0 || !(flags & IORING_CQE_F_BUFFER)) {
+            if (res < 0 && res != -ENOBUFS && res != -EINTR)
+               printf("io_uring recvmsg: %s\n", strerror(-res));
+            continue;
          }
+         bid = flags >> IORING_CQE_BUFFER_SHIFT;
+         out = (struct io_uring_recvmsg_out *)uring_buf(&u, bid);
+         rbuf = (char *)(out + 1) + tmpl.msg_namelen;
+         gotProbe(rbuf, out->payloadlen, 0);
+         uring_buf_recycle(&u, bid);
       }
-      mutex_lock(&sendMutex);
+      epoch_exit(&echoEpoch, reader);
+      if (rearm)
+         uring_recvmsg_multi(&u, sock, &tmpl, URINGTAG);
    }
-   printf("... exiting send thread\n");
+   return 1;
 }
-      
-static void *recvThread(int sock)
+
+/*
+ * TCP load: one epoll loop per sender instead of a send and a receive
+ * thread.  Each endpoint of the sender gets a nonblocking connection that
+ * carries a stream of probes, framed by the 'len' in their heads, and the
+ * reflector streams them back.  Writes are paced on the sender's share of
+ * -l like datagrams are; a connection whose socket buffer is full just
+ * sits out until epoll says it drained.  Connections are indexed by
+ * endpoint slot and hold only the endpoint's id, so the table can change
+ * under the loop between epoch sections.
+ */
+static void *tcpThread(Shard *sh)
 {
-   char                 buf[BUFSIZE];
-   struct timeval       tv, stv;
-   struct timezone      tz;
-   unsigned             *uptr, rttime;
-   int                  ret, n;
-   unsigned             ltime, wtime;
-	struct sockaddr_in   fsin;	   /* the request from address	*/
-	int                  alen;    /* from-address length		*/
+   struct epoll_event   ev[TCPEVENTS];
+   TcpConn              **conns = NULL, *c;
+   EchoTable            *t;
    EchoInfo             *ei;
-   
-   uptr = (unsigned *)buf;
+   Pacer                pacer;
+   unsigned             nconns = 0, gen = ~0U, next = 0, tried, sent, s;
+   unsigned long long   due, now;
+   int                  ep, i, n, wait;
+
+   if (nshards > 1)
+      thread_bindcpu(sh->id);
+   ep = epoll_create1(0);
+   if (ep < 0)
+      errexit("epoll_create1: %s\n", strerror(errno));
+   pacer_init(&pacer, 0);
 
    while (1) {
-      n = 0;
-      while (n < BUFSIZE) {
-         alen = sizeof(fsin);
-         ret = recvfrom(sock, buf + n, BUFSIZE - n, 0,
-                        (struct sockaddr *)&fsin, &alen);
-         if (ret < 0) {
-            printf("Error reading sock for %s\n", inet_ntoa(fsin.sin_addr));
-            break;
+      epoch_enter(&echoEpoch, sh->txreader);
+      t = __atomic_load_n(&echoTable, __ATOMIC_ACQUIRE);
+      if (gen != t->version) {
+         tcpSync(sh, t, &conns, &nconns, ep);
+         if (sh->rate != pacer.rate)
+            pacer_setrate(&pacer, sh->rate);
+         gen = t->version;
+      }
+      if (__atomic_load_n(&sh->count, __ATOMIC_RELAXED) == 0) {
+         epoch_exit(&echoEpoch, sh->txreader);
+         sh->rate = 0;
+         mutex_lock(&sh->mutex);
+         while (__atomic_load_n(&sh->count, __ATOMIC_RELAXED) == 0)
+            cond_wait(&sh->start, &sh->mutex);
+         mutex_unlock(&sh->mutex);
+         continue;
+      }
+
+      /* one probe per connection that can take one, while the pacer lets */
+      now = nsclock_now();
+      for (tried = sent = 0; tried < nconns && !pacer_due(&pacer) &&
+           !__atomic_load_n(&paused, __ATOMIC_RELAXED); tried++) {
+         s = next++ % nconns;
+         if ((c = conns[s]) == NULL)
+            continue;
+         if (c->sock < 0) {
+            if (now >= c->retry)
+               tcpOpen(c, s, ep);
+            continue;
          }
-         n += ret;
+         if (!c->connected || c->woff < c->wlen)
+            continue;
+         pacer_wait(&pacer, tcpProbe(c, t->byid[s]) * 8);
+         if (!tcpFlush(c, s, ep))
+            tcpClose(c, t->byid[s], ep);
+         sent++;
       }
-      if (n == BUFSIZE) {
-         mutex_lock(&recvMutex);
-         ei = getInfo(&fsin);
-         if (ei) {
-            if (ei->seq == 0) {
-               ei->seq = *uptr;
-            }
-            else {
-               if (*uptr != (ei->seq + 1))
-                  ei->outOfseq++;
-               ei->seq = *uptr;
-            }
-            memcpy(&tv, uptr + 1, sizeof(struct timeval));
-            gettimeofday(&stv, &tz);
-            rttime = subtract_timeval(&stv, &tv);
-            ei->rt_time += rttime;
-            ei->rcvd++;
+      due = pacer_due(&pacer);
+      if (due)
+         wait = (int)(due / (NSEC / MILLISEC));
+      else
+         wait = sent ? 0 : TCPIDLE;
+      epoch_exit(&echoEpoch, sh->txreader);
+
+      n = epoll_wait(ep, ev, TCPEVENTS, wait);
+
+      epoch_enter(&echoEpoch, sh->rxreader);
+      t = __atomic_load_n(&echoTable, __ATOMIC_ACQUIRE);
+      for (i = 0; i < n; i++) {
+         /* a connection closed or reopened since is no longer this fd */
+         s = (unsigned)(ev[i].data.u64 >> 32);
+         if (s >= nconns || (c = conns[s]) == NULL ||
+             c->sock != (int)(ev[i].data.u64 & 0xffffffff))
+            continue;
+         ei = s < t->nids && t->byid[s] && t->byid[s]->id == c->id ?
+              t->byid[s] : NULL;
+         if (ei == NULL)
+            continue;            /* deleted, the next sync closes it */
+         if (!c->connected) {
+            if (!tcpConnected(c, s, ep))
+               tcpClose(c, ei, ep);
+            continue;
+         }
+         if ((ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+             !tcpRead(c)) {
+            tcpClose(c, ei, ep);
+            continue;
          }
-         mutex_unlock(&recvMutex);
+         if ((ev[i].events & EPOLLOUT) && !tcpFlush(c, s, ep))
+            tcpClose(c, ei, ep);
+      }
+      epoch_exit(&echoEpoch, sh->rxreader);
+   }
+   return NULL;
+}
+
+/*
+ * Brings the sender's connections in line with table t: drops those of
+ * deleted endpoints, adds unopened ones for new endpoints, and works out
+ * the sender's share of the load.
+ */
+static void tcpSync(Shard *sh, EchoTable *t, TcpConn ***conns,
+                    unsigned *nconns, int ep)
+{
+   TcpConn  *c;
+   EchoInfo *ei;
+   unsigned s, n = 0;
+
+   if (*nconns < t->nids) {
+      *conns = (TcpConn **)realloc(*conns, t->nids * sizeof(TcpConn *));
+      if (*conns == NULL)
+         errexit("Can't allocate %u connections\n", t->nids);
+      memset(*conns + *nconns, 0, (t->nids - *nconns) * sizeof(TcpConn *));
+      *nconns = t->nids;
+   }
+   for (s = 0; s < *nconns; s++) {
+      c = (*conns)[s];
+      ei = s < t->nids ? t->byid[s] : NULL;
+      if (c && (ei == NULL || ei->id != c->id)) {
+         tcpClose(c, NULL, ep);
+         free(c);
+         (*conns)[s] = c = NULL;
+      }
+      if (ei == NULL || ei->shard != sh->id)
+         continue;
+      n++;
+      if (c == NULL) {
+         c = (TcpConn *)calloc(1, sizeof(TcpConn));
+         if (c == NULL)
+            errexit("Can't allocate a connection\n");
+         c->sock = -1;
+         c->id = ei->id;
+         c->addr.sin_family = AF_INET;
+         c->addr.sin_addr.s_addr = ei->addr;
+         c->addr.sin_port = htons(ei->port);
+         (*conns)[s] = c;
       }
    }
+   sh->rate = t->count ? (unsigned long long)loadkpbs * 1000 * n / t->count : 0;
 }
+
+/* starts a nonblocking connect, epoll reports when it's done */
+static void tcpOpen(TcpConn *c, unsigned slot, int ep)
+{
+   struct epoll_event   ev;
+   int                  on = 1;
+
+   c->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (c->sock < 0) {
+      c->retry = nsclock_now() + TCPRETRY;
+      return;
+   }
+   setsockopt(c->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+   c->connected = 0;
+   c->rlen = c->wlen = c->woff = 0;
+   if (connect(c->sock, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0 &&
+       errno != EINPROGRESS) {
+      close(c->sock);
+      c->sock = -1;
+      c->retry = nsclock_now() + TCPRETRY;
+      return;
+   }
+   c->events = EPOLLOUT;
+   ev.events = c->events;
+   ev.data.u64 = ((unsigned long long)slot << 32) | (unsigned)c->sock;
+   epoll_ctl(ep, EPOLL_CTL_ADD, c->sock, &ev);
+}
+
+/* writable after a connect: 0 if it failed */
+static int tcpConnected(TcpConn *c, unsigned slot, int ep)
+{
+   int         err = 0;
+   socklen_t   len = sizeof(err);
+
+   if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+      return 0;
+   c->connected = 1;
+   tcpEvents(c, slot, ep, EPOLLIN);
+   return 1;
+}
+
+/* closes c and schedules a reconnect, counted against ei if it has one */
+static void tcpClose(TcpConn *c, EchoInfo *ei, int ep)
+{
+   if (c->sock < 0)
+      return;
+   epoll_ctl(ep, EPOLL_CTL_DEL, c->sock, NULL);
+   close(c->sock);
+   c->sock = -1;
+   c->connected = 0;
+   c->retry = nsclock_now() + TCPRETRY;
+   if (ei)
+      ei->drops++;
+}
+
+static void tcpEvents(TcpConn *c, unsigned slot, int ep, unsigned events)
+{
+   struct epoll_event   ev;
+
+   if (c->events == events)
+      return;
+   c->events = events;
+   ev.events = events;
+   ev.data.u64 = ((unsigned long long)slot << 32) | (unsigned)c->sock;
+   epoll_ctl(ep, EPOLL_CTL_MOD, c->sock, &ev);
+}
+
+/*
+ * Builds the next probe to ei in c's write buffer, the same head and
+ * body a datagram would carry.  Returns its size.
+ */
+static unsigned tcpProbe(TcpConn *c, EchoInfo *ei)
+{
+   ProbeHead   ph;
+   unsigned    size;
+
+   size = pktsize_next(&ei->size, &ei->rnd);
+   probe_init(&ph, ei->id, size,
+              (bertmode == BERT_PRBS23 ? PROBE_PRBS23 : 0) |
+              (bertmode == BERT_PRBS31 ? PROBE_PRBS31 : 0));
+   ph.seq = ++ei->txseq;
+   if (bertmode)
+      bert_fill(bertmode, bert_seed(bertmode, ei->id, ph.seq),
+                (unsigned char *)c->wbuf + HEADSIZE, size - HEADSIZE);
+   ph.txns = nsclock_now();
+   probe_seal(&ph);
+   memcpy(c->wbuf, &ph, HEADSIZE);
+   c->wlen = size;
+   c->woff = 0;
+   ei->sent++;
+   ei->sentbytes += size;
+   return size;
+}
+
+/* writes what's left of the probe, 0 if the connection broke */
+static int tcpFlush(TcpConn *c, unsigned slot, int ep)
+{
+   int   n;
+
+   while (c->woff < c->wlen) {
+      n = send(c->sock, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            tcpEvents(c, slot, ep, EPOLLIN | EPOLLOUT);
+            return 1;
+         }
+         if (errno == EINTR)
+            continue;
+         return 0;
+      }
+      c->woff += n;
+   }
+   tcpEvents(c, slot, ep, EPOLLIN);
+   return 1;
+}
+
+/*
+ * Reads what the reflector sent back and accounts every whole probe in
+ * it.  0 on end of stream, on error, or when the stream has lost its
+ * framing, which only a new connection fixes.
+ */
+static int tcpRead(TcpConn *c)
+{
+   ProbeHead   ph;
+   unsigned    off;
+   int         n;
+
+   n = recv(c->sock, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+   if (n == 0)
+      return 0;
+   if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+   c->rlen += n;
+
+   for (off = 0; c->rlen - off >= HEADSIZE; off += ph.len) {
+      memcpy(&ph, c->rbuf + off, HEADSIZE);
+      if (ph.magic != PROBE_MAGIC || ph.len < HEADSIZE || ph.len > BUFSIZE) {
+         __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+         return 0;
+      }
+      if (c->rlen - off < ph.len)
+         break;
+      gotProbe(c->rbuf + off, ph.len, 0);
+   }
+   c->rlen -= off;
+   memmove(c->rbuf, c->rbuf + off, c->rlen);
+   return 1;
+}
+#endif
       
    
 static void printhelp(void)
 {
-   printf("add ipaddress port    - adds a thread\n");
+   printf("add ipaddress port [size] - adds a thread\n");
    printf("stat ipaddress port   - shows stats for an ipaddress port\n");
    printf("stat sum              - summary stats\n");
    printf("stat all              - shows stats for all \n");
+   printf("hist ipaddress port   - shows the last intervals, with -I or -R\n");
    printf("help                  - shows this\n");
    printf("aksjdfhlaksd          - shows this\n");
+   printf("pause / resume        - stops and restarts sending\n");
    printf("exit                  - exits\n");
 }
 
 static void showStats(char *what)
 {
+   EchoTable   *t;
    EchoInfo *ei;
-   int      all, bps, count;
+   int      i, all, bps, count;
    time_t   ttime, atime, mintime, cumtime;
-   unsigned addr, packets_sent, packets_rcvd, latency, totlatency;
+   unsigned addr, packets_sent, packets_rcvd, untimed = 0, drops = 0;
    struct in_addr iaddr;
    char     *s, addrbuf[100], portbuf[100];
-   
-   mutex_lock(&sendMutex);
-   mutex_lock(&recvMutex);
+   unsigned long long lost = 0, late = 0, reordered = 0, duplicate = 0;
+   unsigned long long bytes_rcvd = 0, bertbits = 0, biterrs = 0;
+   unsigned errored = 0;
+   static HdrHist rtt;
+
+   /* the caller holds echoMutex, so the table can't go away under us */
+   t = echoTable;
+   hdrhist_init(&rtt);
 
    if (strcmp(what, "all") == 0 || strcmp(what, "sum") == 0) {
       all = strcmp(what, "all") == 0;
@@ -412,32 +1863,60 @@ static void showStats(char *what)
       mintime = LONG_MAX;
       packets_sent = packets_rcvd = 0;
       cumtime = 0;
-      for (ei = echoList; ei; ei = ei->nextlink) {
+      for (i = 0; i < t->count; i++) {
+         ei = t->list[i];
          count++;
          atime = time(NULL) - ei->start;
          packets_sent += ei->sent;
          packets_rcvd += ei->rcvd;
+         bytes_rcvd += ei->rcvdbytes;
+         bertbits += ei->bertbits;
+         biterrs += ei->biterrs;
+         errored += ei->errored;
          cumtime += atime;
-         if (ei->rt_time && ei->rcvd)
-            totlatency += ei->rt_time / ei->rcvd;
+         untimed += ei->untimed;
+         drops += ei->drops;
+         lost += ei->win.lost;
+         late += ei->win.late;
+         reordered += ei->win.reordered;
+         duplicate += ei->win.duplicate;
+         hdrhist_merge(&rtt, &ei->rtt);
          if (ei->start < mintime)
             mintime = ei->start;
          if (all) {
             iaddr.s_addr = ei->addr;
-            latency = ei->rcvd ? ei->rt_time / ei->rcvd : 0;
-            printf("%15s sent %10d rcvd %10d latency %5d ms rate %d kbps\n",
-                   inet_ntoa(iaddr), ei->sent, ei->rcvd,
-                   latency,
-                   ((ei->rcvd * 8)/ atime));
+            printf("%15s sent %10d rcvd %10d lost %8llu p50 %9.1f p99 %9.1f us rate %d kbps\n",
+                   inet_ntoa(iaddr), ei->sent, ei->rcvd, ei->win.lost,
+                   hdrhist_percentile(&ei->rtt, 50) / 1000.0,
+                   hdrhist_percentile(&ei->rtt, 99) / 1000.0,
+                   kbps(ei->rcvdbytes, atime));
          }
       }
-      latency = packets_rcvd ? totlatency / packets_rcvd : 0;
       printf("---------------------------------------------------\n");
       printf("Number of addresses:  %d\n", count);
       printf("Packets sent:         %d\n", packets_sent);
       printf("Packets rcvd:         %d\n", packets_rcvd);
-      printf("Average latency:      %d\n", latency);
-      printf("Average kbps:         %d\n", (packets_rcvd * 8) / cumtime);
+      printf("Lost:                 %llu (%llu of them late)\n", lost, late);
+      printf("Reordered:            %llu\n", reordered);
+      printf("Duplicated:           %llu\n", duplicate);
+      printf("Rejected:             %llu\n",
+             __atomic_load_n(&rejected, __ATOMIC_RELAXED));
+      printf("Average latency:      %.1f us\n", hdrhist_mean(&rtt) / 1000.0);
+      printLatency(&rtt);
+      if (tstamp)
+         printf("Untimed probes:       %u\n", untimed);
+      if (usetcp)
+         printf("Dropped connections:  %u\n", drops);
+      if (bertmode)
+         printBert(bertbits, biterrs, errored);
+      printf("Average kbps:         %d\n", kbps(bytes_rcvd, cumtime));
+      printf("Total kbps:           %d\n",
+             kbps(bytes_rcvd, time(NULL) - mintime));
+      if (nshards > 1) {
+         for (i = 0; i < nshards; i++)
+            printf("Sender %2d:            %u endpoints at %llu kbps\n",
+                   i, shards[i].count, shards[i].rate / 1000);
+      }
    }
    else {
       sscanf(what, "%s %s", addrbuf, portbuf);
@@ -450,11 +1929,17 @@ static void showStats(char *what)
          if (ei) {
             iaddr.s_addr = ei->addr;
             atime = time(NULL) - ei->start;
-            latency = ei->rcvd ? ei->rt_time / ei->rcvd : 0;
-            printf("%15s sent %10d rcvd %10d latency %5d ms rate %d kbps\n",
+            printf("%15s sent %10d rcvd %10d rate %d kbps mean frame %u\n",
                    inet_ntoa(iaddr), ei->sent, ei->rcvd,
-                   latency,
-                   ((ei->rcvd * 8)/ atime));
+                   kbps(ei->rcvdbytes, atime), ei->size.mean);
+            printf("lost %llu late %llu reordered %llu duplicated %llu\n",
+                   ei->win.lost, ei->win.late, ei->win.reordered,
+                   ei->win.duplicate);
+            if (usetcp)
+               printf("dropped connections %u\n", ei->drops);
+            if (bertmode)
+               printBert(ei->bertbits, ei->biterrs, ei->errored);
+            printLatency(&ei->rtt);
          }
          else {
             printf("Don't know nothin bout no address %s\n", what);
@@ -462,29 +1947,10 @@ static void showStats(char *what)
       }
    }
 
-   mutex_unlock(&sendMutex);
-   mutex_unlock(&recvMutex);
-}
-
-static EchoInfo *getInfo(struct sockaddr_in  *fsin)
-{
-   unsigned char  *bp;
-   EchoInfo       *ei;
-   unsigned       addr = fsin->sin_addr.s_addr;
-   unsigned       port = ntohs(fsin->sin_port);
-
-   bp = (unsigned char *)&fsin->sin_addr.s_addr;
-   for (ei = echoHash[bp[2]][bp[3]]; ei; ei = ei->next) {
-      if (ei->addr == addr && ei->port == port)
-         break;
-   }
-   return ei;
 }
 
 static EchoInfo *findInfo(char *addrstr, char *portstr)
 {
-   unsigned char  *bp;
-   EchoInfo       *ei;
    unsigned       addr, port;
    
    addr = inet_addr(addrstr);
@@ -497,84 +1963,226 @@ static EchoInfo *findInfo(char *addrstr, char *portstr)
       printf("Totally bogus port %s\n", portstr);
       return;
    }
-   bp = (unsigned char *)&addr;
-   for (ei = echoHash[bp[2]][bp[3]]; ei; ei = ei->next) {
-      if (ei->addr == addr && ei->port == port)
-         break;
+   return lookup(echoTable, addr, port);
+}
+
+/*
+ * -S: every STATSEG_PERIOD ms, copies each endpoint's counters into its
+ * record, at 1 + its slot, and the sums into record 0.  It reads them
+ * unlocked as showStats does, from inside an epoch section so the table
+ * stays put, and the send and receive paths never see it.  Slots freed
+ * since the last round are written back as unused.
+ */
+static void *publishThread(void *arg)
+{
+   static HdrHist rtt;
+   StatRec     r, total;
+   EchoTable   *t;
+   EchoInfo    *ei;
+   unsigned    s, used = 1;
+   int         reader;
+
+   reader = epoch_register(&echoEpoch);
+   while (1) {
+      usleep(STATSEG_PERIOD * 1000);
+      memset(&total, 0, sizeof(total));
+      hdrhist_init(&rtt);
+
+      epoch_enter(&echoEpoch, reader);
+      t = __atomic_load_n(&echoTable, __ATOMIC_ACQUIRE);
+      for (s = 0; s < t->nids || s + 1 < used; s++) {
+         memset(&r, 0, sizeof(r));
+         ei = s < t->nids ? t->byid[s] : NULL;
+         if (ei) {
+            r.addr = ei->addr;
+            r.port = ei->port;
+            r.flags = STATREC_USED;
+            r.start = ei->start;
+            r.sent = ei->sent;
+            r.rcvd = ei->rcvd;
+            r.sentbytes = ei->sentbytes;
+            r.rcvdbytes = ei->rcvdbytes;
+            r.lost = ei->win.lost;
+            r.late = ei->win.late;
+            r.reordered = ei->win.reordered;
+            r.duplicate = ei->win.duplicate;
+            r.untimed = ei->untimed;
+            r.drops = ei->drops;
+            r.bertbits = ei->bertbits;
+            r.biterrs = ei->biterrs;
+            r.errored = ei->errored;
+            statseg_rtt(&r, &ei->rtt);
+            statseg_sum(&total, &r);
+            hdrhist_merge(&rtt, &ei->rtt);
+         }
+         statseg_write(&statSeg, s + 1, &r);
+      }
+      used = t->nids + 1;
+      epoch_exit(&echoEpoch, reader);
+
+      total.flags = STATREC_USED;
+      total.rejected = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+      statseg_rtt(&total, &rtt);
+      statseg_write(&statSeg, 0, &total);
+      statseg_publish(&statSeg, used);
    }
-   return ei;
+   return NULL;
 }
 
-/* subtracts tv2 from tv1 and returns the result in milliseconds */
-static unsigned subtract_timeval(struct timeval *tv1, struct timeval *tv2)
+/*
+ * -I/-R: closes an interval for every endpoint each 'interval' ms.  Like
+ * publishThread it reads the counters unlocked inside an epoch section,
+ * so the send and receive paths don't know it's there; the samples go
+ * to each endpoint's ring and, with -R, to the queue logThread drains.
+ */
+static void *sampleThread(void *arg)
 {
-   unsigned us;
-   unsigned ms = (tv1->tv_sec - tv2->tv_sec) * MILLISEC;
-   
+   unsigned long long   next, ms;
+   EchoTable            *t;
+   EchoInfo             *ei;
+   RunTotals            now;
+   unsigned long long   answered;
+   unsigned             i;
+   int                  reader;
 
-   if (tv1->tv_usec < tv2->tv_usec) {
-      us = (tv1->tv_usec + MICROSEC) - tv2->tv_usec;
-      ms = (ms - MILLISEC) + (us / MILLISEC);
+   reader = epoch_register(&echoEpoch);
+   next = nsclock_now();
+   while (1) {
+      next += (unsigned long long)interval * (NSEC / MILLISEC);
+      nsclock_sleepuntil(next);
+      ms = runlog_ms();
+
+      epoch_enter(&echoEpoch, reader);
+      t = __atomic_load_n(&echoTable, __ATOMIC_ACQUIRE);
+      for (i = 0; i < t->count; i++) {
+         ei = t->list[i];
+         if (ei->track == NULL)
+            continue;
+         now.sent = ei->sent;
+         now.rcvd = ei->rcvd;
+         /*
+          * sent by the last sample and still unanswered: the window only
+          * calls a probe lost 1024 probes later, long after its interval
+          */
+         answered = ei->rcvd - ei->win.duplicate;
+         now.lost = ei->track->last.sent > answered ?
+                    ei->track->last.sent - answered : 0;
+         now.bytes = ei->rcvdbytes;
+         runlog_sample(runpath ? &runLog : NULL, ei->track, ms, ei->addr,
+                       ei->port, &now, &ei->rtt);
+      }
+      epoch_exit(&echoEpoch, reader);
    }
-   else {
-      ms += (tv1->tv_usec - tv2->tv_usec) / MILLISEC;
+   return NULL;
+}
+
+/* -R: moves queued samples to disk, off the sampler's thread */
+static void *logThread(void *arg)
+{
+   while (1) {
+      usleep(RUNLOG_FLUSH * 1000);
+      runlog_flush(&runLog);
    }
-   return ms;
+   return NULL;
 }
 
-static int up(char *addrstr)
+/* the ring of one endpoint, oldest interval first */
+static void showHistory(char *what)
 {
-   static int     addCnt = 0;
-   char           *argv[6];
-   char           buff[20];
+   char        addrbuf[100], portbuf[100];
+   EchoInfo    *ei;
+   RunTrack    *tr;
+   RunSample   *rs;
+   unsigned    i, n;
+
+   if (sscanf(what, "%99s %99s", addrbuf, portbuf) != 2 ||
+       (ei = findInfo(addrbuf, portbuf)) == NULL) {
+      printf("Don't know nothin bout no address %s\n", what);
+      return;
+   }
+   tr = ei->track;
+   if (tr == NULL) {
+      printf("No samples, run with -I or -R\n");
+      return;
+   }
+   n = tr->count < RUNLOG_RING ? tr->count : RUNLOG_RING;
+   printf("%8s %8s %8s %8s %9s %9s %9s %9s\n", "ms ago", "sent", "rcvd",
+          "lost", "kbps", "p50 us", "p99 us", "max us");
+   for (i = tr->count - n; i != tr->count; i++) {
+      rs = &tr->ring[i % RUNLOG_RING];
+      printf("%8llu %8u %8u %8u %9llu %9.1f %9.1f %9.1f\n",
+             runlog_ms() - rs->t, rs->sent, rs->rcvd, rs->lost,
+             rs->bytes * 8 / interval, rs->rtt50 / 1000.0,
+             rs->rtt99 / 1000.0, rs->rttmax / 1000.0);
+   }
+   if (runpath && runLog.dropped)
+      printf("%llu samples dropped on the way to %s\n", runLog.dropped,
+             runpath);
+}
 
-   sprintf(buff, "%d", addCnt++);
-   argv[0] = "sh";
-   argv[1] = "up";
-   argv[2] = addrstr;
-   argv[3] = buff;
-   argv[4] = 0;
-   return launch(argv);
+/* rate of 'bytes' over 'secs', each probe counted with its ip/udp headers */
+static unsigned kbps(unsigned long long bytes, time_t secs)
+{
+   if (secs <= 0)
+      secs = 1;
+   return (unsigned)((bytes * 8) / 1000 / secs);
 }
 
-static int down(char *addrstr) 
+/* round trip percentiles, in microseconds */
+static void printLatency(HdrHist *h)
 {
-   char *argv[5];
+   printf("Latency p50/p90/p99:  %.1f / %.1f / %.1f us\n",
+          hdrhist_percentile(h, 50) / 1000.0,
+          hdrhist_percentile(h, 90) / 1000.0,
+          hdrhist_percentile(h, 99) / 1000.0);
+   printf("Latency p99.9/max:    %.1f / %.1f us\n",
+          hdrhist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
 
-   argv[0] = "sh";
-   argv[1] = "down";
-   argv[2] = addrstr;
-   argv[3] = 0;
-   return launch(argv);
+static void printBert(unsigned long long bits, unsigned long long errs,
+                      unsigned errored)
+{
+   printf("Bit errors:           %llu in %llu bits, BER %.3g\n", errs, bits,
+          bits ? (double)errs / bits : 0.0);
+   printf("Errored probes:       %u\n", errored);
 }
 
-static void downall(void)
+static int up(char *addrstr, EchoInfo *ei)
 {
-   EchoInfo *ei;
-	struct in_addr   inaddr;
+   static unsigned addCnt = 0;
 
-   for (ei = echoList; ei; ei = ei->nextlink) {
-      inaddr.s_addr = ei->addr;
-      down(inet_ntoa(inaddr));
-   }
+   return provision_up(&prov, addrstr, addCnt++, (unsigned long)ei);
+}
+
+static int down(char *addrstr) 
+{
+   return provision_down(&prov, addrstr, 0);
 }
 
-static int launch(char *argv[])
+/*
+ * Downs everything, pending or not, and waits for the scripts to run.
+ * The addresses are copied out first: the helper may need
+ * provisionThread, and so echoMutex, to make room for more requests.
+ */
+static void downall(void)
 {
-   int pid, status;
+   EchoTable   *t;
+	struct in_addr   inaddr;
+   unsigned    i, n = 0, *addrs;
 
-   pid = fork();
-   if (pid == -1)
-      return -1;
-   if (pid == 0) {
-      execv("/bin/sh", argv);
-      exit(127);
+   mutex_lock(&echoMutex);
+   t = echoTable;
+   addrs = (unsigned *)malloc((t->count + npending + 1) * sizeof(unsigned));
+   for (i = 0; addrs && i < t->count; i++)
+      addrs[n++] = t->list[i]->addr;
+   for (i = 0; addrs && i < npending; i++)
+      addrs[n++] = pending[i]->addr;
+   mutex_unlock(&echoMutex);
+
+   for (i = 0; i < n; i++) {
+      inaddr.s_addr = addrs[i];
+      down(inet_ntoa(inaddr));
    }
-   do {
-      if (waitpid(pid, &status, 0) == -1) {
-         if (errno != EINTR)
-            return -1;
-      } else
-         return status;
-   } while(1);
+   free(addrs);
+   provision_finish(&prov);
 }
@@ -1,4 +1,8 @@
+#ifdef linux
+#define _GNU_SOURCE     /* recvmmsg/sendmmsg */
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <time.h>
 #include <string.h>
@@ -6,123 +10,755 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#ifdef linux
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#endif
 
 #include "tthread.h"
+#include "addrstat.h"
+#include "pktring.h"
+#include "uring.h"
+#include "statseg.h"
 
 extern int  passiveUDP(const char *service);
+extern int  passiveTCP(const char *service, int qlen);
 extern int  errexit(const char *format, ...);
 
 #define BUFSIZE 4096
+#define MAXBATCH 1024    /* largest -b we accept */
+#define MAXWORKERS 64    /* largest -w we accept */
+#define URINGBUFS  4096  /* provided receive buffers, power of 2 */
+#define URINGTAG   (~0ULL)  /* user_data of the multishot receive */
+#define GROSIZE    65536    /* largest coalesced datagram */
+#define TCPBUF     16384    /* pooled per connection buffer */
+#define TCPQLEN    4096     /* listen backlog */
+#define TCPEVENTS  256      /* epoll events taken per wait */
 
-typedef struct _AddrStat {
-   unsigned          addr;
-   unsigned          bytes;
-   unsigned          packets;
-   time_t            start;
-   struct _AddrStat  *next;      /* for hash */
-   struct _AddrStat  *nextlink;  /* for global linked list */
-} AddrStat;
+#define USAGE  "usage: UDPechod [-b batch] [-w workers] [-s sources] [-g]\n" \
+               "                [-e socket|packet|uring] [-i ifname]\n" \
+               "                [-P udp|tcp|both] [-S statsfile] port\n"
 
-static AddrStat *addrHash[256][256];
-static AddrStat *addrList = NULL;
+#define ENGINE_SOCKET   0  /* recvfrom/sendto or recvmmsg/sendmmsg */
+#define ENGINE_PACKET   1  /* AF_PACKET mmap'd rings */
+#define ENGINE_URING    2  /* io_uring, falls back to sockets */
+
+/* per worker stats, only ever written by the owning worker */
+typedef struct _StatShard {
+   AddrTable         table;         /* per source counters */
+   unsigned          batchCalls;    /* recvmmsg calls that returned data */
+   unsigned          batchPackets;  /* datagrams those calls returned */
+} StatShard;
+
+/*
+ * A worker reflects udp on 'sock' and, with -P tcp or both, runs a second
+ * thread on the same cpu that echoes the streams accepted on 'lsock'.
+ * The tcp thread keeps its own stats so each table has a single writer.
+ */
+typedef struct _Worker {
+   int               id;
+   int               sock;
+   int               lsock;         /* tcp listener, -1 if udp only */
+   Thread            thr;
+   StatShard         stats;
+   StatShard         tcpstats;
+   unsigned          tcpaccepted;   /* connections, ever */
+   unsigned          tcpopen;       /* connections, now */
+} Worker;
+
+#ifdef linux
+/*
+ * One accepted stream, kept in the tcp thread's array indexed by fd.  It
+ * holds a pool buffer only while part of an echo is still unwritten; then
+ * it stops reading until the peer takes the rest, so a slow reader costs
+ * one buffer and never more.
+ */
+typedef struct _TcpConn {
+   unsigned          addr;          /* peer, network order; 0 = unused */
+   char              *buf;          /* pool buffer holding unsent bytes */
+   unsigned          len;
+   unsigned          off;           /* sent so far of buf */
+} TcpConn;
+
+/* free list of TCPBUF buffers shared by one thread's connections */
+typedef struct _BufPool {
+   char              **free;
+   unsigned          nfree;
+   unsigned          size;          /* slots in free */
+   unsigned          total;         /* buffers ever allocated */
+} BufPool;
+#endif
+
+extern int  reuseport;
+
+static Worker     *workers;
+static StatSeg    statSeg;          /* -S */
 
 static void *statThread(char *);
-static void addStat(unsigned addr, unsigned bytes);
-static AddrStat *getStat(unsigned addr);
+static void *publishThread(void *);
+static void *workerThread(Worker *);
+static void reflect(Worker *);
+#ifdef linux
+static unsigned groSegment(struct msghdr *);
+static void reflectBatch(Worker *);
+static void reflectRing(Worker *);
+static void reflectUring(Worker *);
+static void *tcpThread(Worker *);
+static void tcpAccept(Worker *, int ep, TcpConn **conns, unsigned *nconns);
+static void tcpEcho(Worker *, int ep, TcpConn *c, int fd, BufPool *pool);
+static int  tcpFlush(TcpConn *c, int fd, BufPool *pool);
+static void tcpClose(Worker *, TcpConn *c, int fd, BufPool *pool);
+static char *pool_get(BufPool *pool);
+static void pool_put(BufPool *pool, char *buf);
+#endif
+static AddrTable *statTable(int i);
+static int  mergeStat(unsigned addr, int first, AddrStat *merged);
 static void showStats(char *what);
 
+static unsigned batch = 1;          /* datagrams per recvmmsg, 1 = classic */
+static unsigned nworkers = 1;       /* reflect threads, one socket each */
+static unsigned maxsources = 100000; /* distinct sources tracked per worker */
+static int      engine = ENGINE_SOCKET;
+static char     *ifname = "lo";     /* interface for the packet engine */
+static int      gro = 0;            /* take GRO trains, reflect them as GSO */
+static int      serveudp = 1;       /* -P */
+static int      servetcp = 0;
+static int      ntables;            /* stat tables, see statTable */
+static char     *statpath = NULL;   /* -S, stats file to publish in */
+
 int main(int argc, char *argv[])
 {
-   struct sockaddr_in   fsin;
-   char     buf[BUFSIZE], *port;
-   int      sock;
-   int      alen;
-   int      bytes, i, j;
+   char     *port = NULL;
+   int      i;
+   unsigned bsize, nw, ns;
+   unsigned long long nrecs;
    Thread   thr;
 
-   if (argc < 2)
-      errexit("usage: UDPechod port\n");
+   for (i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "-h", 2) == 0) {
+         errexit(USAGE);
+      }
+      else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+         bsize = strtoul(argv[++i], (char **)NULL, 10);
+         if (bsize > 0 && bsize <= MAXBATCH)
+            batch = bsize;
+         else
+            printf("Bogus batch value: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+         nw = strtoul(argv[++i], (char **)NULL, 10);
+         if (nw > 0 && nw <= MAXWORKERS)
+            nworkers = nw;
+         else
+            printf("Bogus workers value: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+         ns = strtoul(argv[++i], (char **)NULL, 10);
+         if (ns > 0 && ns < 0x40000000U)
+            maxsources = ns;
+         else
+            printf("Bogus sources value: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "socket") == 0)
+            engine = ENGINE_SOCKET;
+#ifdef linux
+         else if (strcmp(argv[i], "packet") == 0)
+            engine = ENGINE_PACKET;
+         else if (strcmp(argv[i], "uring") == 0)
+            engine = ENGINE_URING;
+#endif
+         else
+            printf("Bogus engine: %s\n", argv[i]);
+      }
+      else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+         ifname = argv[++i];
+      }
+      else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+         statpath = argv[++i];
+      }
+#ifdef linux
+      else if (strcmp(argv[i], "-g") == 0) {
+         gro = 1;
+      }
+      else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+         i++;
+         if (strcmp(argv[i], "udp") == 0)
+            serveudp = 1, servetcp = 0;
+         else if (strcmp(argv[i], "tcp") == 0)
+            serveudp = 0, servetcp = 1;
+         else if (strcmp(argv[i], "both") == 0)
+            serveudp = servetcp = 1;
+         else
+            printf("Bogus protocol: %s\n", argv[i]);
+      }
+#endif
+      else {
+         port = argv[i];
+      }
+   }
+   if (port == NULL)
+      errexit(USAGE);
 
-   memset(addrHash, 0, sizeof(AddrStat *) * 256 * 256);
+   workers = (Worker *)calloc(nworkers, sizeof(Worker));
+   if (workers == NULL)
+      errexit("Can't allocate %d workers\n", nworkers);
 
-   port = argv[1];
-   
-   sock = passiveUDP(port);
+   /* every worker gets its own socket on the same port */
+   reuseport = nworkers > 1;
+   for (i = 0; i < nworkers; i++) {
+      workers[i].id = i;
+      workers[i].sock = workers[i].lsock = -1;
+      if (serveudp) {
+         workers[i].sock = passiveUDP(port);
+         if (!addrstat_init(&workers[i].stats.table, maxsources))
+            errexit("Can't allocate stats for %d sources\n", maxsources);
+      }
+      if (servetcp) {
+         workers[i].lsock = passiveTCP(port, TCPQLEN);
+         if (!addrstat_init(&workers[i].tcpstats.table, maxsources))
+            errexit("Can't allocate stats for %d sources\n", maxsources);
+      }
+   }
+   ntables = nworkers * (serveudp + servetcp);
 
    thread_create(&thr, (ThreadRunFunc)statThread, port);
-   
+   if (statpath) {
+      /*
+       * a record for every source each table can hold, as they may all
+       * differ; pages no source reaches are never touched
+       */
+      nrecs = (unsigned long long)ntables * maxsources + 1;
+      if (nrecs > UINT_MAX / sizeof(StatRec))
+         nrecs = UINT_MAX / sizeof(StatRec);
+      if (!statseg_create(&statSeg, statpath, STATSEG_REFLECTOR, "UDPechod",
+                          (unsigned)nrecs))
+         errexit("Can't create stats file %s: %s\n", statpath,
+                 strerror(errno));
+      thread_create(&thr, (ThreadRunFunc)publishThread, NULL);
+   }
+
+#ifdef linux
+   if (servetcp)
+      for (i = serveudp ? 0 : 1; i < nworkers; i++)
+         thread_create(&thr, (ThreadRunFunc)tcpThread, &workers[i]);
+   if (!serveudp) {
+      tcpThread(&workers[0]);
+      return 0;
+   }
+#endif
+   for (i = 1; i < nworkers; i++)
+      thread_create(&workers[i].thr, (ThreadRunFunc)workerThread, &workers[i]);
+   workerThread(&workers[0]);
+   return 0;
+}
+
+static void *workerThread(Worker *w)
+{
+   int   i;
+
+   if (nworkers > 1)
+      thread_bindcpu(w->id);
+#ifdef linux
+   if (engine == ENGINE_PACKET)
+      reflectRing(w);      /* never returns */
+   if (engine == ENGINE_URING)
+      reflectUring(w);     /* returns only if io_uring is unavailable */
+   if (gro) {
+      i = 1;
+      if (setsockopt(w->sock, SOL_UDP, UDP_GRO, &i, sizeof(i)) < 0) {
+         printf("UDP_GRO not supported: %s\n", strerror(errno));
+         gro = 0;
+      }
+   }
+   if (batch > 1 || gro)
+      reflectBatch(w);     /* never returns */
+#endif
+   reflect(w);
+   return NULL;
+}
+
+/* classic reflect loop, one recvfrom and one sendto per datagram */
+static void reflect(Worker *w)
+{
+   struct sockaddr_in   fsin;
+   char     buf[BUFSIZE];
+   int      alen;
+   int      bytes;
+
    while (1) {
       alen = sizeof(fsin);
-      bytes = recvfrom(sock, buf, BUFSIZE, 0,
+      bytes = recvfrom(w->sock, buf, BUFSIZE, 0,
                        (struct sockaddr *)&fsin, &alen);
       if (bytes < 0)
          errexit("recvfrom: %s\n", strerror(errno));
 
-      sendto(sock, (char *)buf, bytes, 0,
+      sendto(w->sock, (char *)buf, bytes, 0,
              (struct sockaddr *)&fsin, sizeof(fsin));
 
-      addStat(fsin.sin_addr.s_addr, bytes);
+      addrstat_add(&w->stats.table, fsin.sin_addr.s_addr, bytes, 1);
    }
+}
+
+#ifdef linux
+/* GRO segment size of a received datagram, 0 if it wasn't coalesced */
+static unsigned groSegment(struct msghdr *msg)
+{
+   struct cmsghdr *cm;
+
+   for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm))
+      if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+         return *(int *)CMSG_DATA(cm);
    return 0;
 }
 
-static void addStat(unsigned addr, unsigned bytes)
+/*
+ * Batched reflect loop: pull up to 'batch' datagrams with one recvmmsg and
+ * send them all back with sendmmsg.  The receive vector is reused as the
+ * send vector since the source address is already sitting in msg_name.
+ *
+ * With -g the socket takes GRO trains, a run of same sized datagrams from
+ * one sender coalesced into a single buffer.  Each train goes back out as
+ * one GSO send with the same segment size, so the sender sees exactly the
+ * datagrams it sent, and the stats count the segments, not the trains.
+ */
+static void reflectBatch(Worker *w)
 {
-   unsigned char *bp = (unsigned char *)&addr;
-   AddrStat *sp, *sp2;
+   struct mmsghdr       *msgs;
+   struct iovec         *iovs;
+   struct sockaddr_in   *addrs;
+   struct cmsghdr       *cm;
+   char                 *bufs, *ctls;
+   unsigned             *segs;
+   unsigned             addr, bytes, packets, bufsize, ctlsize, seg;
+   int                  i, n, ret, sent;
 
-   sp = addrHash[bp[2]][bp[3]];
-   
-   if (sp) {
-      do {
-         if (sp->addr == addr) {
-            sp->bytes += bytes;
-            sp->packets++;
-            return;
+   bufsize = gro ? GROSIZE : BUFSIZE;
+   ctlsize = gro ? CMSG_SPACE(sizeof(int)) : 0;
+   msgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+   iovs = (struct iovec *)calloc(batch, sizeof(struct iovec));
+   addrs = (struct sockaddr_in *)calloc(batch, sizeof(struct sockaddr_in));
+   bufs = (char *)malloc((size_t)batch * bufsize);
+   ctls = (char *)calloc(batch, ctlsize + 1);
+   segs = (unsigned *)calloc(batch, sizeof(unsigned));
+   if (!msgs || !iovs || !addrs || !bufs || !ctls || !segs)
+      errexit("Can't allocate %d batch buffers\n", batch);
+
+   for (i = 0; i < batch; i++) {
+      iovs[i].iov_base = bufs + (size_t)i * bufsize;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+   }
+
+   while (1) {
+      for (i = 0; i < batch; i++) {
+         iovs[i].iov_len = bufsize;
+         msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+         msgs[i].msg_hdr.msg_control = ctlsize ? ctls + i * ctlsize : NULL;
+         msgs[i].msg_hdr.msg_controllen = ctlsize;
+      }
+      n = recvmmsg(w->sock, msgs, batch, MSG_WAITFORONE, NULL);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         errexit("recvmmsg: %s\n", strerror(errno));
+      }
+      if (n == 0)
+         continue;
+
+      /* echo back exactly what came in, trains with their segment size */
+      for (i = 0; i < n; i++) {
+         iovs[i].iov_len = msgs[i].msg_len;
+         seg = groSegment(&msgs[i].msg_hdr);
+         if (seg && seg < msgs[i].msg_len) {
+            cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+            *(unsigned short *)CMSG_DATA(cm) = seg;
+            msgs[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(unsigned short));
+         }
+         else
+            msgs[i].msg_hdr.msg_controllen = 0;
+         segs[i] = seg;
+      }
+      for (sent = 0; sent < n; sent += ret) {
+         ret = sendmmsg(w->sock, msgs + sent, n - sent, 0);
+         if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+               ret = 0;
+               continue;
+            }
+            break;   /* drop the rest of the batch, like a failed sendto */
          }
-         if (sp->next == NULL) {
-            sp2 = (AddrStat *)malloc(sizeof(AddrStat));
-            sp2->addr = addr;
-            sp2->bytes = bytes;
-            sp2->packets = 1;
-            sp2->start = time(NULL);
-            sp2->next = NULL;
-            
-            sp->next = sp2;
-
-            sp2->nextlink = addrList;
-            addrList = sp2;
-            
-            return;
+      }
+
+      /* one stat update per run of datagrams from the same source */
+      addr = addrs[0].sin_addr.s_addr;
+      bytes = packets = 0;
+      for (i = 0; i < n; i++) {
+         if (addrs[i].sin_addr.s_addr != addr) {
+            addrstat_add(&w->stats.table, addr, bytes, packets);
+            addr = addrs[i].sin_addr.s_addr;
+            bytes = packets = 0;
          }
-         sp = sp->next;
-      }  while (sp);
+         bytes += msgs[i].msg_len;
+         packets += segs[i] ? (msgs[i].msg_len + segs[i] - 1) / segs[i] : 1;
+      }
+      addrstat_add(&w->stats.table, addr, bytes, packets);
+
+      w->stats.batchCalls++;
+      w->stats.batchPackets += n;
+   }
+}
+
+/*
+ * Packet engine: the probes are reflected straight from the AF_PACKET
+ * rings.  The worker's udp socket stays bound so the stack doesn't answer
+ * with port unreachables, but a drop-all filter keeps it from queueing
+ * copies nobody will read.
+ */
+static void reflectRing(Worker *w)
+{
+   struct sockaddr_in   sin;
+   struct sock_filter   drop = { 0x06, 0, 0, 0 };  /* ret #0 */
+   struct sock_fprog    prog;
+   PktRing              ring;
+   socklen_t            alen = sizeof(sin);
+
+   if (getsockname(w->sock, (struct sockaddr *)&sin, &alen) < 0)
+      errexit("getsockname: %s\n", strerror(errno));
+   prog.len = 1;
+   prog.filter = &drop;
+   setsockopt(w->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+
+   pktring_open(&ring, ifname, sin.sin_port,
+                nworkers > 1 ? ((getpid() & 0xffff) | 1) : 0);
+   pktring_reflect(&ring, &w->stats.table);
+}
+
+/*
+ * io_uring engine: one multishot recvmsg fills buffers from a registered
+ * provided buffer ring, each datagram is echoed with a sendmsg that points
+ * straight into the buffer it arrived in, and the buffer goes back to the
+ * kernel when the send completes.  Everything queued while draining the
+ * completion ring goes out with a single io_uring_enter, which also waits
+ * for the next completions.
+ */
+static void reflectUring(Worker *w)
+{
+   Uring                      u;
+   struct io_uring_cqe        *cqe;
+   struct io_uring_recvmsg_out *out;
+   struct msghdr              tmpl, *msgs;
+   struct iovec               *iovs;
+   struct sockaddr_in         *name;
+   unsigned long long         data;
+   unsigned                   bid, flags, addr, bytes, packets, n;
+   int                        res, rearm;
+
+   if (!uring_init(&u, 1024) ||
+       !uring_bufring(&u, URINGBUFS, sizeof(struct io_uring_recvmsg_out) +
+                      sizeof(struct sockaddr_in) + BUFSIZE, 1)) {
+      if (u.fd >= 0)
+         uring_exit(&u);
+      printf("io_uring not available, using the socket engine\n");
+      return;
+   }
+   msgs = (struct msghdr *)calloc(URINGBUFS, sizeof(struct msghdr));
+   iovs = (struct iovec *)calloc(URINGBUFS, sizeof(struct iovec));
+   if (!msgs || !iovs)
+      errexit("Can't allocate io_uring send vectors\n");
+
+   memset(&tmpl, 0, sizeof(tmpl));
+   tmpl.msg_namelen = sizeof(struct sockaddr_in);
+   uring_recvmsg_multi(&u, w->sock, &tmpl, URINGTAG);
+
+   while (1) {
+      uring_submit(&u, 1);
+
+      rearm = 0;
+      addr = bytes = packets = n = 0;
+      while ((cqe = uring_cqe(&u)) != NULL) {
+         res = cqe->res;
+         flags = cqe->flags;
+         data = cqe->user_data;
+         uring_cqe_seen(&u);
+
+         if (data != URINGTAG) {
+            uring_buf_recycle(&u, (unsigned)data);   /* send finished */
+            continue;
+         }
+         if (!(flags & IORING_CQE_F_MORE))
+            rearm = 1;
+         if (res < 0) {
+            if (res == -ENOBUFS || res == -EINTR)
+               continue;   /* every buffer is out echoing, rearm below */
+            errexit("io_uring recvmsg: %s\n", strerror(-res));
+         }
+         if (!(flags & IORING_CQE_F_BUFFER))
+            continue;
+
+         bid = flags >> IORING_CQE_BUFFER_SHIFT;
+         out = (struct io_uring_recvmsg_out *)uring_buf(&u, bid);
+         name = (struct sockaddr_in *)(out + 1);
+         iovs[bid].iov_base = (char *)name + tmpl.msg_namelen;
+         iovs[bid].iov_len = out->payloadlen;
+         msgs[bid].msg_name = name;
+         msgs[bid].msg_namelen = sizeof(struct sockaddr_in);
+         msgs[bid].msg_iov = &iovs[bid];
+         msgs[bid].msg_iovlen = 1;
+         uring_sendmsg(&u, w->sock, &msgs[bid], bid);
+
+         if (name->sin_addr.s_addr != addr && packets) {
+            addrstat_add(&w->stats.table, addr, bytes, packets);
+            bytes = packets = 0;
+         }
+         addr = name->sin_addr.s_addr;
+         bytes += out->payloadlen;
+         packets++;
+         n++;
+      }
+      if (packets)
+         addrstat_add(&w->stats.table, addr, bytes, packets);
+      if (rearm)
+         uring_recvmsg_multi(&u, w->sock, &tmpl, URINGTAG);
+      if (n) {
+         w->stats.batchCalls++;
+         w->stats.batchPackets += n;
+      }
+   }
+}
+
+/*
+ * TCP echo loop for one worker.  The listener is shared with the other
+ * workers' through SO_REUSEPORT, so the kernel spreads connections over
+ * them, and every connection stays on the worker's epoll loop until it
+ * closes.  Whatever a read brings in is written straight back; a read
+ * counts as one packet in the source's stats.
+ */
+static void *tcpThread(Worker *w)
+{
+   struct epoll_event   ev[TCPEVENTS];
+   TcpConn              *conns = NULL;
+   unsigned             nconns = 0;
+   BufPool              pool;
+   int                  ep, i, n, fd;
+
+   if (nworkers > 1)
+      thread_bindcpu(w->id);
+   memset(&pool, 0, sizeof(pool));
+   ep = epoll_create1(0);
+   if (ep < 0)
+      errexit("epoll_create1: %s\n", strerror(errno));
+   fcntl(w->lsock, F_SETFL, fcntl(w->lsock, F_GETFL) | O_NONBLOCK);
+   ev[0].events = EPOLLIN;
+   ev[0].data.fd = w->lsock;
+   if (epoll_ctl(ep, EPOLL_CTL_ADD, w->lsock, &ev[0]) < 0)
+      errexit("epoll_ctl: %s\n", strerror(errno));
+
+   while (1) {
+      n = epoll_wait(ep, ev, TCPEVENTS, -1);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         errexit("epoll_wait: %s\n", strerror(errno));
+      }
+      for (i = 0; i < n; i++) {
+         fd = ev[i].data.fd;
+         if (fd == w->lsock)
+            tcpAccept(w, ep, &conns, &nconns);
+         else if (fd < nconns && conns[fd].addr)
+            tcpEcho(w, ep, &conns[fd], fd, &pool);
+      }
+   }
+   return NULL;
+}
+
+/* takes every pending connection, conns grows to cover the highest fd */
+static void tcpAccept(Worker *w, int ep, TcpConn **conns, unsigned *nconns)
+{
+   struct sockaddr_in   fsin;
+   struct epoll_event   ev;
+   socklen_t            alen;
+   unsigned             size;
+   int                  fd, on = 1;
+
+   while (1) {
+      alen = sizeof(fsin);
+      fd = accept4(w->lsock, (struct sockaddr *)&fsin, &alen, SOCK_NONBLOCK);
+      if (fd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            printf("accept: %s\n", strerror(errno));
+         return;
+      }
+      if (fd >= *nconns) {
+         for (size = *nconns ? *nconns : 1024; size <= fd; size *= 2)
+            ;
+         *conns = (TcpConn *)realloc(*conns, size * sizeof(TcpConn));
+         if (*conns == NULL)
+            errexit("Can't allocate %u connections\n", size);
+         memset(*conns + *nconns, 0, (size - *nconns) * sizeof(TcpConn));
+         *nconns = size;
+      }
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      memset(&(*conns)[fd], 0, sizeof(TcpConn));
+      (*conns)[fd].addr = fsin.sin_addr.s_addr;
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+         close(fd);
+         (*conns)[fd].addr = 0;
+         continue;
+      }
+      w->tcpaccepted++;
+      __atomic_add_fetch(&w->tcpopen, 1, __ATOMIC_RELAXED);
+   }
+}
+
+/*
+ * Echoes what's readable on c, or with an echo still pending, writes
+ * more of it.  When the socket can't take all of an echo the remainder
+ * stays in a pool buffer and the connection waits for EPOLLOUT instead
+ * of reading, which leaves the peer's data in the kernel until it drains.
+ */
+static void tcpEcho(Worker *w, int ep, TcpConn *c, int fd, BufPool *pool)
+{
+   struct epoll_event   ev;
+   int                  n;
+
+   if (c->buf == NULL) {
+      c->buf = pool_get(pool);
+      n = recv(fd, c->buf, TCPBUF, 0);
+      if (n <= 0) {
+         pool_put(pool, c->buf);
+         c->buf = NULL;
+         if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            tcpClose(w, c, fd, pool);
+         return;
+      }
+      c->len = n;
+      c->off = 0;
+      addrstat_add(&w->tcpstats.table, c->addr, n, 1);
+      if (!tcpFlush(c, fd, pool)) {
+         tcpClose(w, c, fd, pool);
+         return;
+      }
+      if (c->buf == NULL)
+         return;
+      ev.events = EPOLLOUT;      /* the rest has to wait for room */
    }
    else {
-      sp = (AddrStat *)malloc(sizeof(AddrStat));
-      sp->addr = addr;
-      sp->bytes = bytes;
-      sp->packets = 1;
-      sp->start = time(NULL);
-      sp->next = NULL;
-      addrHash[bp[2]][bp[3]] = sp;
-      sp->nextlink = addrList;
-      addrList = sp;
+      if (!tcpFlush(c, fd, pool)) {
+         tcpClose(w, c, fd, pool);
+         return;
+      }
+      if (c->buf)
+         return;
+      ev.events = EPOLLIN;
    }
+   ev.data.fd = fd;
+   epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
 }
 
-static AddrStat *getStat(unsigned addr)
+/* writes what's pending, the buffer goes back once it's all out */
+static int tcpFlush(TcpConn *c, int fd, BufPool *pool)
 {
-   unsigned char *bp = (unsigned char *)&addr;
-   AddrStat *sp = addrHash[bp[2]][bp[3]];
-   if (sp) {
-      do {
-         if (sp->addr == addr)
-            break;
-         sp = sp->next;
-      }  while (sp);
+   int   n;
+
+   while (c->off < c->len) {
+      n = send(fd, c->buf + c->off, c->len - c->off, MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EINTR)
+            continue;
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      c->off += n;
    }
-   return sp;
+   pool_put(pool, c->buf);
+   c->buf = NULL;
+   return 1;
+}
+
+static void tcpClose(Worker *w, TcpConn *c, int fd, BufPool *pool)
+{
+   if (c->buf)
+      pool_put(pool, c->buf);
+   memset(c, 0, sizeof(TcpConn));
+   close(fd);                    /* drops it from the epoll set too */
+   __atomic_sub_fetch(&w->tcpopen, 1, __ATOMIC_RELAXED);
+}
+
+static char *pool_get(BufPool *pool)
+{
+   char  *buf;
+
+   if (pool->nfree)
+      return pool->free[--pool->nfree];
+   buf = (char *)malloc(TCPBUF);
+   if (buf == NULL)
+      errexit("Can't allocate a connection buffer\n");
+   pool->total++;
+   return buf;
+}
+
+static void pool_put(BufPool *pool, char *buf)
+{
+   if (pool->nfree == pool->size) {
+      pool->size = pool->size ? pool->size * 2 : 64;
+      pool->free = (char **)realloc(pool->free, pool->size * sizeof(char *));
+      if (pool->free == NULL)
+         errexit("Can't allocate the buffer pool\n");
+   }
+   pool->free[pool->nfree++] = buf;
+}
+#endif
+
+/* the i-th of the 'ntables' stat tables: udp workers first, then tcp */
+static AddrTable *statTable(int i)
+{
+   if (!serveudp || i >= nworkers)
+      return &workers[i % nworkers].tcpstats.table;
+   return &workers[i].stats.table;
+}
+
+/*
+ * Sums the stats for addr over the tables starting at 'first'.  The kernel
+ * shards by address and port, so one address can show up in several
+ * workers, and in both the udp and the tcp tables.  Returns 0 if addr was
+ * already seen in a table before 'first', which lets showStats walk every
+ * table and print each address once.
+ */
+static int mergeStat(unsigned addr, int first, AddrStat *merged)
+{
+   AddrStat snap;
+   int      i;
+
+   for (i = 0; i < first; i++)
+      if (addrstat_get(statTable(i), addr, &snap))
+         return 0;
+
+   memset(merged, 0, sizeof(AddrStat));
+   merged->addr = addr;
+   merged->start = LONG_MAX;
+   for (i = first; i < ntables; i++) {
+      if (addrstat_get(statTable(i), addr, &snap)) {
+         merged->bytes += snap.bytes;
+         merged->packets += snap.packets;
+         if (snap.start < merged->start)
+            merged->start = snap.start;
+      }
+   }
+   return merged->start != LONG_MAX;
 }
 
 static void printhelp(void)
@@ -137,11 +773,12 @@ static void printhelp(void)
 
 static void showStats(char *what)
 {
-   AddrStat *sp;
-   int      i , j, all, bps, kbits, count, packets;
+   AddrStat *sp, snap, merged;
+   int      i , j, all, bps, kbits, count;
    time_t   ttime, atime, mintime;
    double   tbytes, tbps;
-   unsigned addr;
+   unsigned addr, calls, filled, n, tcpopen, tcpaccepted;
+   unsigned long long packets, wpackets, dropped;
    struct in_addr iaddr;
    char     *s;
    
@@ -151,29 +788,64 @@ static void showStats(char *what)
       packets = 0;
       tbytes = 0;
       mintime = LONG_MAX;
-      for (sp = addrList; sp; sp = sp->nextlink) {
-         count++;
-         atime = time(NULL) - sp->start;
-         kbits = (sp->bytes / 1024) * 8;
-         bps = kbits / atime;
-         tbytes += sp->bytes;
-         packets += sp->packets;
-         if (sp->start < mintime)
-            mintime = sp->start;
-         if (all) {
-            iaddr.s_addr = sp->addr;
-            printf("%20s got %10d packets - %10d kbits at %10d kbps\n",
-                   inet_ntoa(iaddr), sp->packets, kbits, bps);
+      for (i = 0; i < ntables; i++) {
+         for (n = 0; n < addrstat_count(statTable(i)); n++) {
+            if (!addrstat_snap(statTable(i), n, &snap) ||
+                !mergeStat(snap.addr, i, &merged))
+               continue;
+            count++;
+            atime = time(NULL) - merged.start;
+            kbits = (merged.bytes / 1024) * 8;
+            bps = kbits / atime;
+            tbytes += merged.bytes;
+            packets += merged.packets;
+            if (merged.start < mintime)
+               mintime = merged.start;
+            if (all) {
+               iaddr.s_addr = merged.addr;
+               printf("%20s got %10llu packets - %10d kbits at %10d kbps\n",
+                      inet_ntoa(iaddr), merged.packets, kbits, bps);
+            }
          }
       }
       printf("---------------------------------------------------\n");
       printf("Number of addresses:  %d\n", count);
-      printf("Total Packets:        %d\n", packets);
+      printf("Total Packets:        %llu\n", packets);
       printf("Total Throughput:     %d mbps\n",
              (int)(((tbytes * 8) / ((time(NULL) - mintime))) / 0x100000));
       printf("Average Throughput:   %d kbps\n",
              (int)(((tbytes * 8 * 1024) / ((time(NULL) - mintime))) /
                    (count * 0x100000)));
+      calls = filled = tcpopen = tcpaccepted = 0;
+      dropped = 0;
+      for (i = 0; i < nworkers; i++) {
+         calls += workers[i].stats.batchCalls;
+         filled += workers[i].stats.batchPackets;
+         tcpopen += __atomic_load_n(&workers[i].tcpopen, __ATOMIC_RELAXED);
+         tcpaccepted += workers[i].tcpaccepted;
+      }
+      for (i = 0; i < ntables; i++)
+         dropped += addrstat_dropped(statTable(i));
+      if (dropped)
+         printf("Untracked packets:    %llu (raise -s)\n", dropped);
+      if (servetcp)
+         printf("TCP connections:      %u open, %u accepted\n",
+                tcpopen, tcpaccepted);
+      if (engine == ENGINE_URING && calls)
+         printf("Packets per enter:    %.1f\n", (double)filled / calls);
+      else if (batch > 1)
+         printf("Average batch fill:   %.1f of %d\n",
+                calls ? (double)filled / calls : 0.0, batch);
+      if (nworkers > 1) {
+         for (i = 0; i < nworkers; i++) {
+            wpackets = 0;
+            for (j = i; j < ntables; j += nworkers)
+               for (n = 0; n < addrstat_count(statTable(j)); n++)
+                  if (addrstat_snap(statTable(j), n, &snap))
+                     wpackets += snap.packets;
+            printf("Worker %2d packets:    %llu\n", i, wpackets);
+         }
+      }
    }
    else {
       addr = inet_addr(what);
@@ -181,13 +853,13 @@ static void showStats(char *what)
          printf("Bogus ip address: %s\n", s);
       }
       else {
-         sp = getStat(addr);
-         if (sp) {
+         if (mergeStat(addr, 0, &merged)) {
+            sp = &merged;
             atime = time(NULL) - sp->start;
             kbits = (sp->bytes / 1024) * 8;
             bps = kbits / atime;
             iaddr.s_addr = sp->addr;
-            printf("%20s got %10d packets - %10d kbits at %10d kbs\n",
+            printf("%20s got %10llu packets - %10d kbits at %10d kbs\n",
                    inet_ntoa(iaddr), sp->packets, kbits, bps);
          }
          else {
@@ -197,6 +869,44 @@ static void showStats(char *what)
    }
 }
 
+/*
+ * -S: every STATSEG_PERIOD ms, writes each source's counters, merged
+ * over the workers as showStats does, to the next record and the sums
+ * to record 0.  Snapshots are lock free, so the workers never wait.
+ */
+static void *publishThread(void *arg)
+{
+   AddrStat snap, merged;
+   StatRec  r, total;
+   unsigned n, used;
+   int      i;
+
+   while (1) {
+      usleep(STATSEG_PERIOD * 1000);
+      memset(&total, 0, sizeof(total));
+      used = 1;
+      for (i = 0; i < ntables; i++) {
+         for (n = 0; n < addrstat_count(statTable(i)); n++) {
+            if (!addrstat_snap(statTable(i), n, &snap) ||
+                !mergeStat(snap.addr, i, &merged))
+               continue;
+            memset(&r, 0, sizeof(r));
+            r.addr = merged.addr;
+            r.flags = STATREC_USED;
+            r.start = merged.start;
+            r.rcvd = merged.packets;
+            r.rcvdbytes = merged.bytes;
+            statseg_write(&statSeg, used++, &r);
+            statseg_sum(&total, &r);
+         }
+      }
+      total.flags = STATREC_USED;
+      statseg_write(&statSeg, 0, &total);
+      statseg_publish(&statSeg, used);
+   }
+   return NULL;
+}
+
 static void *statThread(char *port)
 {
    char hostname[100], prompt[100], rbuf[500], *s;
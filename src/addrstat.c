@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "addrstat.h"
+
+#define LOAD(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+/*
+ * fibonacci hashing, then a murmur style finish.  The low bits the mask
+ * keeps only depend on the low address bytes until the product's high
+ * half is folded in; without that a block like 10.0.0.1 up lands in a
+ * few dozen slots and sources get dropped.  Tables keyed on the port as
+ * well pass it in, this one passes 0.
+ */
+unsigned addrstat_hash(unsigned addr, unsigned port)
+{
+   unsigned h = (addr * 0x9e3779b1U) ^ port;
+
+   h ^= h >> 16;
+   h *= 0x85ebca6bU;
+   return h ^ (h >> 13);
+}
+
+/* sizes the table to at least twice 'sources' so probes stay short */
+int addrstat_init(AddrTable *t, unsigned sources)
+{
+   unsigned size = 64;
+   void     *mem;
+
+   while (size < sources * 2 && size < 0x80000000U)
+      size <<= 1;
+
+   memset(t, 0, sizeof(AddrTable));
+   if (posix_memalign(&mem, ADDRSTAT_LINE, size * sizeof(AddrSlot)))
+      return 0;
+   t->slots = (AddrSlot *)mem;
+   memset(t->slots, 0, size * sizeof(AddrSlot));
+   t->order = (unsigned *)calloc(size, sizeof(unsigned));
+   if (t->order == NULL) {
+      free(t->slots);
+      t->slots = NULL;
+      return 0;
+   }
+   t->mask = size - 1;
+   return 1;
+}
+
+/* writer side: bump the counters under the slot's sequence lock */
+static void update(AddrSlot *sl, unsigned bytes, unsigned packets)
+{
+   unsigned seq = LOAD(&sl->seq);
+
+   STORE(&sl->seq, seq + 1);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   STORE(&sl->bytes, LOAD(&sl->bytes) + bytes);
+   STORE(&sl->packets, LOAD(&sl->packets) + packets);
+   __atomic_store_n(&sl->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void addrstat_add(AddrTable *t, unsigned addr, unsigned bytes,
+                  unsigned packets)
+{
+   AddrSlot *sl;
+   unsigned h, i, key, n;
+
+   h = addrstat_hash(addr, 0);
+   for (i = 0; i < ADDRSTAT_MAXPROBE && i <= t->mask; i++) {
+      sl = &t->slots[(h + i) & t->mask];
+      key = __atomic_load_n(&sl->addr, __ATOMIC_ACQUIRE);
+      if (key == 0) {
+         if (__atomic_compare_exchange_n(&sl->addr, &key, addr, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            /* new source: fill in, then publish seq and insertion order */
+            STORE(&sl->seq, 1);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            STORE(&sl->bytes, (unsigned long long)bytes);
+            STORE(&sl->packets, (unsigned long long)packets);
+            STORE(&sl->start, time(NULL));
+            __atomic_store_n(&sl->seq, 2, __ATOMIC_RELEASE);
+
+            n = LOAD(&t->count);
+            t->order[n] = (h + i) & t->mask;
+            __atomic_store_n(&t->count, n + 1, __ATOMIC_RELEASE);
+            return;
+         }
+      }
+      if (key == addr) {
+         update(sl, bytes, packets);
+         return;
+      }
+   }
+   __atomic_fetch_add(&t->dropped, packets, __ATOMIC_RELAXED);
+}
+
+/* reader side: retry until the copy did not straddle a write */
+static int snapslot(AddrSlot *sl, AddrStat *snap)
+{
+   unsigned s1, s2;
+
+   do {
+      s1 = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+      if (s1 == 0)
+         return 0;      /* claimed but not yet published */
+      if (s1 & 1)
+         continue;
+      snap->addr = LOAD(&sl->addr);
+      snap->bytes = LOAD(&sl->bytes);
+      snap->packets = LOAD(&sl->packets);
+      snap->start = LOAD(&sl->start);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      s2 = LOAD(&sl->seq);
+   } while ((s1 & 1) || s1 != s2);
+   return 1;
+}
+
+int addrstat_get(AddrTable *t, unsigned addr, AddrStat *snap)
+{
+   AddrSlot *sl;
+   unsigned h, i, key;
+
+   h = addrstat_hash(addr, 0);
+   for (i = 0; i < ADDRSTAT_MAXPROBE && i <= t->mask; i++) {
+      sl = &t->slots[(h + i) & t->mask];
+      key = __atomic_load_n(&sl->addr, __ATOMIC_ACQUIRE);
+      if (key == 0)
+         return 0;
+      if (key == addr)
+         return snapslot(sl, snap);
+   }
+   return 0;
+}
+
+unsigned addrstat_count(AddrTable *t)
+{
+   return __atomic_load_n(&t->count, __ATOMIC_ACQUIRE);
+}
+
+/* snapshot of the n-th source in insertion order, n < addrstat_count() */
+int addrstat_snap(AddrTable *t, unsigned n, AddrStat *snap)
+{
+   return snapslot(&t->slots[t->order[n]], snap);
+}
+
+unsigned long long addrstat_dropped(AddrTable *t)
+{
+   return __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,53 @@
+#ifndef __ADDRSTAT_H__
+#define __ADDRSTAT_H__
+
+#include <time.h>
+
+#define ADDRSTAT_LINE      64    /* cache line, one slot per line */
+#define ADDRSTAT_MAXPROBE  64    /* bounds the per packet lookup */
+
+/* a consistent copy of one source's counters */
+typedef struct _AddrStat {
+   unsigned             addr;
+   unsigned long long   bytes;
+   unsigned long long   packets;
+   time_t               start;
+} AddrStat;
+
+/*
+ * One table slot.  addr is claimed with a CAS (0 means empty, so 0.0.0.0
+ * is never tracked) and the counters are guarded by a per slot sequence
+ * lock: odd while the owner is writing, 0 until the slot is published.
+ */
+typedef struct _AddrSlot {
+   unsigned             addr;
+   unsigned             seq;
+   unsigned long long   bytes;
+   unsigned long long   packets;
+   time_t               start;
+} __attribute__((aligned(ADDRSTAT_LINE))) AddrSlot;
+
+/*
+ * Preallocated open addressing table, linear probing over whole cache
+ * lines.  Counters are updated by a single writer thread per table while
+ * any number of threads take snapshots.  Sources that do not fit are
+ * counted in 'dropped' instead of being allocated.
+ */
+typedef struct _AddrTable {
+   AddrSlot             *slots;
+   unsigned             mask;       /* slots - 1, slots is a power of 2 */
+   unsigned             *order;     /* slot numbers in insertion order */
+   unsigned             count;      /* entries published in order */
+   unsigned long long   dropped;    /* packets from untracked sources */
+} AddrTable;
+
+extern int        addrstat_init(AddrTable *t, unsigned sources);
+extern void       addrstat_add(AddrTable *t, unsigned addr, unsigned bytes,
+                               unsigned packets);
+extern int        addrstat_get(AddrTable *t, unsigned addr, AddrStat *snap);
+extern unsigned   addrstat_count(AddrTable *t);
+extern int        addrstat_snap(AddrTable *t, unsigned n, AddrStat *snap);
+extern unsigned long long addrstat_dropped(AddrTable *t);
+extern unsigned   addrstat_hash(unsigned addr, unsigned port);
+
+#endif
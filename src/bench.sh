@@ -0,0 +1,165 @@
+#!/bin/sh
+# bench.sh - loopback benchmark, UDPecho2 against UDPechod
+#
+# Sweeps endpoint counts, frame sizes and offered loads.  Every run
+# starts a fresh reflector and generator, adds the endpoints, lets them
+# settle for WARMUP seconds and then measures for SECS seconds from the
+# generator's -S stats file and the two processes' cpu time.  One CSV
+# line per run is appended to OUT, so runs can be compared over time.
+#
+#   ENDPOINTS   endpoint counts              "1 100 1300 10000"
+#   SIZES       frame sizes, as -s takes     "128 1070 1500"
+#   LOADS       total offered kbps, as -l    "10000 100000 1000000"
+#   SECS        measured seconds per run     5
+#   WARMUP      seconds before measuring     2
+#   DRAIN       seconds for echoes to return 1
+#   OUT         results file                 bench.csv
+#   GENFLAGS    extra UDPecho2 flags         e.g. "-w 4 -e uring"
+#   REFLFLAGS   extra UDPechod flags         e.g. "-w 4 -b 64"
+#   PORT        reflector port, PORT+1 the generator's
+#
+# Loss is what was sent since the window opened and never came back:
+# the generator is paused when it closes and given DRAIN seconds, well
+# past any round trip, before the last totals are read.  Echoes of
+# probes already in flight when the window opened count as received, so
+# it can read a little low, never high.
+#
+# Round trip percentiles are the generator's since the endpoints were
+# added, warmup included.  cpu is user+system time from /proc, per
+# packet sent (generator) or echoed (reflector); with perf on the path
+# cycles per packet are added too.
+
+ENDPOINTS=${ENDPOINTS:-"1 100 1300 10000"}
+SIZES=${SIZES:-"128 1070 1500"}
+LOADS=${LOADS:-"10000 100000 1000000"}
+SECS=${SECS:-5}
+WARMUP=${WARMUP:-2}
+DRAIN=${DRAIN:-1}
+OUT=${OUT:-bench.csv}
+PORT=${PORT:-17000}
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d /tmp/bench.XXXXXX) || exit 1
+HZ=$(getconf CLK_TCK)
+REV=$(cd "$BIN" && git rev-parse --short HEAD 2>/dev/null || echo unknown)
+PERF=$(command -v perf)
+
+for p in UDPechod UDPecho2 statdump; do
+   if [ ! -x "$BIN/$p" ]; then
+      echo "bench.sh: no $BIN/$p, run make first" >&2
+      exit 1
+   fi
+done
+
+if [ ! -s "$OUT" ]; then
+   echo "date,rev,endpoints,size,load_kbps,secs,genflags,reflflags,tx_pps,rx_pps,rx_mbps,loss_pct,rtt_p50_us,rtt_p99_us,rtt_p999_us,rtt_max_us,gen_ns_pkt,refl_ns_pkt,gen_cycles_pkt,refl_cycles_pkt" > "$OUT"
+fi
+
+# user+system clock ticks of a process
+ticks() {
+   awk '{ sub(/^.*\) /, ""); print $12 + $13 }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+# generator totals: sent rcvd rcvdbytes p50 p99 p999 max count
+totals() {
+   "$BIN/statdump" -c "$TMP/gen.stat" 2>/dev/null | tail -1 |
+      awk -F, '{ print $6, $7, $9, $22, $24, $25, $26, $4 }'
+}
+
+now() {
+   date +%s.%N
+}
+
+# cycles a process spends over SECS, empty without perf
+cycles() {
+   if [ -n "$PERF" ]; then
+      "$PERF" stat -x, -e cycles -p $1 -o "$TMP/perf.$1" sleep $SECS \
+         >/dev/null 2>&1
+      awk -F, '$3 == "cycles" || $3 ~ /^cycles/ { print $1 }' "$TMP/perf.$1"
+   else
+      sleep $SECS
+   fi
+}
+
+cleanup() {
+   exec 3>&- 4>&-
+   kill $GEN $REFL 2>/dev/null
+   wait 2>/dev/null
+}
+
+run() {
+   n=$1 size=$2 load=$3
+
+   # both read commands from stdin and quit at its end, so hold fifos open
+   rm -f "$TMP/gen.in" "$TMP/refl.in" "$TMP/gen.stat"
+   mkfifo "$TMP/gen.in" "$TMP/refl.in"
+   (cd "$TMP" && exec "$BIN/UDPechod" $REFLFLAGS $PORT \
+       < refl.in > refl.out 2>&1) &
+   REFL=$!
+   exec 4> "$TMP/refl.in"
+   (cd "$TMP" && exec "$BIN/UDPecho2" -p $((PORT + 1)) -l $load -s $size \
+       -S gen.stat $GENFLAGS < gen.in > gen.out 2>&1) &
+   GEN=$!
+   exec 3> "$TMP/gen.in"
+   sleep 1
+
+   # distinct loopback addresses, the reflector answers them all
+   awk -v n=$n -v port=$PORT 'BEGIN {
+      for (i = 0; i < n; i++)
+         printf "add 127.%d.%d.%d %d\n", 1 + int(i / 62500),
+                int(i / 250) % 250, i % 250 + 1, port
+   }' >&3
+
+   t=0
+   while [ "$(totals | awk '{ print $8 }')" != "$n" ]; do
+      sleep 1
+      t=$((t + 1))
+      if [ $t -gt 600 ]; then
+         echo "bench.sh: $n endpoints never came up" >&2
+         cleanup
+         return
+      fi
+   done
+   sleep $WARMUP
+
+   a=$(totals) ga=$(ticks $GEN) ra=$(ticks $REFL) ta=$(now)
+   cycles $REFL > "$TMP/refl.cycles" &
+   gc=$(cycles $GEN)
+   wait $!
+   rc=$(cat "$TMP/refl.cycles")
+   b=$(totals) gb=$(ticks $GEN) rb=$(ticks $REFL) tb=$(now)
+   echo pause >&3
+   sleep $DRAIN
+   c=$(totals)
+   cleanup
+
+   echo $a $b $ga $gb $ra $rb $ta $tb "${gc:--}" "${rc:--}" $c | awk \
+      -v hz=$HZ -v date="$(date -u +%Y-%m-%dT%H:%M:%SZ)" -v rev=$REV \
+      -v n=$n -v size=$size -v load=$load \
+      -v gf="$GENFLAGS" -v rf="$REFLFLAGS" '{
+      secs = $22 - $21
+      sent = $9 - $1; rcvd = $10 - $2; bytes = $11 - $3
+      gns = sent ? ($18 - $17) / hz * 1e9 / sent : 0
+      rns = rcvd ? ($20 - $19) / hz * 1e9 / rcvd : 0
+      gcy = ($23 != "-" && sent) ? sprintf("%.0f", $23 / sent) : ""
+      rcy = ($24 != "-" && rcvd) ? sprintf("%.0f", $24 / rcvd) : ""
+      out = $25 - $1; lost = out - ($26 - $2)
+      if (lost < 0)
+         lost = 0
+      printf "%s,%s,%d,%d,%d,%.2f,%s,%s,%.0f,%.0f,%.2f,%.3f,%.1f,%.1f,%.1f,%.1f,%.0f,%.0f,%s,%s\n",
+             date, rev, n, size, load, secs, gf, rf, sent / secs,
+             rcvd / secs, bytes * 8 / secs / 1e6,
+             out ? 100 * lost / out : 0, $12 / 1e3, $13 / 1e3,
+             $14 / 1e3, $15 / 1e3, gns, rns, gcy, rcy
+   }' | tee -a "$OUT"
+}
+
+trap 'cleanup; rm -rf "$TMP"; exit 1' INT TERM
+for n in $ENDPOINTS; do
+   for size in $SIZES; do
+      for load in $LOADS; do
+         run $n $size $load
+      done
+   done
+done
+rm -rf "$TMP"
@@ -0,0 +1,227 @@
+#include <string.h>
+
+#include "bert.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BERT_X86
+#include <immintrin.h>
+#endif
+
+#define CHUNK     256      /* bytes regenerated per compare call */
+#define MASK(b)   (((unsigned long long)1 << (b)) - 1)
+
+typedef unsigned long long (*CountFunc)(const unsigned char *a,
+                                        const unsigned char *b, unsigned n);
+
+static unsigned long long countGeneric(const unsigned char *a,
+                                       const unsigned char *b, unsigned n);
+#ifdef BERT_X86
+static unsigned long long countSse(const unsigned char *a,
+                                   const unsigned char *b, unsigned n);
+static unsigned long long countAvx2(const unsigned char *a,
+                                    const unsigned char *b, unsigned n);
+#endif
+
+static CountFunc  count = countGeneric;
+static char       *impl = "generic";
+
+void bert_init(void)
+{
+#ifdef BERT_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      count = countAvx2;
+      impl = "avx2";
+   }
+   else if (__builtin_cpu_supports("sse4.2") &&
+            __builtin_cpu_supports("popcnt")) {
+      count = countSse;
+      impl = "sse4.2";
+   }
+#endif
+}
+
+const char *bert_impl(void)
+{
+   return impl;
+}
+
+/* a nonzero starting state for the register, different for every probe */
+unsigned bert_seed(int prbs, unsigned id, unsigned seq)
+{
+   unsigned s = id * 0x9e3779b1U ^ seq * 0x85ebca6bU;
+
+   s ^= s >> 15;
+   s *= 0x2c1b3c6dU;
+   s ^= s >> 12;
+   s &= (unsigned)MASK(prbs);
+   return s ? s : 1;
+}
+
+/*
+ * Generator state: the last 'hist' bits of the sequence, newest in bit 0.
+ * x[n] = x[n-L] ^ x[n-T] for the polynomial x^L + x^T + 1, so the next T
+ * bits come out of one shift and xor.  Squaring the polynomial doubles
+ * both lags, so once 2L bits of history exist the same trick yields 2T
+ * bits per step, which is what runs for all but the first few bytes.
+ */
+typedef struct _Prbs {
+   unsigned long long   hist;
+   unsigned long long   acc;     /* bits generated, not yet stored */
+   int                  nacc;
+   int                  lag;
+   int                  tap;
+} Prbs;
+
+static void start(Prbs *g, int prbs, unsigned seed)
+{
+   unsigned long long   n;
+   int                  tap = prbs == BERT_PRBS23 ? 18 : 28;
+
+   g->hist = seed & MASK(prbs);
+   g->acc = 0;
+   g->nacc = 0;
+   /* grow the history to twice the lag with single steps */
+   while (g->nacc < prbs) {
+      n = ((g->hist >> (prbs - tap)) ^ g->hist) & MASK(tap);
+      g->hist = ((g->hist << tap) | n) & MASK(2 * prbs);
+      g->acc = (g->acc << tap) | n;
+      g->nacc += tap;
+   }
+   g->lag = 2 * prbs;
+   g->tap = 2 * tap;
+}
+
+/*
+ * Next n bytes of the sequence, most significant bit first.  Whole
+ * 64-bit words are stored while they last; acc never holds 64 bits.
+ */
+static void gen(Prbs *g, unsigned char *buf, unsigned n)
+{
+   unsigned long long   x, w;
+   int                  lag = g->lag, tap = g->tap, r, k;
+
+   while (n >= 8) {
+      x = ((g->hist >> (lag - tap)) ^ g->hist) & MASK(tap);
+      g->hist = ((g->hist << tap) | x) & MASK(lag);
+      if (g->nacc + tap < 64) {
+         g->acc = (g->acc << tap) | x;
+         g->nacc += tap;
+         continue;
+      }
+      r = g->nacc + tap - 64;
+      w = (g->acc << (64 - g->nacc)) | (x >> r);
+      for (k = 0; k < 8; k++)
+         buf[k] = (unsigned char)(w >> (56 - 8 * k));
+      buf += 8;
+      n -= 8;
+      g->acc = x & MASK(r);
+      g->nacc = r;
+   }
+   while (n) {
+      if (g->nacc < 8) {
+         x = ((g->hist >> (lag - tap)) ^ g->hist) & MASK(tap);
+         g->hist = ((g->hist << tap) | x) & MASK(lag);
+         g->acc = (g->acc << tap) | x;
+         g->nacc += tap;
+      }
+      g->nacc -= 8;
+      *buf++ = (unsigned char)(g->acc >> g->nacc);
+      g->acc &= MASK(g->nacc);
+      n--;
+   }
+}
+
+void bert_fill(int prbs, unsigned seed, unsigned char *buf, unsigned n)
+{
+   Prbs  g;
+
+   start(&g, prbs, seed);
+   gen(&g, buf, n);
+}
+
+/* bits of buf that differ from what bert_fill would have put there */
+unsigned long long bert_check(int prbs, unsigned seed,
+                              const unsigned char *buf, unsigned n)
+{
+   unsigned char        want[CHUNK];
+   unsigned long long   errs = 0;
+   unsigned             k;
+   Prbs                 g;
+
+   start(&g, prbs, seed);
+   for (; n; n -= k, buf += k) {
+      k = n < CHUNK ? n : CHUNK;
+      gen(&g, want, k);
+      errs += count(want, buf, k);
+   }
+   return errs;
+}
+
+static unsigned long long countGeneric(const unsigned char *a,
+                                       const unsigned char *b, unsigned n)
+{
+   unsigned long long   x, y, errs = 0;
+   unsigned             i;
+
+   for (i = 0; i + 8 <= n; i += 8) {
+      memcpy(&x, a + i, 8);
+      memcpy(&y, b + i, 8);
+      errs += __builtin_popcountll(x ^ y);
+   }
+   for (; i < n; i++)
+      errs += __builtin_popcount(a[i] ^ b[i]);
+   return errs;
+}
+
+#ifdef BERT_X86
+__attribute__((target("sse4.2,popcnt")))
+static unsigned long long countSse(const unsigned char *a,
+                                   const unsigned char *b, unsigned n)
+{
+   unsigned long long   errs = 0;
+   unsigned             i;
+   __m128i              x;
+
+   for (i = 0; i + 16 <= n; i += 16) {
+      x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                        _mm_loadu_si128((const __m128i *)(b + i)));
+      errs += _mm_popcnt_u64(_mm_cvtsi128_si64(x)) +
+              _mm_popcnt_u64(_mm_extract_epi64(x, 1));
+   }
+   return errs + countGeneric(a + i, b + i, n - i);
+}
+
+/*
+ * 32 bytes at a time: popcount each nibble with a shuffle lookup, and
+ * fold the byte counts into four 64-bit sums with a sum of absolute
+ * differences every iteration, so nothing can overflow.
+ */
+__attribute__((target("avx2")))
+static unsigned long long countAvx2(const unsigned char *a,
+                                    const unsigned char *b, unsigned n)
+{
+   const __m256i  lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+   const __m256i  low = _mm256_set1_epi8(0x0f);
+   __m256i        x, c, sum = _mm256_setzero_si256();
+   unsigned long long s[4];
+   unsigned       i;
+
+   for (i = 0; i + 32 <= n; i += 32) {
+      x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                           _mm256_loadu_si256((const __m256i *)(b + i)));
+      c = _mm256_add_epi8(
+             _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+             _mm256_shuffle_epi8(lut,
+                                 _mm256_and_si256(_mm256_srli_epi16(x, 4),
+                                                  low)));
+      sum = _mm256_add_epi64(sum, _mm256_sad_epu8(c,
+                                                  _mm256_setzero_si256()));
+   }
+   _mm256_storeu_si256((__m256i *)s, sum);
+   return s[0] + s[1] + s[2] + s[3] + countGeneric(a + i, b + i, n - i);
+}
+#endif
@@ -0,0 +1,23 @@
+#ifndef __BERT_H__
+#define __BERT_H__
+
+#define BERT_NONE    0
+#define BERT_PRBS23  23     /* x^23 + x^18 + 1 */
+#define BERT_PRBS31  31     /* x^31 + x^28 + 1 */
+
+/*
+ * Bit error rate test payloads.  A payload is a stretch of a PRBS whose
+ * starting state comes from the probe's endpoint id and sequence, so the
+ * receiver can regenerate exactly what was sent and count differing bits.
+ * The count uses the widest xor and popcount the cpu has, picked once by
+ * bert_init().
+ */
+extern void               bert_init(void);
+extern const char         *bert_impl(void);
+extern unsigned           bert_seed(int prbs, unsigned id, unsigned seq);
+extern void               bert_fill(int prbs, unsigned seed,
+                                    unsigned char *buf, unsigned n);
+extern unsigned long long bert_check(int prbs, unsigned seed,
+                                     const unsigned char *buf, unsigned n);
+
+#endif
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+
+#define LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int epoch_init(Epoch *e, unsigned maxreaders)
+{
+   void  *mem;
+
+   memset(e, 0, sizeof(Epoch));
+   if (posix_memalign(&mem, EPOCH_LINE, maxreaders * sizeof(EpochReader)))
+      return 0;
+   e->readers = (EpochReader *)mem;
+   memset(e->readers, 0, maxreaders * sizeof(EpochReader));
+   e->maxreaders = maxreaders;
+   e->global = 2;
+   return 1;
+}
+
+/* a reader slot for the calling thread, -1 if they are all taken */
+int epoch_register(Epoch *e)
+{
+   unsigned r = __atomic_fetch_add(&e->nreaders, 1, __ATOMIC_RELAXED);
+
+   return r < e->maxreaders ? (int)r : -1;
+}
+
+void epoch_enter(Epoch *e, int reader)
+{
+   __atomic_store_n(&e->readers[reader].state,
+                    (LOAD(&e->global) << 1) | 1, __ATOMIC_RELAXED);
+   /* the announcement must be visible before we load any pointers */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(Epoch *e, int reader)
+{
+   STORE(&e->readers[reader].state, 0);
+}
+
+/* ptr is already unreachable for new readers, release it when it's safe */
+void epoch_retire(Epoch *e, void *ptr, void (*release)(void *))
+{
+   EpochItem   *it;
+
+   it = (EpochItem *)malloc(sizeof(EpochItem));
+   if (it == NULL) {
+      fprintf(stderr, "epoch_retire: out of memory, leaking %p\n", ptr);
+      return;
+   }
+   it->ptr = ptr;
+   it->release = release;
+   it->epoch = LOAD(&e->global);
+   it->next = e->retired;
+   e->retired = it;
+   e->pending++;
+}
+
+/*
+ * Moves the global epoch on if every active reader has caught up with it,
+ * then releases whatever was retired two epochs ago or earlier.  Never
+ * waits for readers.  Returns the number of items still pending.
+ */
+unsigned epoch_reclaim(Epoch *e)
+{
+   EpochItem            *it, **pp;
+   unsigned long long   global, state;
+   unsigned             i, n;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   global = LOAD(&e->global);
+   n = LOAD(&e->nreaders);
+   if (n > e->maxreaders)
+      n = e->maxreaders;
+   for (i = 0; i < n; i++) {
+      state = LOAD(&e->readers[i].state);
+      if ((state & 1) && (state >> 1) != global)
+         break;
+   }
+   if (i == n)
+      STORE(&e->global, ++global);
+
+   for (pp = &e->retired; (it = *pp) != NULL; ) {
+      if (it->epoch + 2 <= global) {
+         *pp = it->next;
+         it->release(it->ptr);
+         free(it);
+         e->pending--;
+      }
+      else
+         pp = &it->next;
+   }
+   return e->pending;
+}
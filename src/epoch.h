@@ -0,0 +1,46 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#define EPOCH_LINE   64    /* cache line, one reader per line */
+
+/*
+ * A reader's announced epoch: (epoch << 1) | 1 while it is inside a read
+ * side section, 0 while it is outside and holds no references.
+ */
+typedef struct _EpochReader {
+   unsigned long long   state;
+} __attribute__((aligned(EPOCH_LINE))) EpochReader;
+
+/* something unpublished, waiting for the readers that might see it */
+typedef struct _EpochItem {
+   void                 *ptr;
+   void                 (*release)(void *);
+   unsigned long long   epoch;      /* global epoch when it was retired */
+   struct _EpochItem    *next;
+} EpochItem;
+
+/*
+ * Epoch based reclamation.  Readers bracket their accesses with
+ * epoch_enter/epoch_exit and never block a writer.  A single writer at a
+ * time (the caller serializes them) unpublishes an object, hands it to
+ * epoch_retire, and it is released once the global epoch has moved on
+ * twice, which can only happen after every reader that was inside when
+ * it was retired has left.
+ */
+typedef struct _Epoch {
+   unsigned long long   global;
+   EpochReader          *readers;
+   unsigned             maxreaders;
+   unsigned             nreaders;
+   EpochItem            *retired;   /* newest first, writer only */
+   unsigned             pending;
+} Epoch;
+
+extern int        epoch_init(Epoch *e, unsigned maxreaders);
+extern int        epoch_register(Epoch *e);
+extern void       epoch_enter(Epoch *e, int reader);
+extern void       epoch_exit(Epoch *e, int reader);
+extern void       epoch_retire(Epoch *e, void *ptr, void (*release)(void *));
+extern unsigned   epoch_reclaim(Epoch *e);
+
+#endif
@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include "hdrhist.h"
+
+#define TOPBUCKET    (HDRHIST_BUCKETS - 1)
+
+/* bucket for v: a shift and the top HDRHIST_SUBBITS+1 bits below it */
+static unsigned bucket(unsigned long long v)
+{
+   unsigned shift;
+
+   if (v < 2 * HDRHIST_SUB)
+      return (unsigned)v;
+   if (v >> HDRHIST_MAXBITS)
+      return TOPBUCKET;
+   shift = 63 - __builtin_clzll(v) - HDRHIST_SUBBITS;
+   return shift * HDRHIST_SUB + (unsigned)(v >> shift);
+}
+
+/* largest value that lands in bucket b */
+static unsigned long long highest(unsigned b)
+{
+   unsigned shift;
+
+   if (b < 2 * HDRHIST_SUB)
+      return b;
+   shift = b / HDRHIST_SUB - 1;
+   return ((unsigned long long)(b - shift * HDRHIST_SUB) << shift) +
+          ((1ULL << shift) - 1);
+}
+
+void hdrhist_init(HdrHist *h)
+{
+   memset(h, 0, sizeof(HdrHist));
+   h->min = ~0ULL;
+}
+
+void hdrhist_record(HdrHist *h, unsigned long long v)
+{
+   h->counts[bucket(v)]++;
+   h->count++;
+   h->total += v;
+   if (v < h->min)
+      h->min = v;
+   if (v > h->max)
+      h->max = v;
+}
+
+void hdrhist_merge(HdrHist *dst, HdrHist *src)
+{
+   unsigned i;
+
+   if (src->count == 0)
+      return;
+   for (i = 0; i < HDRHIST_BUCKETS; i++)
+      dst->counts[i] += src->counts[i];
+   dst->count += src->count;
+   dst->total += src->total;
+   if (src->min < dst->min)
+      dst->min = src->min;
+   if (src->max > dst->max)
+      dst->max = src->max;
+}
+
+/* smallest value at or above pct percent of the samples, 0 if empty */
+unsigned long long hdrhist_percentile(HdrHist *h, double pct)
+{
+   unsigned long long want, seen = 0, v;
+   unsigned           i;
+
+   if (h->count == 0)
+      return 0;
+   want = (unsigned long long)(pct / 100.0 * h->count + 0.5);
+   if (want < 1)
+      want = 1;
+   for (i = 0; i < HDRHIST_BUCKETS; i++) {
+      seen += h->counts[i];
+      if (seen >= want) {
+         if (i == TOPBUCKET)
+            break;
+         v = highest(i);
+         return v < h->max ? v : h->max;
+      }
+   }
+   return h->max;
+}
+
+unsigned long long hdrhist_mean(HdrHist *h)
+{
+   return h->count ? h->total / h->count : 0;
+}
+
+/*
+ * What was recorded into a histogram between two copies of it, 'then'
+ * taken before 'now'.  min and max of the difference are only known to
+ * bucket precision.
+ */
+void hdrhist_sub(HdrHist *dst, HdrHist *now, HdrHist *then)
+{
+   unsigned i;
+
+   hdrhist_init(dst);
+   for (i = 0; i < HDRHIST_BUCKETS; i++) {
+      dst->counts[i] = now->counts[i] - then->counts[i];
+      if (dst->counts[i] == 0)
+         continue;
+      if (dst->min == ~0ULL)
+         dst->min = i ? highest(i - 1) + 1 : 0;
+      dst->max = highest(i);
+   }
+   dst->count = now->count - then->count;
+   dst->total = now->total - then->total;
+   if (dst->max > now->max)
+      dst->max = now->max;
+   if (dst->min < now->min)
+      dst->min = now->min;
+}
@@ -0,0 +1,34 @@
+#ifndef __HDRHIST_H__
+#define __HDRHIST_H__
+
+#define HDRHIST_SUBBITS    6        /* 64 sub-buckets per power of 2, ~1.6% */
+#define HDRHIST_SUB        (1 << HDRHIST_SUBBITS)
+#define HDRHIST_MAXBITS    40       /* values up to 2^40 ns, about 18 min */
+#define HDRHIST_BUCKETS    ((HDRHIST_MAXBITS - HDRHIST_SUBBITS + 1) * \
+                            HDRHIST_SUB + HDRHIST_SUB)
+
+/*
+ * Log-linear latency histogram in the HdrHistogram style.  Values below
+ * 2 * HDRHIST_SUB land in exact buckets.  Above that, every power of 2
+ * is cut into HDRHIST_SUB equal buckets, so a recorded value is never
+ * off by more than 1 / HDRHIST_SUB.  Fixed size and no allocation,
+ * so it can sit inside whatever it measures.  Merging is bucket-wise
+ * addition.
+ */
+typedef struct _HdrHist {
+   unsigned long long   count;
+   unsigned long long   total;      /* sum of all values, for the mean */
+   unsigned long long   min;
+   unsigned long long   max;
+   unsigned             counts[HDRHIST_BUCKETS];
+} HdrHist;
+
+extern void               hdrhist_init(HdrHist *h);
+extern void               hdrhist_record(HdrHist *h, unsigned long long v);
+extern void               hdrhist_merge(HdrHist *dst, HdrHist *src);
+extern unsigned long long hdrhist_percentile(HdrHist *h, double pct);
+extern unsigned long long hdrhist_mean(HdrHist *h);
+extern void               hdrhist_sub(HdrHist *dst, HdrHist *now,
+                                      HdrHist *then);
+
+#endif
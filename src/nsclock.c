@@ -0,0 +1,41 @@
+#include <time.h>
+#include <errno.h>
+
+#include "nsclock.h"
+
+#ifdef CLOCK_MONOTONIC
+#define NSCLOCK   CLOCK_MONOTONIC
+#else
+#define NSCLOCK   CLOCK_REALTIME
+#endif
+
+unsigned long long nsclock_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(NSCLOCK, &ts);
+   return (unsigned long long)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* sleeps until an absolute nsclock_now() time, immune to early wakeups */
+void nsclock_sleepuntil(unsigned long long when)
+{
+   struct timespec ts;
+
+   ts.tv_sec = when / NSEC;
+   ts.tv_nsec = when % NSEC;
+#ifdef TIMER_ABSTIME
+   while (clock_nanosleep(NSCLOCK, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+#else
+   {
+      unsigned long long now = nsclock_now();
+      if (when > now) {
+         ts.tv_sec = (when - now) / NSEC;
+         ts.tv_nsec = (when - now) % NSEC;
+         while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+      }
+   }
+#endif
+}
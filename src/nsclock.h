@@ -0,0 +1,10 @@
+#ifndef __NSCLOCK_H__
+#define __NSCLOCK_H__
+
+#define NSEC   1000000000ULL
+
+/* nanoseconds on a clock that never steps, for pacing and round trips */
+extern unsigned long long nsclock_now(void);
+extern void               nsclock_sleepuntil(unsigned long long when);
+
+#endif
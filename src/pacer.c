@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "nsclock.h"
+#include "pacer.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define CPU_RELAX()  __builtin_ia32_pause()
+#else
+#define CPU_RELAX()
+#endif
+
+void pacer_init(Pacer *p, unsigned long long bps)
+{
+   memset(p, 0, sizeof(Pacer));
+   p->rate = bps;
+   p->next = nsclock_now();
+}
+
+/*
+ * New rate applies from the next packet on.  Credit already earned is
+ * kept (pacer_wait still caps it at PACER_BURST), so frequent rate
+ * changes don't cost throughput.
+ */
+void pacer_setrate(Pacer *p, unsigned long long bps)
+{
+   p->rate = bps;
+   p->frac = 0;
+}
+
+/* ns until the next packet may leave, 0 if it may go now */
+unsigned long long pacer_due(Pacer *p)
+{
+   unsigned long long now;
+
+   if (p->rate == 0)
+      return 0;
+   now = nsclock_now();
+   return p->next > now ? p->next - now : 0;
+}
+
+/* blocks until 'bits' more bits fit the rate, then charges them */
+void pacer_wait(Pacer *p, unsigned bits)
+{
+   unsigned long long now, num;
+
+   p->bits += bits;
+   if (p->rate == 0)
+      return;
+
+   now = nsclock_now();
+   if (p->next + PACER_BURST < now) {
+      /* idle for a while: keep at most PACER_BURST of credit */
+      p->next = now - PACER_BURST;
+      p->frac = 0;
+   }
+
+   if (p->next > now) {
+      if (p->next - now > PACER_SPIN)
+         nsclock_sleepuntil(p->next - PACER_SPIN);
+      while (nsclock_now() < p->next)
+         CPU_RELAX();
+   }
+
+   /* advance by this packet's serialization time at 'rate' */
+   num = (unsigned long long)bits * NSEC;
+   p->next += num / p->rate;
+   p->frac += num % p->rate;
+   if (p->frac >= p->rate) {
+      p->next++;
+      p->frac -= p->rate;
+   }
+}
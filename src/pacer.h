@@ -0,0 +1,26 @@
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#define PACER_SPIN     50000ULL   /* ns, waits shorter than this spin */
+#define PACER_BURST    2000000ULL /* ns of credit a stalled sender may reuse */
+
+/*
+ * Token bucket pacer in virtual scheduling form: 'next' is the time the
+ * bucket holds enough tokens for the next packet, every packet pushes it
+ * out by its size at the configured rate.  Long waits sleep on the
+ * monotonic clock, the last PACER_SPIN ns are spun so packets leave at
+ * sub-microsecond spacing instead of in scheduler tick sized clumps.
+ */
+typedef struct _Pacer {
+   unsigned long long   rate;    /* bits per second, 0 = unpaced */
+   unsigned long long   next;    /* ns when the next packet may go */
+   unsigned long long   frac;    /* remainder of next, in 1/rate ns */
+   unsigned long long   bits;    /* total bits let through */
+} Pacer;
+
+extern void               pacer_init(Pacer *p, unsigned long long bps);
+extern void               pacer_setrate(Pacer *p, unsigned long long bps);
+extern unsigned long long pacer_due(Pacer *p);
+extern void               pacer_wait(Pacer *p, unsigned bits);
+
+#endif
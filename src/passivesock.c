@@ -14,6 +14,7 @@ extern int	errno;
 int	errexit(const char *format, ...);
 
 u_short	portbase = 0;		/* port base, for non-root servers	*/
+int	reuseport = 0;		/* share the port between sockets	*/
 
 /*------------------------------------------------------------------------
  * passivesock - allocate & bind a server socket using TCP or UDP
@@ -59,6 +60,13 @@ passivesock(const char *service, const char *transport, int qlen)
 	if (s < 0)
 		errexit("can't create socket: %s\n", strerror(errno));
 
+#ifdef SO_REUSEPORT
+    /* Let several sockets bind the same port, kernel shards the load */
+	if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+			(char *)&reuseport, sizeof(reuseport)) < 0)
+		errexit("can't set SO_REUSEPORT: %s\n", strerror(errno));
+#endif
+
     /* Bind the socket */
 	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
 		errexit("can't bind to %s port: %s\n", service,
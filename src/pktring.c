@@ -0,0 +1,277 @@
+/* pktring.c - AF_PACKET mmap'd ring reflector engine */
+
+/*
+ * Frames injected on lo carry a 127/8 or local source and arrive without
+ * a route attached, so the stack drops them as martians unless both
+ * net.ipv4.conf.lo.accept_local and route_localnet are set.  A veth pair
+ * needs no such tuning.
+ */
+
+#ifdef linux
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "pktring.h"
+
+extern int  errexit(const char *format, ...);
+
+#define ETHLEN          14
+#define TXDATA          TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+/*------------------------------------------------------------------------
+ * udpfilter - classic BPF for "ip and udp dst port N and not fragment",
+ *             so the kernel only copies our probes into the ring
+ *------------------------------------------------------------------------
+ */
+static void udpfilter(int s, unsigned short port)
+{
+   struct sock_filter code[] = {
+      { 0x28, 0, 0, 12 },                 /* ldh [12]           */
+      { 0x15, 0, 8, ETH_P_IP },           /* jne #ip, drop      */
+      { 0x30, 0, 0, 23 },                 /* ldb [23]           */
+      { 0x15, 0, 6, IPPROTO_UDP },        /* jne #udp, drop     */
+      { 0x28, 0, 0, 20 },                 /* ldh [20]           */
+      { 0x45, 4, 0, 0x1fff },             /* jset #frag, drop   */
+      { 0xb1, 0, 0, ETHLEN },             /* ldxb 4*([14]&0xf)  */
+      { 0x48, 0, 0, ETHLEN + 2 },         /* ldh [x + 16]       */
+      { 0x15, 0, 1, 0 },                  /* jne #port, drop    */
+      { 0x06, 0, 0, 0xffff },             /* ret #65535         */
+      { 0x06, 0, 0, 0 },                  /* drop: ret #0       */
+   };
+   struct sock_fprog prog;
+
+   code[8].k = ntohs(port);
+   prog.len = sizeof(code) / sizeof(code[0]);
+   prog.filter = code;
+   if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+      errexit("can't attach packet filter: %s\n", strerror(errno));
+}
+
+static void bindif(int s, int ifindex, int proto)
+{
+   struct sockaddr_ll sll;
+
+   memset(&sll, 0, sizeof(sll));
+   sll.sll_family = AF_PACKET;
+   sll.sll_protocol = proto;
+   sll.sll_ifindex = ifindex;
+   if (bind(s, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+      errexit("can't bind packet socket: %s\n", strerror(errno));
+}
+
+/*------------------------------------------------------------------------
+ * pktring_open - map the rx and tx rings on ifname for udp port 'port'
+ *                (network order).  fanout != 0 joins a PACKET_FANOUT
+ *                group so several workers split the flows by hash.
+ *------------------------------------------------------------------------
+ */
+int pktring_open(PktRing *r, const char *ifname, unsigned short port,
+                 int fanout)
+{
+   struct tpacket_req3  rreq;
+   struct tpacket_req   treq;
+   int                  ifindex, v, one = 1;
+
+   memset(r, 0, sizeof(PktRing));
+   r->port = port;
+
+   ifindex = if_nametoindex(ifname);
+   if (ifindex == 0)
+      errexit("can't find interface %s\n", ifname);
+   if (strcmp(ifname, "lo") == 0)
+      printf("packet engine on lo needs sysctl net.ipv4.conf.lo.accept_local=1"
+             " and route_localnet=1\n");
+
+   /* receive side, TPACKET_V3 hands us whole blocks of frames */
+   r->rxsock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+   if (r->rxsock < 0)
+      errexit("can't create packet socket: %s\n", strerror(errno));
+   udpfilter(r->rxsock, port);
+   v = TPACKET_V3;
+   if (setsockopt(r->rxsock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0)
+      errexit("can't set TPACKET_V3: %s\n", strerror(errno));
+#ifdef PACKET_IGNORE_OUTGOING
+   /* on lo every frame shows up outgoing and again incoming */
+   setsockopt(r->rxsock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+              sizeof(one));
+#endif
+   memset(&rreq, 0, sizeof(rreq));
+   rreq.tp_block_size = PKTRING_BLOCKSIZE;
+   rreq.tp_block_nr = PKTRING_BLOCKS;
+   rreq.tp_frame_size = PKTRING_FRAMESIZE;
+   rreq.tp_frame_nr = (PKTRING_BLOCKSIZE / PKTRING_FRAMESIZE) * PKTRING_BLOCKS;
+   rreq.tp_retire_blk_tov = PKTRING_TIMEOUT;
+   if (setsockopt(r->rxsock, SOL_PACKET, PACKET_RX_RING, &rreq,
+                  sizeof(rreq)) < 0)
+      errexit("can't set up rx ring: %s\n", strerror(errno));
+   r->rxring = mmap(NULL, PKTRING_BLOCKSIZE * PKTRING_BLOCKS,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
+                    r->rxsock, 0);
+   if (r->rxring == MAP_FAILED)
+      r->rxring = mmap(NULL, PKTRING_BLOCKSIZE * PKTRING_BLOCKS,
+                       PROT_READ | PROT_WRITE, MAP_SHARED, r->rxsock, 0);
+   if (r->rxring == MAP_FAILED)
+      errexit("can't map rx ring: %s\n", strerror(errno));
+   bindif(r->rxsock, ifindex, htons(ETH_P_IP));
+   if (fanout) {
+      v = (fanout & 0xffff) | (PACKET_FANOUT_HASH << 16);
+      if (setsockopt(r->rxsock, SOL_PACKET, PACKET_FANOUT, &v, sizeof(v)) < 0)
+         errexit("can't join fanout group: %s\n", strerror(errno));
+   }
+
+   /* transmit side, protocol 0 so this socket never receives */
+   r->txsock = socket(AF_PACKET, SOCK_RAW, 0);
+   if (r->txsock < 0)
+      errexit("can't create packet socket: %s\n", strerror(errno));
+   v = TPACKET_V2;
+   if (setsockopt(r->txsock, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0)
+      errexit("can't set TPACKET_V2: %s\n", strerror(errno));
+#ifdef PACKET_QDISC_BYPASS
+   setsockopt(r->txsock, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+#endif
+   memset(&treq, 0, sizeof(treq));
+   treq.tp_block_size = PKTRING_FRAMESIZE * 32;
+   treq.tp_block_nr = PKTRING_TXFRAMES / 32;
+   treq.tp_frame_size = PKTRING_FRAMESIZE;
+   treq.tp_frame_nr = PKTRING_TXFRAMES;
+   if (setsockopt(r->txsock, SOL_PACKET, PACKET_TX_RING, &treq,
+                  sizeof(treq)) < 0)
+      errexit("can't set up tx ring: %s\n", strerror(errno));
+   r->txring = mmap(NULL, PKTRING_FRAMESIZE * PKTRING_TXFRAMES,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, r->txsock, 0);
+   if (r->txring == MAP_FAILED)
+      errexit("can't map tx ring: %s\n", strerror(errno));
+   bindif(r->txsock, ifindex, 0);
+   return 1;
+}
+
+/*
+ * Queues a reflected copy of frame on the tx ring, 0 if the ring is full.
+ * Swapping the endpoints leaves both checksums valid, except for frames
+ * seen before checksum offload filled in udp's (lo, veth), which go out
+ * with the checksum disabled instead.
+ */
+static int reflectframe(PktRing *r, unsigned char *frame, unsigned len,
+                        int csumpartial)
+{
+   struct tpacket2_hdr  *th;
+   unsigned char        *out, tmp[ETH_ALEN];
+   unsigned             ihl, a;
+   unsigned short       p;
+
+   th = (struct tpacket2_hdr *)(r->txring + r->txframe * PKTRING_FRAMESIZE);
+   if (__atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE) !=
+       TP_STATUS_AVAILABLE) {
+      /* kick the kernel and give the frame one more chance */
+      send(r->txsock, NULL, 0, MSG_DONTWAIT);
+      if (__atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE) !=
+          TP_STATUS_AVAILABLE)
+         return 0;
+   }
+   if (len > PKTRING_FRAMESIZE - TXDATA)
+      return 0;
+
+   out = (unsigned char *)th + TXDATA;
+   memcpy(out, frame, len);
+
+   /* swap ethernet, ip and udp endpoints */
+   memcpy(tmp, out, ETH_ALEN);
+   memcpy(out, out + ETH_ALEN, ETH_ALEN);
+   memcpy(out + ETH_ALEN, tmp, ETH_ALEN);
+   memcpy(&a, out + ETHLEN + 12, 4);
+   memcpy(out + ETHLEN + 12, out + ETHLEN + 16, 4);
+   memcpy(out + ETHLEN + 16, &a, 4);
+   ihl = (out[ETHLEN] & 0x0f) * 4;
+   memcpy(&p, out + ETHLEN + ihl, 2);
+   memcpy(out + ETHLEN + ihl, out + ETHLEN + ihl + 2, 2);
+   memcpy(out + ETHLEN + ihl + 2, &p, 2);
+   if (csumpartial)
+      memset(out + ETHLEN + ihl + 6, 0, 2);
+
+   th->tp_len = len;
+   __atomic_store_n(&th->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+   r->txframe = (r->txframe + 1) % PKTRING_TXFRAMES;
+   return 1;
+}
+
+/*------------------------------------------------------------------------
+ * pktring_reflect - reflect every probe that lands in the rx ring and
+ *                   account it to its source, never returns
+ *------------------------------------------------------------------------
+ */
+void pktring_reflect(PktRing *r, AddrTable *stats)
+{
+   struct tpacket_block_desc  *bd;
+   struct tpacket3_hdr        *ph;
+   struct sockaddr_ll         *sll;
+   struct pollfd              pfd;
+   unsigned char              *frame;
+   unsigned                   i, ihl, addr, runaddr, bytes, packets, ulen;
+   unsigned short             dport;
+
+   pfd.fd = r->rxsock;
+   pfd.events = POLLIN | POLLERR;
+
+   while (1) {
+      bd = (struct tpacket_block_desc *)
+           (r->rxring + r->rxblock * PKTRING_BLOCKSIZE);
+      if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+            TP_STATUS_USER)) {
+         pfd.revents = 0;
+         poll(&pfd, 1, -1);
+         continue;
+      }
+
+      runaddr = bytes = packets = 0;
+      ph = (struct tpacket3_hdr *)((unsigned char *)bd +
+                                   bd->hdr.bh1.offset_to_first_pkt);
+      for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+         frame = (unsigned char *)ph + ph->tp_mac;
+         sll = (struct sockaddr_ll *)((unsigned char *)ph +
+                                      TPACKET_ALIGN(sizeof(*ph)));
+         if (sll->sll_pkttype != PACKET_OUTGOING &&
+             ph->tp_snaplen == ph->tp_len && ph->tp_len > ETHLEN + 20 &&
+             (frame[ETHLEN] >> 4) == 4) {
+            ihl = (frame[ETHLEN] & 0x0f) * 4;
+            memcpy(&dport, frame + ETHLEN + ihl + 2, 2);
+            if (dport == r->port && ph->tp_len >= ETHLEN + ihl + 8 &&
+                reflectframe(r, frame, ph->tp_len,
+                             ph->tp_status & TP_STATUS_CSUMNOTREADY)) {
+               memcpy(&addr, frame + ETHLEN + 12, 4);
+               ulen = ph->tp_len - (ETHLEN + ihl + 8);
+               if (addr != runaddr && packets) {
+                  addrstat_add(stats, runaddr, bytes, packets);
+                  bytes = packets = 0;
+               }
+               runaddr = addr;
+               bytes += ulen;
+               packets++;
+            }
+         }
+         ph = (struct tpacket3_hdr *)((unsigned char *)ph +
+                                      ph->tp_next_offset);
+      }
+      if (packets)
+         addrstat_add(stats, runaddr, bytes, packets);
+
+      /* hand the block back and flush whatever we queued from it */
+      __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      r->rxblock = (r->rxblock + 1) % PKTRING_BLOCKS;
+      send(r->txsock, NULL, 0, MSG_DONTWAIT);
+   }
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef __PKTRING_H__
+#define __PKTRING_H__
+
+#include "addrstat.h"
+
+#define PKTRING_BLOCKSIZE  (1 << 18)   /* rx block, retired when full */
+#define PKTRING_BLOCKS     64
+#define PKTRING_FRAMESIZE  2048        /* tx frame, fits a 1500 mtu */
+#define PKTRING_TXFRAMES   4096
+#define PKTRING_TIMEOUT    1           /* ms before a partial block retires */
+
+/*
+ * AF_PACKET ring pair used by the reflector: a TPACKET_V3 block ring for
+ * receive and a TPACKET_V2 frame ring for transmit, both on one interface.
+ */
+typedef struct _PktRing {
+   int               rxsock;
+   int               txsock;
+   unsigned char     *rxring;
+   unsigned char     *txring;
+   unsigned          rxblock;    /* next rx block to look at */
+   unsigned          txframe;    /* next tx frame to fill */
+   unsigned short    port;       /* network order */
+} PktRing;
+
+extern int  pktring_open(PktRing *r, const char *ifname,
+                         unsigned short port, int fanout);
+extern void pktring_reflect(PktRing *r, AddrTable *stats);
+
+#endif
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pktsize.h"
+
+#define MAXMIX    16
+
+/* frame size to payload, raised to what a probe head needs */
+static unsigned payload(unsigned long frame, unsigned minpayload)
+{
+   if (frame < minpayload + PKTSIZE_OVERHEAD)
+      return minpayload;
+   return (unsigned)frame - PKTSIZE_OVERHEAD;
+}
+
+/* 0 if spec is malformed or asks for frames over PKTSIZE_MAXFRAME */
+int pktsize_parse(PktSize *ps, const char *spec, unsigned minpayload)
+{
+   unsigned long  size[MAXMIX], weight[MAXMIX], total = 0, acc;
+   unsigned       n = 0, i, k;
+   char           *s;
+
+   memset(ps, 0, sizeof(PktSize));
+   if (strcmp(spec, "imix") == 0)
+      spec = PKTSIZE_IMIX;
+
+   size[0] = strtoul(spec, &s, 10);
+   if (s == spec || size[0] > PKTSIZE_MAXFRAME)
+      return 0;
+   if (*s == '-') {
+      spec = s + 1;
+      weight[0] = strtoul(spec, &s, 10);
+      if (s == spec || *s || weight[0] < size[0] ||
+          weight[0] > PKTSIZE_MAXFRAME)
+         return 0;
+      ps->lo = payload(size[0], minpayload);
+      ps->hi = payload(weight[0], minpayload);
+      ps->mean = (ps->lo + ps->hi) / 2 + PKTSIZE_OVERHEAD;
+      for (k = 0; k < PKTSIZE_PICKS; k++)
+         ps->pick[k] = (unsigned short)ps->lo;
+      return 1;
+   }
+
+   while (1) {
+      weight[n] = 1;
+      if (*s == ':') {
+         spec = s + 1;
+         weight[n] = strtoul(spec, &s, 10);
+         if (s == spec || weight[n] == 0 || weight[n] > PKTSIZE_PICKS)
+            return 0;
+      }
+      total += weight[n++];
+      if (*s == 0)
+         break;
+      if (*s != ',' || n == MAXMIX)
+         return 0;
+      spec = s + 1;
+      size[n] = strtoul(spec, &s, 10);
+      if (s == spec || size[n] > PKTSIZE_MAXFRAME)
+         return 0;
+   }
+
+   /* slot k gets the size whose share of the weights covers its middle */
+   for (i = 0, acc = weight[0], k = 0; k < PKTSIZE_PICKS; k++) {
+      while ((2 * k + 1) * total > 2 * acc * PKTSIZE_PICKS)
+         acc += weight[++i];
+      ps->pick[k] = (unsigned short)payload(size[i], minpayload);
+   }
+   for (acc = 0, k = 0; k < PKTSIZE_PICKS; k++)
+      acc += ps->pick[k];
+   ps->mean = (unsigned)(acc / PKTSIZE_PICKS) + PKTSIZE_OVERHEAD;
+   return 1;
+}
+
+/* payload bytes for the next probe, rnd is the caller's generator state */
+unsigned pktsize_next(PktSize *ps, unsigned *rnd)
+{
+   unsigned x = *rnd ? *rnd : 0x9e3779b9U;
+
+   /* xorshift32 */
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *rnd = x;
+   if (ps->hi)
+      return ps->lo + x % (ps->hi - ps->lo + 1);
+   return ps->pick[x & (PKTSIZE_PICKS - 1)];
+}
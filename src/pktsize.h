@@ -0,0 +1,28 @@
+#ifndef __PKTSIZE_H__
+#define __PKTSIZE_H__
+
+#define PKTSIZE_OVERHEAD   46    /* ethernet header and fcs, ip, udp */
+#define PKTSIZE_MAXFRAME   1518
+#define PKTSIZE_MAXPAYLOAD (PKTSIZE_MAXFRAME - PKTSIZE_OVERHEAD)
+#define PKTSIZE_PICKS      256   /* resolution of a weighted mix */
+#define PKTSIZE_IMIX       "64:7,594:4,1518:1"
+
+/*
+ * A probe size distribution, given in ethernet frame bytes the way IMIX
+ * is: "1070" is fixed, "64-1518" uniform, "64:7,594:4,1518:1" a weighted
+ * mix (and "imix" that one).  Fixed sizes and mixes are unrolled into
+ * 'pick' so drawing a size is one table lookup.  Sizes come out as udp
+ * payload bytes.
+ */
+typedef struct _PktSize {
+   unsigned          lo;         /* uniform payload range, lo < hi */
+   unsigned          hi;
+   unsigned          mean;       /* frame bytes */
+   unsigned short    pick[PKTSIZE_PICKS];
+} PktSize;
+
+extern int      pktsize_parse(PktSize *ps, const char *spec,
+                              unsigned minpayload);
+extern unsigned pktsize_next(PktSize *ps, unsigned *rnd);
+
+#endif
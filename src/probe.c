@@ -0,0 +1,46 @@
+#include <string.h>
+
+#include "probe.h"
+
+static unsigned short sum(const ProbeHead *h)
+{
+   unsigned short w[sizeof(ProbeHead) / 2];
+   unsigned       s = 0, i;
+
+   memcpy(w, h, sizeof(w));
+   for (i = 0; i < sizeof(w) / 2; i++)
+      s += w[i];
+   s = (s & 0xffff) + (s >> 16);
+   s = (s & 0xffff) + (s >> 16);
+   return (unsigned short)s;
+}
+
+void probe_init(ProbeHead *h, unsigned id, unsigned len, unsigned flags)
+{
+   memset(h, 0, sizeof(ProbeHead));
+   h->magic = PROBE_MAGIC;
+   h->version = PROBE_VERSION;
+   h->flags = (unsigned char)flags;
+   h->len = (unsigned short)len;
+   h->id = id;
+}
+
+/* call after the last change to seq or txns */
+void probe_seal(ProbeHead *h)
+{
+   h->check = 0;
+   h->check = (unsigned short)~sum(h);
+}
+
+/*
+ * Copies the head out of a received probe of n bytes, 0 unless it is one
+ * of ours, in this version, intact and exactly as long as it says.
+ */
+int probe_parse(const char *buf, int n, ProbeHead *h)
+{
+   if (n < (int)sizeof(ProbeHead))
+      return 0;
+   memcpy(h, buf, sizeof(ProbeHead));
+   return h->magic == PROBE_MAGIC && h->version == PROBE_VERSION &&
+          h->len == n && sum(h) == 0xffff;
+}
@@ -0,0 +1,36 @@
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#define PROBE_MAGIC     0xec40
+#define PROBE_VERSION   1
+
+#define PROBE_KTX       0x01     /* sender takes kernel tx timestamps */
+#define PROBE_PRBS23    0x02     /* body is a PRBS-23 bert pattern */
+#define PROBE_PRBS31    0x04     /* body is a PRBS-31 bert pattern */
+
+/*
+ * Head of every probe, followed by filler up to 'len'.  The reflector
+ * sends it back untouched and only the sender reads it, so it is in host
+ * byte order.  The fields are ordered so there is no padding on any ABI.
+ * 'id' is whatever the sender uses to find the endpoint without looking
+ * at the source address.  'check' is the ones' complement of the ones'
+ * complement sum of the head, so a torn or stray packet is rejected
+ * before anything is looked up.
+ */
+typedef struct _ProbeHead {
+   unsigned short       magic;
+   unsigned char        version;
+   unsigned char        flags;
+   unsigned short       len;        /* whole probe, head included */
+   unsigned short       check;
+   unsigned             id;
+   unsigned             seq;
+   unsigned long long   txns;       /* nsclock_now() when sent */
+} ProbeHead;
+
+extern void probe_init(ProbeHead *h, unsigned id, unsigned len,
+                       unsigned flags);
+extern void probe_seal(ProbeHead *h);
+extern int  probe_parse(const char *buf, int n, ProbeHead *h);
+
+#endif
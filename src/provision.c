@@ -0,0 +1,295 @@
+/* provision.c - runs up/down scripts from a helper process */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+
+#include "provision.h"
+
+#define LINESIZE  128
+
+/* a request the helper has read but not finished */
+typedef struct _Job {
+   int            pid;        /* 0 until started */
+   unsigned long  tag;
+   char           script[8];  /* "up" or "down" */
+   char           addr[64];
+   char           n[16];
+} Job;
+
+static void helper(int cmd, int done, unsigned jobs);
+static int  readJobs(int cmd, Job **queue, int *count, int *size,
+                     char *buf, int *len, int block);
+static int  startJob(Job *j);
+static int  busy(Job *queue, int next, char *addr);
+static int  writeAll(int fd, char *s, int len);
+
+/*------------------------------------------------------------------------
+ * provision_start - fork the helper, 0 if it couldn't be started
+ *------------------------------------------------------------------------
+ */
+int provision_start(Provision *p, unsigned jobs)
+{
+   int   cmd[2], done[2];
+
+   memset(p, 0, sizeof(Provision));
+   if (pipe(cmd) < 0)
+      return 0;
+   if (pipe(done) < 0) {
+      close(cmd[0]);
+      close(cmd[1]);
+      return 0;
+   }
+   fflush(stdout);
+   p->pid = fork();
+   if (p->pid < 0) {
+      close(cmd[0]);
+      close(cmd[1]);
+      close(done[0]);
+      close(done[1]);
+      return 0;
+   }
+   if (p->pid == 0) {
+      close(cmd[1]);
+      close(done[0]);
+      helper(cmd[0], done[1], jobs ? jobs : 1);
+      _exit(0);
+   }
+   close(cmd[0]);
+   close(done[1]);
+   p->cmd = cmd[1];
+   p->done = done[0];
+   return 1;
+}
+
+/* asks for "sh up addr n", reported back as 'tag' */
+int provision_up(Provision *p, const char *addr, unsigned n,
+                 unsigned long tag)
+{
+   char  line[LINESIZE];
+   int   len;
+
+   len = snprintf(line, sizeof(line), "up %lu %.63s %u\n", tag, addr, n);
+   return writeAll(p->cmd, line, len);
+}
+
+/* asks for "sh down addr", reported back as 'tag' */
+int provision_down(Provision *p, const char *addr, unsigned long tag)
+{
+   char  line[LINESIZE];
+   int   len;
+
+   len = snprintf(line, sizeof(line), "down %lu %.63s\n", tag, addr);
+   return writeAll(p->cmd, line, len);
+}
+
+/*------------------------------------------------------------------------
+ * provision_done - waits for at least one request to finish and returns
+ *                  up to 'max' of the finished ones with their exit
+ *                  status, 0 once the helper is gone
+ *------------------------------------------------------------------------
+ */
+int provision_done(Provision *p, unsigned long *tags, int *status, int max)
+{
+   char  *s, *nl;
+   int   n = 0, used, got;
+
+   while (n == 0) {
+      s = p->buf;
+      while (n < max && (nl = memchr(s, '\n', p->len - (s - p->buf)))) {
+         *nl = 0;
+         if (sscanf(s, "%lu %d", &tags[n], &status[n]) == 2)
+            n++;
+         s = nl + 1;
+      }
+      used = s - p->buf;
+      memmove(p->buf, s, p->len - used);
+      p->len -= used;
+      if (n)
+         break;
+      do {
+         got = read(p->done, p->buf + p->len, sizeof(p->buf) - p->len);
+      } while (got < 0 && errno == EINTR);
+      if (got <= 0)
+         return 0;
+      p->len += got;
+   }
+   return n;
+}
+
+/* no more requests: waits for the helper to finish what it has */
+void provision_finish(Provision *p)
+{
+   int   status;
+
+   close(p->cmd);
+   while (waitpid(p->pid, &status, 0) < 0 && errno == EINTR)
+      ;
+}
+
+/*
+ * The helper: reads requests as they come, keeps up to 'jobs' scripts
+ * running, and reports each one as it exits.  Ends when the parent
+ * closes its end and everything queued has run.
+ */
+static void helper(int cmd, int done, unsigned jobs)
+{
+   Job      *queue = NULL;
+   int      count = 0, size = 0, next = 0, running = 0, eof = 0;
+   int      len = 0, i, pid, status;
+   char     buf[PROVISION_BUFSIZE], line[LINESIZE];
+
+   signal(SIGINT, SIG_IGN);      /* ^C on the parent shouldn't cut us off */
+   signal(SIGPIPE, SIG_IGN);
+   while (!eof || next < count || running) {
+      /* block for requests only when there's nothing else to wait for */
+      if (!eof)
+         eof = readJobs(cmd, &queue, &count, &size, buf, &len,
+                        next == count && running == 0);
+      /* in order, and never two scripts for one address at once */
+      while (next < count && running < jobs &&
+             !busy(queue, next, queue[next].addr)) {
+         if (startJob(&queue[next]))
+            running++;
+         else {
+            i = snprintf(line, sizeof(line), "%lu %d\n", queue[next].tag,
+                         127);
+            writeAll(done, line, i);
+         }
+         next++;
+      }
+
+      /* drop the finished front of the queue */
+      for (i = 0; i < next && queue[i].pid == -1; i++)
+         ;
+      if (i) {
+         memmove(queue, queue + i, (count - i) * sizeof(Job));
+         count -= i;
+         next -= i;
+      }
+      if (running == 0)
+         continue;
+
+      pid = waitpid(-1, &status, 0);
+      if (pid < 0)
+         continue;
+      for (i = 0; i < next; i++)
+         if (queue[i].pid == pid)
+            break;
+      if (i == next)
+         continue;
+      running--;
+      queue[i].pid = -1;
+      i = snprintf(line, sizeof(line), "%lu %d\n", queue[i].tag,
+                   WIFEXITED(status) ? WEXITSTATUS(status) : 128);
+      writeAll(done, line, i);
+   }
+   close(done);
+}
+
+/*
+ * Appends whatever requests are on the pipe to the queue, waiting for
+ * some if 'block'.  Returns 1 at end of file.
+ */
+static int readJobs(int cmd, Job **queue, int *count, int *size,
+                    char *buf, int *len, int block)
+{
+   char  *s, *nl;
+   Job   *j;
+   int   got, used;
+
+   if (!block) {
+      /* only what's already there, the scripts need watching */
+      fd_set   fds;
+      struct timeval tv;
+
+      FD_ZERO(&fds);
+      FD_SET(cmd, &fds);
+      tv.tv_sec = tv.tv_usec = 0;
+      if (select(cmd + 1, &fds, NULL, NULL, &tv) <= 0)
+         return 0;
+   }
+   do {
+      got = read(cmd, buf + *len, PROVISION_BUFSIZE - *len);
+   } while (got < 0 && errno == EINTR);
+   if (got <= 0)
+      return 1;
+   *len += got;
+
+   s = buf;
+   while ((nl = memchr(s, '\n', *len - (s - buf))) != NULL) {
+      *nl = 0;
+      if (*count == *size) {
+         *size = *size ? *size * 2 : 256;
+         *queue = (Job *)realloc(*queue, *size * sizeof(Job));
+         if (*queue == NULL)
+            _exit(1);
+      }
+      j = &(*queue)[*count];
+      memset(j, 0, sizeof(Job));
+      if (sscanf(s, "%7s %lu %63s %15s", j->script, &j->tag, j->addr,
+                 j->n) >= 3)
+         (*count)++;
+      s = nl + 1;
+   }
+   used = s - buf;
+   memmove(buf, s, *len - used);
+   *len -= used;
+   return 0;
+}
+
+/* a script for addr among the first 'next' jobs is still running */
+static int busy(Job *queue, int next, char *addr)
+{
+   int   i;
+
+   for (i = 0; i < next; i++)
+      if (queue[i].pid > 0 && strcmp(queue[i].addr, addr) == 0)
+         return 1;
+   return 0;
+}
+
+/* sh up|down addr [n], like the scripts were always run */
+static int startJob(Job *j)
+{
+   char  *argv[5];
+
+   argv[0] = "sh";
+   argv[1] = j->script;
+   argv[2] = j->addr;
+   argv[3] = j->n[0] ? j->n : NULL;
+   argv[4] = NULL;
+   j->pid = fork();
+   if (j->pid == 0) {
+      execv("/bin/sh", argv);
+      _exit(127);
+   }
+   if (j->pid < 0) {
+      j->pid = -1;
+      return 0;
+   }
+   return 1;
+}
+
+static int writeAll(int fd, char *s, int len)
+{
+   int   n;
+
+   while (len > 0) {
+      n = write(fd, s, len);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return 0;
+      s += n;
+      len -= n;
+   }
+   return 1;
+}
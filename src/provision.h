@@ -0,0 +1,32 @@
+#ifndef __PROVISION_H__
+#define __PROVISION_H__
+
+#define PROVISION_JOBS     16    /* up/down scripts run at once */
+#define PROVISION_BUFSIZE  4096
+
+/*
+ * A helper process that runs the "up" and "down" scripts for the
+ * parent.  Requests go down one pipe and the helper runs them up to
+ * 'jobs' at a time, taking whatever has queued up as a batch; each
+ * finished request comes back on the other pipe with the tag it was
+ * sent with.  The helper is forked before the parent starts any thread
+ * and stays small, so a script costs a fork of it, not of the parent.
+ */
+typedef struct _Provision {
+   int            cmd;        /* requests, parent writes */
+   int            done;       /* completions, parent reads */
+   int            pid;
+   int            len;        /* completion bytes waiting in buf */
+   char           buf[PROVISION_BUFSIZE];
+} Provision;
+
+extern int  provision_start(Provision *p, unsigned jobs);
+extern int  provision_up(Provision *p, const char *addr, unsigned n,
+                         unsigned long tag);
+extern int  provision_down(Provision *p, const char *addr,
+                           unsigned long tag);
+extern int  provision_done(Provision *p, unsigned long *tags, int *status,
+                           int max);
+extern void provision_finish(Provision *p);
+
+#endif
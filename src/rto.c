@@ -0,0 +1,34 @@
+#include <string.h>
+
+#include "rto.h"
+
+/* 'initial' ns until the first round trip is measured */
+void rto_init(Rto *r, unsigned long long initial)
+{
+   memset(r, 0, sizeof(Rto));
+   r->rto = initial;
+}
+
+void rto_sample(Rto *r, unsigned long long rtt)
+{
+   unsigned long long dev;
+
+   if (r->srtt == 0) {
+      r->srtt = rtt;
+      r->rttvar = rtt / 2;
+   }
+   else {
+      dev = r->srtt > rtt ? r->srtt - rtt : rtt - r->srtt;
+      r->rttvar = (3 * r->rttvar + dev) / 4;
+      r->srtt = (7 * r->srtt + rtt) / 8;
+   }
+   r->rto = r->srtt + (4 * r->rttvar > RTO_MIN ? 4 * r->rttvar : RTO_MIN);
+   if (r->rto > RTO_MAX)
+      r->rto = RTO_MAX;
+}
+
+/* once per timer expiry, however many probes it took */
+void rto_backoff(Rto *r)
+{
+   r->rto = r->rto * 2 < RTO_MAX ? r->rto * 2 : RTO_MAX;
+}
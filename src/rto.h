@@ -0,0 +1,22 @@
+#ifndef __RTO_H__
+#define __RTO_H__
+
+#define RTO_MIN      1000000ULL        /* ns, floor and clock granularity */
+#define RTO_MAX      60000000000ULL    /* ns, backoff stops here */
+
+/*
+ * RFC 6298 retransmission timeout of one endpoint.  Probes are never
+ * resent and each carries its own send time, so every echo is a clean
+ * sample, late ones included.
+ */
+typedef struct _Rto {
+   unsigned long long   srtt;       /* ns, smoothed round trip, 0 = none */
+   unsigned long long   rttvar;     /* ns, its mean deviation */
+   unsigned long long   rto;        /* ns */
+} Rto;
+
+extern void rto_init(Rto *r, unsigned long long initial);
+extern void rto_sample(Rto *r, unsigned long long rtt);
+extern void rto_backoff(Rto *r);
+
+#endif
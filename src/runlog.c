@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "runlog.h"
+
+/*------------------------------------------------------------------------
+ * runlog_open - start a new log at path, samples every 'interval' ms
+ *------------------------------------------------------------------------
+ */
+int runlog_open(RunLog *l, const char *path, const char *name,
+                unsigned interval)
+{
+   RunLogHead  h;
+
+   memset(l, 0, sizeof(RunLog));
+   l->queue = (RunSample *)calloc(RUNLOG_QUEUE, sizeof(RunSample));
+   if (l->queue == NULL)
+      return 0;
+   l->fp = fopen(path, "wb");
+   if (l->fp == NULL) {
+      free(l->queue);
+      return 0;
+   }
+   l->interval = interval;
+
+   memset(&h, 0, sizeof(h));
+   h.magic = RUNLOG_MAGIC;
+   h.version = RUNLOG_VERSION;
+   h.recsize = sizeof(RunSample);
+   h.interval = interval;
+   h.pid = getpid();
+   h.start = time(NULL);
+   strncpy(h.name, name, sizeof(h.name) - 1);
+   if (fwrite(&h, sizeof(h), 1, l->fp) != 1 || fflush(l->fp) != 0) {
+      fclose(l->fp);
+      free(l->queue);
+      return 0;
+   }
+   return 1;
+}
+
+/* a fresh RunTrack for an endpoint added just now, NULL if out of memory */
+RunTrack *runlog_track(void)
+{
+   RunTrack *t;
+
+   t = (RunTrack *)calloc(1, sizeof(RunTrack));
+   if (t)
+      hdrhist_init(&t->rtt);
+   return t;
+}
+
+static unsigned delta(unsigned long long now, unsigned long long then)
+{
+   return now > then ? (unsigned)(now - then) : 0;
+}
+
+static unsigned clampns(unsigned long long v)
+{
+   return v > 0xffffffffULL ? 0xffffffffU : (unsigned)v;
+}
+
+/*
+ * Closes the interval ending at 'ms' for one endpoint: 'now' and 'rtt'
+ * are its totals and histogram at this moment, read unlocked.  The
+ * sample goes into the endpoint's ring and, with a log, into the queue.
+ */
+void runlog_sample(RunLog *l, RunTrack *t, unsigned long long ms,
+                   unsigned addr, unsigned short port,
+                   RunTotals *now, HdrHist *rtt)
+{
+   static HdrHist diff;
+   HdrHist        snap;
+   RunSample      *s;
+
+   /* one copy, so a receiver recording meanwhile can't skew the diff */
+   memcpy(&snap, rtt, sizeof(HdrHist));
+   hdrhist_sub(&diff, &snap, &t->rtt);
+
+   s = &t->ring[t->count++ % RUNLOG_RING];
+   memset(s, 0, sizeof(RunSample));
+   s->t = ms;
+   s->addr = addr;
+   s->port = port;
+   s->sent = delta(now->sent, t->last.sent);
+   s->rcvd = delta(now->rcvd, t->last.rcvd);
+   s->lost = delta(now->lost, t->last.lost);
+   s->bytes = delta(now->bytes, t->last.bytes);
+   s->rtt50 = clampns(hdrhist_percentile(&diff, 50));
+   s->rtt99 = clampns(hdrhist_percentile(&diff, 99));
+   s->rttmax = clampns(diff.count ? diff.max : 0);
+   t->last = *now;
+   memcpy(&t->rtt, &snap, sizeof(HdrHist));
+
+   if (l == NULL || l->fp == NULL)
+      return;
+   if (l->head - __atomic_load_n(&l->tail, __ATOMIC_ACQUIRE) >= RUNLOG_QUEUE) {
+      l->dropped++;
+      return;
+   }
+   l->queue[l->head % RUNLOG_QUEUE] = *s;
+   __atomic_store_n(&l->head, l->head + 1, __ATOMIC_RELEASE);
+}
+
+/* writer side: appends every queued sample to the file, returns how many */
+unsigned runlog_flush(RunLog *l)
+{
+   unsigned head, n, first, run;
+
+   head = __atomic_load_n(&l->head, __ATOMIC_ACQUIRE);
+   n = head - l->tail;
+   while (l->tail != head) {
+      /* in one or two runs, the queue may wrap */
+      first = l->tail % RUNLOG_QUEUE;
+      run = head - l->tail;
+      if (run > RUNLOG_QUEUE - first)
+         run = RUNLOG_QUEUE - first;
+      fwrite(&l->queue[first], sizeof(RunSample), run, l->fp);
+      __atomic_store_n(&l->tail, l->tail + run, __ATOMIC_RELEASE);
+   }
+   if (n)
+      fflush(l->fp);
+   return n;
+}
+
+/* wall clock ms, for sample times that line up with other logs */
+unsigned long long runlog_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,85 @@
+#ifndef __RUNLOG_H__
+#define __RUNLOG_H__
+
+#include <stdio.h>
+
+#include "hdrhist.h"
+
+#define RUNLOG_MAGIC    0x55455252  /* "UERR" */
+#define RUNLOG_VERSION  1
+#define RUNLOG_RING     64          /* intervals kept per endpoint */
+#define RUNLOG_QUEUE    65536       /* samples waiting for the writer, 2^n */
+#define RUNLOG_FLUSH    500         /* ms between writer passes */
+
+/* start of a run log, followed by RunSamples until the end of the file */
+typedef struct _RunLogHead {
+   unsigned             magic;
+   unsigned short       version;
+   unsigned short       recsize;    /* sizeof(RunSample) */
+   unsigned             interval;   /* ms per sample */
+   unsigned             pid;
+   unsigned long long   start;      /* time() the run began */
+   char                 name[24];   /* program that wrote it */
+} RunLogHead;
+
+/* one endpoint over one interval */
+typedef struct _RunSample {
+   unsigned long long   t;          /* ms since the epoch, interval's end */
+   unsigned             addr;       /* network order */
+   unsigned short       port;
+   unsigned short       pad;
+   unsigned             sent;
+   unsigned             rcvd;
+   unsigned             lost;
+   unsigned             rtt50;      /* ns, round trips in the interval */
+   unsigned             rtt99;
+   unsigned             rttmax;
+   unsigned long long   bytes;      /* received */
+} RunSample;
+
+/* running totals a program keeps for an endpoint */
+typedef struct _RunTotals {
+   unsigned long long   sent;
+   unsigned long long   rcvd;
+   unsigned long long   lost;
+   unsigned long long   bytes;
+} RunTotals;
+
+/*
+ * Sampling state of one endpoint, only touched by the sampling thread.
+ * It keeps the totals and round trip histogram as they were at the last
+ * sample, so an interval is just the difference, and the endpoint's
+ * last RUNLOG_RING samples.
+ */
+typedef struct _RunTrack {
+   RunTotals            last;
+   HdrHist              rtt;
+   RunSample            ring[RUNLOG_RING];
+   unsigned             count;      /* samples taken */
+} RunTrack;
+
+/*
+ * The log file and the queue of samples on their way to it.  The
+ * sampling thread fills the queue and one writer thread drains it, so
+ * a slow disk holds up neither sampling nor traffic; samples that find
+ * the queue full are counted and dropped.
+ */
+typedef struct _RunLog {
+   FILE                 *fp;
+   unsigned             interval;
+   RunSample            *queue;
+   unsigned             head;       /* next to fill, sampler only */
+   unsigned             tail;       /* next to write, writer only */
+   unsigned long long   dropped;
+} RunLog;
+
+extern int        runlog_open(RunLog *l, const char *path, const char *name,
+                              unsigned interval);
+extern RunTrack   *runlog_track(void);
+extern void       runlog_sample(RunLog *l, RunTrack *t, unsigned long long ms,
+                                unsigned addr, unsigned short port,
+                                RunTotals *now, HdrHist *rtt);
+extern unsigned   runlog_flush(RunLog *l);
+extern unsigned long long runlog_ms(void);
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "runlog.h"
+
+extern int  errexit(const char *format, ...);
+
+#define USAGE  "usage: runlog2csv [-H] runlog\n"
+
+/*
+ * Turns a run log written with -R by UDPecho or UDPecho2 into CSV on
+ * stdout, one line per endpoint and interval.  The log may still be
+ * growing; a sample cut off at the end is left out.  -H drops the
+ * header line, for appending several runs into one file.
+ */
+int main(int argc, char *argv[])
+{
+   RunLogHead  h;
+   RunSample   s;
+   FILE        *fp;
+   char        *path = NULL, *rec;
+   unsigned    kbps;
+   int         i, header = 1;
+   struct in_addr iaddr;
+
+   for (i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "-h", 2) == 0) {
+         errexit(USAGE);
+      }
+      else if (strcmp(argv[i], "-H") == 0) {
+         header = 0;
+      }
+      else {
+         path = argv[i];
+      }
+   }
+   if (path == NULL)
+      errexit(USAGE);
+   fp = fopen(path, "rb");
+   if (fp == NULL)
+      errexit("Can't open %s\n", path);
+   if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != RUNLOG_MAGIC ||
+       h.version != RUNLOG_VERSION || h.recsize < sizeof(RunSample))
+      errexit("%s is not a run log\n", path);
+   rec = (char *)malloc(h.recsize);
+   if (rec == NULL)
+      errexit("Can't allocate a %u byte record\n", h.recsize);
+
+   if (header)
+      printf("time_ms,addr,port,interval_ms,sent,rcvd,lost,bytes,kbps,"
+             "rtt_p50_us,rtt_p99_us,rtt_max_us\n");
+   while (fread(rec, h.recsize, 1, fp) == 1) {
+      memcpy(&s, rec, sizeof(s));
+      iaddr.s_addr = s.addr;
+      kbps = (unsigned)(s.bytes * 8 / (h.interval ? h.interval : 1));
+      printf("%llu,%s,%u,%u,%u,%u,%u,%llu,%u,%.1f,%.1f,%.1f\n",
+             s.t, inet_ntoa(iaddr), s.port, h.interval, s.sent, s.rcvd,
+             s.lost, s.bytes, kbps, s.rtt50 / 1000.0, s.rtt99 / 1000.0,
+             s.rttmax / 1000.0);
+   }
+   free(rec);
+   fclose(fp);
+   return 0;
+}
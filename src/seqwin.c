@@ -0,0 +1,142 @@
+#include <string.h>
+
+#include "seqwin.h"
+
+#define MASK   (SEQWIN_BITS - 1)
+
+void seqwin_init(SeqWin *w)
+{
+   memset(w, 0, sizeof(SeqWin));
+}
+
+/* the bits of the n <= 64 - (b & 63) numbers from window position b */
+static unsigned long long span(unsigned b, unsigned n)
+{
+   return (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (b & 63);
+}
+
+/*
+ * Slides the window up by d positions starting at bit 'from': every bit
+ * there belongs to a number leaving the window and is reused by a new
+ * one.  Clear bits are losses.  Whole words are done with a popcount.
+ */
+static void slide(SeqWin *w, unsigned from, unsigned d)
+{
+   unsigned             b, n;
+   unsigned long long   m;
+
+   while (d) {
+      b = from & MASK;
+      n = 64 - (b & 63);
+      if (n > d)
+         n = d;
+      m = span(b, n);
+      w->lost += n - __builtin_popcountll(w->bits[b >> 6] & m);
+      w->bits[b >> 6] &= ~m;
+      w->gone[b >> 6] &= ~m;
+      from += n;
+      d -= n;
+   }
+}
+
+void seqwin_add(SeqWin *w, unsigned seq)
+{
+   int                  d;
+   unsigned long long   *word, bit;
+   unsigned             m;
+
+   if (!w->started) {
+      /*
+       * the numbers before the first arrival are still in flight, or
+       * reordered behind it; none before the sequence began
+       */
+      memset(w->bits, 0xff, sizeof(w->bits));
+      for (m = seq > SEQWIN_BITS ? seq - SEQWIN_BITS + 1 : 1; m < seq; m++)
+         w->bits[(m & MASK) >> 6] &= ~(1ULL << (m & 63));
+      w->top = seq;
+      w->expired = seq > SEQWIN_BITS ? seq - SEQWIN_BITS : 0;
+      w->started = 1;
+      return;
+   }
+
+   d = (int)(seq - w->top);
+   if (d > 0) {
+      if (d > SEQWIN_BITS) {
+         /* the whole window leaves, plus numbers that never entered it */
+         slide(w, w->top + 1, SEQWIN_BITS);
+         w->lost += d - SEQWIN_BITS;
+      }
+      else
+         slide(w, w->top + 1, d);
+      w->top = seq;
+      w->bits[(seq & MASK) >> 6] |= 1ULL << (seq & 63);
+      return;
+   }
+
+   if (d <= -SEQWIN_BITS) {
+      w->late++;
+      return;
+   }
+   word = &w->bits[(seq & MASK) >> 6];
+   bit = 1ULL << (seq & 63);
+   if (w->gone[(seq & MASK) >> 6] & bit) {
+      w->gone[(seq & MASK) >> 6] &= ~bit;
+      w->late++;
+   }
+   else if (*word & bit)
+      w->duplicate++;
+   else {
+      *word |= bit;
+      w->reordered++;
+   }
+}
+
+/*
+ * Time-based expiry, after seqwin_add of probe 'seq' sent at 'txns'.  The
+ * mark is a top and its send time: everything below it was sent before,
+ * so once the mark is 'rto' old whatever is still missing there is given
+ * up on.  The next top to arrive becomes the new mark.  Without it a
+ * probe would only count as lost SEQWIN_BITS probes later.
+ */
+void seqwin_age(SeqWin *w, unsigned seq, unsigned long long txns,
+                unsigned long long now, unsigned long long rto)
+{
+   if (w->markns && now > w->markns + rto) {
+      seqwin_expire(w, w->markseq - 1);
+      w->markns = 0;
+   }
+   if (w->markns == 0 && seq == w->top) {
+      w->markseq = seq;
+      w->markns = txns;
+   }
+}
+
+/* counts the numbers up to 'seq' still missing as lost, now */
+void seqwin_expire(SeqWin *w, unsigned seq)
+{
+   unsigned             from, b, n, d;
+   unsigned long long   m, miss;
+
+   if ((int)(seq - w->top) > 0)
+      seq = w->top;
+   from = w->expired + 1;
+   if ((int)(w->top - from) >= SEQWIN_BITS)
+      from = w->top - SEQWIN_BITS + 1;
+   if ((int)(seq - from) < 0)
+      return;
+   d = seq - from + 1;
+   w->expired = seq;
+   while (d) {
+      b = from & MASK;
+      n = 64 - (b & 63);
+      if (n > d)
+         n = d;
+      m = span(b, n);
+      miss = ~w->bits[b >> 6] & m;
+      w->lost += __builtin_popcountll(miss);
+      w->bits[b >> 6] |= miss;
+      w->gone[b >> 6] |= miss;
+      from += n;
+      d -= n;
+   }
+}
@@ -0,0 +1,38 @@
+#ifndef __SEQWIN_H__
+#define __SEQWIN_H__
+
+#define SEQWIN_BITS     1024     /* sequence numbers in the window, 2^n */
+#define SEQWIN_WORDS    (SEQWIN_BITS / 64)
+
+/*
+ * Arrival tracker for one sequence space, numbered from 1.  The window
+ * covers the SEQWIN_BITS sequence numbers up to the highest one seen,
+ * one bit each.  A number that slides out of the window without its bit
+ * set is lost, and so is one still missing an RTO after a later number
+ * was sent (seqwin_age); it is marked 'gone' so it isn't counted twice.
+ * One that shows up after that is late; it was already counted lost and
+ * stays counted.  One that fills a hole still inside the window is
+ * reordered, and one whose bit is already set is a duplicate.  Work per
+ * packet is bounded by the window size, not by the gap.
+ */
+typedef struct _SeqWin {
+   unsigned long long   bits[SEQWIN_WORDS];
+   unsigned long long   gone[SEQWIN_WORDS];  /* counted lost in the window */
+   unsigned             top;        /* highest sequence seen */
+   int                  started;
+   unsigned             expired;    /* given up on everything up to here */
+   unsigned             markseq;    /* a top, and when it was sent */
+   unsigned long long   markns;     /* 0 = no mark */
+   unsigned long long   lost;
+   unsigned long long   late;
+   unsigned long long   reordered;
+   unsigned long long   duplicate;
+} SeqWin;
+
+extern void seqwin_init(SeqWin *w);
+extern void seqwin_add(SeqWin *w, unsigned seq);
+extern void seqwin_age(SeqWin *w, unsigned seq, unsigned long long txns,
+                       unsigned long long now, unsigned long long rto);
+extern void seqwin_expire(SeqWin *w, unsigned seq);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "statseg.h"
+
+extern int  errexit(const char *format, ...);
+
+#define USAGE  "usage: statdump [-a] [-c] [-i interval(ms)] statsfile\n"
+
+static void dump(StatSeg *s, int all);
+static void printRec(StatSeg *s, StatRec *r);
+static void printCsv(StatSeg *s, StatRec *r);
+
+static int  csv = 0;    /* -c, raw counters for scripts */
+
+/*
+ * Prints what a running UDPecho, UDPecho2 or UDPechod publishes with -S,
+ * once or every -i ms.  Reads never block the writer, so it can poll as
+ * often as it likes.  -c prints the raw counters as CSV instead, totals
+ * last, for scripts such as bench.sh.
+ */
+int main(int argc, char *argv[])
+{
+   StatSeg  seg;
+   char     *path = NULL;
+   unsigned interval = 0;
+   int      i, all = 0;
+
+   for (i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "-h", 2) == 0) {
+         errexit(USAGE);
+      }
+      else if (strcmp(argv[i], "-a") == 0) {
+         all = 1;
+      }
+      else if (strcmp(argv[i], "-c") == 0) {
+         csv = 1;
+      }
+      else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+         interval = strtoul(argv[++i], (char **)NULL, 10);
+      }
+      else {
+         path = argv[i];
+      }
+   }
+   if (path == NULL)
+      errexit(USAGE);
+   if (!statseg_open(&seg, path))
+      errexit("%s is not a stats file\n", path);
+
+   while (1) {
+      dump(&seg, all);
+      if (interval == 0)
+         break;
+      usleep(interval * 1000);
+   }
+   statseg_close(&seg);
+   return 0;
+}
+
+static void dump(StatSeg *s, int all)
+{
+   StatSegHead *h = s->head;
+   StatRec     r;
+   unsigned    n, count;
+
+   count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+   if (csv) {
+      printf("time,addr,port,count,start,sent,rcvd,sentbytes,rcvdbytes,"
+             "lost,late,reordered,duplicate,timeouts,rejected,untimed,drops,"
+             "bertbits,biterrs,errored,rttmean,rttp50,rttp90,rttp99,"
+             "rttp999,rttmax\n");
+      for (n = 1; all && n < count; n++)
+         if (statseg_read(s, n, &r))
+            printCsv(s, &r);
+      if (statseg_read(s, 0, &r))
+         printCsv(s, &r);
+      fflush(stdout);
+      return;
+   }
+   printf("%s pid %u, %s, %u of %u records, updated %llds ago\n",
+          h->name, h->pid,
+          h->kind == STATSEG_REFLECTOR ? "reflector" : "generator",
+          count ? count - 1 : 0, h->nrecs - 1,
+          (long long)time(NULL) - (long long)h->updated);
+   if (all)
+      for (n = 1; n < count; n++)
+         if (statseg_read(s, n, &r))
+            printRec(s, &r);
+   if (statseg_read(s, 0, &r))
+      printRec(s, &r);
+   fflush(stdout);
+}
+
+static void printRec(StatSeg *s, StatRec *r)
+{
+   struct in_addr iaddr;
+   char           name[32];
+   long long      secs;
+
+   if (r->addr) {
+      iaddr.s_addr = r->addr;
+      if (r->port)
+         sprintf(name, "%s:%u", inet_ntoa(iaddr), r->port);
+      else
+         strcpy(name, inet_ntoa(iaddr));
+   }
+   else
+      sprintf(name, "total of %u", r->count);
+   secs = (long long)time(NULL) - (long long)r->start;
+   if (secs <= 0)
+      secs = 1;
+
+   if (s->head->kind == STATSEG_REFLECTOR) {
+      printf("%21s got %10llu packets %14llu bytes at %10llu kbps\n", name,
+             r->rcvd, r->rcvdbytes, r->rcvdbytes * 8 / 1000 / secs);
+      return;
+   }
+   printf("%21s sent %10llu rcvd %10llu lost %8llu late %6llu "
+          "reord %6llu dup %6llu timeouts %6llu rate %llu kbps\n",
+          name, r->sent, r->rcvd, r->lost, r->late, r->reordered,
+          r->duplicate, r->timeouts, r->rcvdbytes * 8 / 1000 / secs);
+   printf("%21s rtt mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+          "max %.1f us", "", r->rttmean / 1000.0, r->rttp50 / 1000.0,
+          r->rttp90 / 1000.0, r->rttp99 / 1000.0, r->rttp999 / 1000.0,
+          r->rttmax / 1000.0);
+   if (r->bertbits)
+      printf(", BER %.3g", (double)r->biterrs / r->bertbits);
+   if (r->rejected || r->untimed || r->drops)
+      printf(", rejected %llu untimed %llu drops %llu", r->rejected,
+             r->untimed, r->drops);
+   printf("\n");
+}
+
+/* one record, every counter as is; round trips in ns */
+static void printCsv(StatSeg *s, StatRec *r)
+{
+   struct in_addr iaddr;
+
+   iaddr.s_addr = r->addr;
+   printf("%lld,%s,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+          "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+          "%llu\n", (long long)s->head->updated,
+          r->addr ? inet_ntoa(iaddr) : "total", r->port, r->count, r->start,
+          r->sent, r->rcvd, r->sentbytes, r->rcvdbytes, r->lost, r->late,
+          r->reordered, r->duplicate, r->timeouts, r->rejected, r->untimed,
+          r->drops, r->bertbits, r->biterrs, r->errored, r->rttmean,
+          r->rttp50, r->rttp90, r->rttp99, r->rttp999, r->rttmax);
+}
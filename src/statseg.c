@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "statseg.h"
+
+#define LOAD(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static int map(StatSeg *s, int prot)
+{
+   void  *mem;
+
+   mem = mmap(NULL, s->size, prot, MAP_SHARED, s->fd, 0);
+   if (mem == MAP_FAILED) {
+      close(s->fd);
+      return 0;
+   }
+   s->head = (StatSegHead *)mem;
+   s->recs = (StatRec *)(s->head + 1);
+   return 1;
+}
+
+/*------------------------------------------------------------------------
+ * statseg_create - (re)create the stats file at path with room for nrecs
+ *                  records, all unused, and map it for writing
+ *------------------------------------------------------------------------
+ */
+int statseg_create(StatSeg *s, const char *path, int kind,
+                   const char *name, unsigned nrecs)
+{
+   memset(s, 0, sizeof(StatSeg));
+   s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (s->fd < 0)
+      return 0;
+   s->nrecs = nrecs;
+   s->size = sizeof(StatSegHead) + (unsigned long)nrecs * sizeof(StatRec);
+   if (ftruncate(s->fd, s->size) < 0) {
+      close(s->fd);
+      return 0;
+   }
+   if (!map(s, PROT_READ | PROT_WRITE))
+      return 0;
+
+   s->head->version = STATSEG_VERSION;
+   s->head->kind = kind;
+   s->head->recsize = sizeof(StatRec);
+   s->head->nrecs = nrecs;
+   s->head->pid = getpid();
+   s->head->start = time(NULL);
+   strncpy(s->head->name, name, sizeof(s->head->name) - 1);
+   /* magic last, a reader that sees it sees the rest */
+   __atomic_store_n(&s->head->magic, STATSEG_MAGIC, __ATOMIC_RELEASE);
+   return 1;
+}
+
+/* writer side: copy r into record n under its sequence lock */
+void statseg_write(StatSeg *s, unsigned n, StatRec *r)
+{
+   StatRec  *d;
+   unsigned seq;
+
+   if (n >= s->nrecs)
+      return;
+   d = &s->recs[n];
+   seq = LOAD(&d->seq);
+   STORE(&d->seq, seq + 1);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   memcpy((char *)d + sizeof(d->seq), (char *)r + sizeof(r->seq),
+          sizeof(StatRec) - sizeof(r->seq));
+   __atomic_store_n(&d->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* marks the end of one round of writes, 'count' records are in use */
+void statseg_publish(StatSeg *s, unsigned count)
+{
+   if (count > s->nrecs)
+      count = s->nrecs;
+   STORE(&s->head->updated, (unsigned long long)time(NULL));
+   __atomic_store_n(&s->head->count, count, __ATOMIC_RELEASE);
+}
+
+/*------------------------------------------------------------------------
+ * statseg_open - map an existing stats file read only, 0 if it isn't one
+ *                or was written by an incompatible version
+ *------------------------------------------------------------------------
+ */
+int statseg_open(StatSeg *s, const char *path)
+{
+   struct stat st;
+
+   memset(s, 0, sizeof(StatSeg));
+   s->fd = open(path, O_RDONLY);
+   if (s->fd < 0)
+      return 0;
+   if (fstat(s->fd, &st) < 0 || st.st_size < sizeof(StatSegHead)) {
+      close(s->fd);
+      return 0;
+   }
+   s->size = st.st_size;
+   if (!map(s, PROT_READ))
+      return 0;
+   if (__atomic_load_n(&s->head->magic, __ATOMIC_ACQUIRE) != STATSEG_MAGIC ||
+       s->head->version != STATSEG_VERSION ||
+       s->head->recsize != sizeof(StatRec) ||
+       s->size < sizeof(StatSegHead) +
+                 (unsigned long)s->head->nrecs * sizeof(StatRec)) {
+      statseg_close(s);
+      return 0;
+   }
+   s->nrecs = s->head->nrecs;
+   return 1;
+}
+
+/* reader side: consistent copy of record n, 0 if it's not in use */
+int statseg_read(StatSeg *s, unsigned n, StatRec *r)
+{
+   StatRec  *d;
+   unsigned s1, s2;
+
+   if (n >= s->nrecs)
+      return 0;
+   d = &s->recs[n];
+   do {
+      s1 = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+      if (s1 & 1)
+         continue;
+      memcpy(r, d, sizeof(StatRec));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      s2 = LOAD(&d->seq);
+   } while ((s1 & 1) || s1 != s2);
+   return (r->flags & STATREC_USED) != 0;
+}
+
+void statseg_close(StatSeg *s)
+{
+   if (s->head)
+      munmap(s->head, s->size);
+   close(s->fd);
+   memset(s, 0, sizeof(StatSeg));
+}
+
+/* adds r's counters into the totals record, the round trips are left out */
+void statseg_sum(StatRec *total, StatRec *r)
+{
+   unsigned long long   *t = &total->sent, *c = &r->sent;
+
+   while (c <= &r->errored)
+      *t++ += *c++;
+   if (total->count++ == 0 || r->start < total->start)
+      total->start = r->start;
+}
+
+/* fills in r's round trip fields from h */
+void statseg_rtt(StatRec *r, HdrHist *h)
+{
+   r->rttmean = hdrhist_mean(h);
+   r->rttp50 = hdrhist_percentile(h, 50);
+   r->rttp90 = hdrhist_percentile(h, 90);
+   r->rttp99 = hdrhist_percentile(h, 99);
+   r->rttp999 = hdrhist_percentile(h, 99.9);
+   r->rttmax = h->max;
+}
@@ -0,0 +1,87 @@
+#ifndef __STATSEG_H__
+#define __STATSEG_H__
+
+#include "hdrhist.h"
+
+#define STATSEG_MAGIC      0x55455354  /* "UEST" */
+#define STATSEG_VERSION    1
+#define STATSEG_GENERATOR  1           /* records are endpoints probed */
+#define STATSEG_REFLECTOR  2           /* records are sources echoed */
+#define STATSEG_PERIOD     100         /* ms between publishes */
+#define STATSEG_RECS       65536       /* generator records, total included */
+
+#define STATREC_USED       0x0001
+
+/*
+ * Start of a stats file.  Everything but 'count' and 'updated' is fixed
+ * once the file is created; a reader checks magic, version and recsize
+ * before it trusts the rest.
+ */
+typedef struct _StatSegHead {
+   unsigned             magic;
+   unsigned short       version;
+   unsigned short       kind;       /* STATSEG_GENERATOR or _REFLECTOR */
+   unsigned             recsize;    /* sizeof(StatRec) */
+   unsigned             nrecs;      /* records in the file */
+   unsigned             count;      /* records published so far */
+   unsigned             pid;        /* writer */
+   unsigned long long   start;      /* time() the writer started */
+   unsigned long long   updated;    /* time() of the last publish */
+   char                 name[24];   /* writer's program name */
+} StatSegHead;
+
+/*
+ * One endpoint or source, or with n == 0 the totals over all of them.
+ * Guarded by 'seq' like an AddrSlot: odd while the writer is in the
+ * middle of it.  Counters a program doesn't keep stay 0.
+ */
+typedef struct _StatRec {
+   unsigned             seq;
+   unsigned             addr;       /* network order, 0 in the totals */
+   unsigned short       port;       /* host order, 0 for a source */
+   unsigned short       flags;      /* STATREC_USED */
+   unsigned             count;      /* totals: records summed */
+   unsigned long long   start;      /* time() it was added */
+   unsigned long long   sent;       /* packets */
+   unsigned long long   rcvd;
+   unsigned long long   sentbytes;
+   unsigned long long   rcvdbytes;
+   unsigned long long   lost;
+   unsigned long long   late;
+   unsigned long long   reordered;
+   unsigned long long   duplicate;
+   unsigned long long   timeouts;
+   unsigned long long   rejected;
+   unsigned long long   untimed;
+   unsigned long long   drops;      /* connections lost */
+   unsigned long long   bertbits;
+   unsigned long long   biterrs;
+   unsigned long long   errored;
+   unsigned long long   rttmean;    /* round trips, ns */
+   unsigned long long   rttp50;
+   unsigned long long   rttp90;
+   unsigned long long   rttp99;
+   unsigned long long   rttp999;
+   unsigned long long   rttmax;
+} StatRec;
+
+/* a mapped stats file, for the writer or a reader */
+typedef struct _StatSeg {
+   int                  fd;
+   StatSegHead          *head;
+   StatRec              *recs;
+   unsigned             nrecs;
+   unsigned long        size;
+} StatSeg;
+
+extern int  statseg_create(StatSeg *s, const char *path, int kind,
+                           const char *name, unsigned nrecs);
+extern void statseg_write(StatSeg *s, unsigned n, StatRec *r);
+extern void statseg_publish(StatSeg *s, unsigned count);
+extern int  statseg_open(StatSeg *s, const char *path);
+extern int  statseg_read(StatSeg *s, unsigned n, StatRec *r);
+extern void statseg_close(StatSeg *s);
+extern void statseg_sum(StatRec *total, StatRec *r);
+extern void statseg_rtt(StatRec *r, HdrHist *h);
+
+#endif
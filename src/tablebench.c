@@ -0,0 +1,530 @@
+/* tablebench.c - times the per-source and per-endpoint lookup tables */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#ifdef linux
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "addrstat.h"
+#include "nsclock.h"
+
+extern int  errexit(const char *format, ...);
+
+#define USAGE  "usage: tablebench [-n entries,...] [-d seq|random|subnet,...] [-t chain|addrstat|echoidx,...] [-b budget(ms)]\n"
+
+#define MAXSIZES  16
+#define PORT      7
+#define CHECK     1024     /* ops between budget checks */
+
+/*
+ * One table design under test.  'insert' adds a key that isn't there,
+ * 'lookup' finds one that is and bumps its counters, as a packet would,
+ * and 'snapshot' copies every entry's counters, as a stats reader does.
+ */
+typedef struct _Design {
+   char                 *name;
+   void                 (*init)(unsigned n);
+   void                 (*insert)(unsigned addr, unsigned port);
+   int                  (*lookup)(unsigned addr, unsigned port);
+   unsigned long long   (*snapshot)(void);
+   void                 (*done)(void);
+} Design;
+
+/* time and cache misses of one phase */
+typedef struct _Phase {
+   unsigned             ops;
+   unsigned long long   ns;
+   long long            misses;     /* -1 without a counter */
+} Phase;
+
+static void       chainInit(unsigned n);
+static void       chainInsert(unsigned addr, unsigned port);
+static int        chainLookup(unsigned addr, unsigned port);
+static unsigned long long chainSnapshot(void);
+static void       chainDone(void);
+static void       statInit(unsigned n);
+static void       statInsert(unsigned addr, unsigned port);
+static int        statLookup(unsigned addr, unsigned port);
+static unsigned long long statSnapshot(void);
+static void       statDone(void);
+static void       idxInit(unsigned n);
+static void       idxInsert(unsigned addr, unsigned port);
+static int        idxLookup(unsigned addr, unsigned port);
+static unsigned long long idxSnapshot(void);
+static void       idxDone(void);
+static void       run(Design *d, char *dist, unsigned n);
+static void       makeKeys(unsigned *keys, char *dist, unsigned n);
+static void       shuffle(unsigned *keys, unsigned n);
+static unsigned   fmix(unsigned k);
+static void       missStart(void);
+static long long  missStop(void);
+static void       printPhase(Phase *p);
+static int        listed(char *list, char *name);
+
+static Design designs[] = {
+   { "chain", chainInit, chainInsert, chainLookup, chainSnapshot, chainDone },
+   { "addrstat", statInit, statInsert, statLookup, statSnapshot, statDone },
+   { "echoidx", idxInit, idxInsert, idxLookup, idxSnapshot, idxDone },
+};
+#define NDESIGNS  (sizeof(designs) / sizeof(designs[0]))
+
+static char       *dists = "seq,random,subnet";
+static char       *tables = "chain,addrstat,echoidx";
+static unsigned long long budget = 2000;  /* ms per phase */
+static int        perfFd = -1;
+static unsigned long long sink;           /* keeps results live */
+
+/*
+ * Insert, lookup and snapshot costs of the address tables, in ns and
+ * cache misses per operation, for n entries drawn from:
+ *
+ *   seq      10.0.0.1 upwards, a rig's block of endpoint addresses
+ *   random   scattered over the whole address space
+ *   subnet   a.b.0.1 for every a.b first: the last two bytes are all
+ *            the same, as across many 10.x.0.1 subnets
+ *
+ * Tables:
+ *
+ *   chain    [256][256] chains on the last two address bytes, the way
+ *            addStat/getStat and getInfo used to work, for reference
+ *   addrstat UDPechod's per-source table
+ *   echoidx  UDPecho2's EchoTable index, endpoints malloced one by one
+ *
+ * A phase that runs past the budget stops there and reports what it
+ * did, so a degenerate case can't hold up the rest; 'stored' then shows
+ * how many entries the later phases ran over.
+ */
+int main(int argc, char *argv[])
+{
+   unsigned sizes[MAXSIZES] = { 1000, 10000, 100000, 1000000 };
+   unsigned nsizes = 4, i, j;
+   char     *s, *d, *dlist;
+
+   for (i = 1; i < argc; i++) {
+      if (strncmp(argv[i], "-h", 2) == 0) {
+         errexit(USAGE);
+      }
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+         nsizes = 0;
+         for (s = strtok(argv[++i], ","); s && nsizes < MAXSIZES;
+              s = strtok(NULL, ","))
+            if ((sizes[nsizes] = strtoul(s, NULL, 10)) > 0)
+               nsizes++;
+      }
+      else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+         dists = argv[++i];
+      }
+      else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+         tables = argv[++i];
+      }
+      else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+         budget = strtoul(argv[++i], NULL, 10);
+      }
+      else {
+         errexit(USAGE);
+      }
+   }
+
+#ifdef linux
+   {
+      struct perf_event_attr  pe;
+
+      memset(&pe, 0, sizeof(pe));
+      pe.type = PERF_TYPE_HARDWARE;
+      pe.size = sizeof(pe);
+      pe.config = PERF_COUNT_HW_CACHE_MISSES;
+      pe.disabled = 1;
+      pe.exclude_kernel = 1;
+      pe.exclude_hv = 1;
+      perfFd = (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+   }
+#endif
+   if (perfFd < 0)
+      printf("# no cache miss counter, misses shown as -\n");
+   printf("# per op: insert and lookup; per entry: snapshot\n");
+   printf("%-9s %-7s %8s %8s %9s %7s %9s %7s %9s %7s\n", "table", "dist",
+          "entries", "stored", "insert ns", "misses", "lookup ns", "misses",
+          "snap ns", "misses");
+
+   for (j = 0; j < NDESIGNS; j++) {
+      if (!listed(tables, designs[j].name))
+         continue;
+      dlist = strdup(dists);
+      for (d = strtok(dlist, ","); d; d = strtok(NULL, ","))
+         for (i = 0; i < nsizes; i++)
+            run(&designs[j], d, sizes[i]);
+      free(dlist);
+   }
+   return 0;
+}
+
+/* one design, one distribution, n entries */
+static void run(Design *d, char *dist, unsigned n)
+{
+   unsigned             *keys, i, stored = 0;
+   unsigned long long   t0, deadline;
+   Phase                ins, look, snap;
+
+   keys = (unsigned *)malloc(n * sizeof(unsigned));
+   if (keys == NULL)
+      errexit("Can't allocate %u keys\n", n);
+   makeKeys(keys, dist, n);
+   d->init(n);
+
+   memset(&ins, 0, sizeof(ins));
+   memset(&look, 0, sizeof(look));
+   memset(&snap, 0, sizeof(snap));
+
+   missStart();
+   t0 = nsclock_now();
+   deadline = t0 + budget * (NSEC / 1000);
+   for (i = 0; i < n; i++) {
+      d->insert(keys[i], PORT);
+      if (i % CHECK == CHECK - 1 && nsclock_now() > deadline) {
+         i++;
+         break;
+      }
+   }
+   ins.ns = nsclock_now() - t0;
+   ins.misses = missStop();
+   ins.ops = i;
+
+   /* lookups in random order, over what got in */
+   shuffle(keys, ins.ops);
+   missStart();
+   t0 = nsclock_now();
+   deadline = t0 + budget * (NSEC / 1000);
+   for (i = 0; i < ins.ops; i++) {
+      stored += d->lookup(keys[i], PORT);
+      if (i % CHECK == CHECK - 1 && nsclock_now() > deadline) {
+         i++;
+         break;
+      }
+   }
+   look.ns = nsclock_now() - t0;
+   look.misses = missStop();
+   look.ops = i;
+
+   missStart();
+   t0 = nsclock_now();
+   snap.ops = (unsigned)d->snapshot();
+   snap.ns = nsclock_now() - t0;
+   snap.misses = missStop();
+
+   printf("%-9s %-7s %8u %8u", d->name, dist, n, stored);
+   printPhase(&ins);
+   printPhase(&look);
+   printPhase(&snap);
+   printf("%s\n", ins.ops < n || look.ops < ins.ops ? "  (over budget)" : "");
+   fflush(stdout);
+
+   d->done();
+   free(keys);
+}
+
+static void makeKeys(unsigned *keys, char *dist, unsigned n)
+{
+   unsigned       i;
+   unsigned char  *bp;
+
+   for (i = 0; i < n; i++) {
+      if (strcmp(dist, "random") == 0) {
+         keys[i] = fmix(i + 1);     /* a bijection, so no repeats or 0 */
+      }
+      else if (strcmp(dist, "subnet") == 0) {
+         bp = (unsigned char *)&keys[i];
+         bp[0] = i & 0xff;
+         bp[1] = (i >> 8) & 0xff;
+         bp[2] = i >> 16;
+         bp[3] = 1;
+      }
+      else {
+         keys[i] = htonl(0x0a000001 + i);
+      }
+   }
+}
+
+static void shuffle(unsigned *keys, unsigned n)
+{
+   unsigned i, j, k, rnd = 0x2545f491;
+
+   for (i = n; i > 1; i--) {
+      rnd ^= rnd << 13;
+      rnd ^= rnd >> 17;
+      rnd ^= rnd << 5;
+      j = rnd % i;
+      k = keys[i - 1];
+      keys[i - 1] = keys[j];
+      keys[j] = k;
+   }
+}
+
+/* murmur3's finalizer, invertible and fmix(0) == 0 */
+static unsigned fmix(unsigned k)
+{
+   k ^= k >> 16;
+   k *= 0x85ebca6b;
+   k ^= k >> 13;
+   k *= 0xc2b2ae35;
+   k ^= k >> 16;
+   return k;
+}
+
+static void missStart(void)
+{
+#ifdef linux
+   if (perfFd >= 0) {
+      ioctl(perfFd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(perfFd, PERF_EVENT_IOC_ENABLE, 0);
+   }
+#endif
+}
+
+static long long missStop(void)
+{
+   long long count = -1;
+
+#ifdef linux
+   if (perfFd >= 0) {
+      ioctl(perfFd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(perfFd, &count, sizeof(count)) != sizeof(count))
+         count = -1;
+   }
+#endif
+   return count;
+}
+
+static void printPhase(Phase *p)
+{
+   unsigned ops = p->ops ? p->ops : 1;
+
+   printf(" %9.1f", (double)p->ns / ops);
+   if (p->misses < 0)
+      printf(" %7s", "-");
+   else
+      printf(" %7.2f", (double)p->misses / ops);
+}
+
+static int listed(char *list, char *name)
+{
+   size_t   len = strlen(name);
+   char     *s;
+
+   for (s = strstr(list, name); s; s = strstr(s + 1, name))
+      if ((s == list || s[-1] == ',') && (s[len] == ',' || s[len] == 0))
+         return 1;
+   return 0;
+}
+
+/*------------------------------------------------------------------------
+ * chain - the original [256][256] table: chained on the last two bytes
+ *         of the address, new entries malloced and put at a chain's end
+ *------------------------------------------------------------------------
+ */
+typedef struct _Chain {
+   unsigned             addr;
+   unsigned             port;
+   unsigned long long   bytes;
+   unsigned long long   packets;
+   time_t               start;
+   struct _Chain        *next;      /* for hash */
+   struct _Chain        *nextlink;  /* for global linked list */
+} Chain;
+
+static Chain   *chainHash[256][256];
+static Chain   *chainList;
+
+static void chainInit(unsigned n)
+{
+   memset(chainHash, 0, sizeof(chainHash));
+   chainList = NULL;
+}
+
+static void chainInsert(unsigned addr, unsigned port)
+{
+   unsigned char  *bp = (unsigned char *)&addr;
+   Chain          **pp, *sp;
+
+   for (pp = &chainHash[bp[2]][bp[3]]; *pp; pp = &(*pp)->next)
+      if ((*pp)->addr == addr && (*pp)->port == port)
+         return;
+   sp = (Chain *)calloc(1, sizeof(Chain));
+   if (sp == NULL)
+      errexit("Out of memory\n");
+   sp->addr = addr;
+   sp->port = port;
+   sp->start = time(NULL);
+   *pp = sp;
+   sp->nextlink = chainList;
+   chainList = sp;
+}
+
+static int chainLookup(unsigned addr, unsigned port)
+{
+   unsigned char  *bp = (unsigned char *)&addr;
+   Chain          *sp;
+
+   for (sp = chainHash[bp[2]][bp[3]]; sp; sp = sp->next)
+      if (sp->addr == addr && sp->port == port) {
+         sp->bytes += 1070;
+         sp->packets++;
+         return 1;
+      }
+   return 0;
+}
+
+static unsigned long long chainSnapshot(void)
+{
+   Chain                *sp;
+   unsigned long long   n = 0;
+
+   for (sp = chainList; sp; sp = sp->nextlink, n++)
+      sink += sp->bytes + sp->packets;
+   return n;
+}
+
+static void chainDone(void)
+{
+   Chain *sp, *next;
+
+   for (sp = chainList; sp; sp = next) {
+      next = sp->nextlink;
+      free(sp);
+   }
+   chainList = NULL;
+}
+
+/*------------------------------------------------------------------------
+ * addrstat - UDPechod's table, keyed on the address alone; lookup is the
+ *            per-packet addrstat_add, snapshot the stats thread's walk
+ *------------------------------------------------------------------------
+ */
+static AddrTable statTable;
+
+static void statInit(unsigned n)
+{
+   if (!addrstat_init(&statTable, n))
+      errexit("Can't allocate a table for %u sources\n", n);
+}
+
+static void statInsert(unsigned addr, unsigned port)
+{
+   addrstat_add(&statTable, addr, 1070, 1);
+}
+
+static int statLookup(unsigned addr, unsigned port)
+{
+   unsigned long long dropped = statTable.dropped;
+
+   addrstat_add(&statTable, addr, 1070, 1);
+   return statTable.dropped == dropped;
+}
+
+static unsigned long long statSnapshot(void)
+{
+   AddrStat snap;
+   unsigned i, n = addrstat_count(&statTable);
+
+   for (i = 0; i < n; i++)
+      if (addrstat_snap(&statTable, i, &snap))
+         sink += snap.bytes + snap.packets;
+   return n;
+}
+
+static void statDone(void)
+{
+   free(statTable.slots);
+   free(statTable.order);
+}
+
+/*------------------------------------------------------------------------
+ * echoidx - UDPecho2's EchoTable index: open addressing on the address
+ *           and port with the same addrstat_hash(), pointing at
+ *           separately malloced endpoints.  UDPecho2 rebuilds the index
+ *           on every add; here it is built in place, sized for n up
+ *           front, so insert is the cost of one probe sequence and not
+ *           of a rebuild.
+ *------------------------------------------------------------------------
+ */
+typedef struct _Endpoint {
+   unsigned             addr;
+   unsigned             port;
+   unsigned long long   bytes;
+   unsigned long long   packets;
+} Endpoint;
+
+static Endpoint   **idxIndex;
+static unsigned   idxMask;
+static Endpoint   **idxList;
+static unsigned   idxCount;
+
+static void idxInit(unsigned n)
+{
+   unsigned size = 64;
+
+   while (size < n * 2)
+      size <<= 1;
+   idxIndex = (Endpoint **)calloc(size, sizeof(Endpoint *));
+   idxList = (Endpoint **)calloc(n, sizeof(Endpoint *));
+   if (idxIndex == NULL || idxList == NULL)
+      errexit("Can't allocate an index for %u endpoints\n", n);
+   idxMask = size - 1;
+   idxCount = 0;
+}
+
+static void idxInsert(unsigned addr, unsigned port)
+{
+   unsigned h = addrstat_hash(addr, port);
+   Endpoint *ep;
+
+   for (; (ep = idxIndex[h & idxMask]) != NULL; h++)
+      if (ep->addr == addr && ep->port == port)
+         return;
+   ep = (Endpoint *)calloc(1, sizeof(Endpoint));
+   if (ep == NULL)
+      errexit("Out of memory\n");
+   ep->addr = addr;
+   ep->port = port;
+   idxIndex[h & idxMask] = ep;
+   idxList[idxCount++] = ep;
+}
+
+static int idxLookup(unsigned addr, unsigned port)
+{
+   unsigned h = addrstat_hash(addr, port);
+   Endpoint *ep;
+
+   for (; (ep = idxIndex[h & idxMask]) != NULL; h++)
+      if (ep->addr == addr && ep->port == port) {
+         ep->bytes += 1070;
+         ep->packets++;
+         return 1;
+      }
+   return 0;
+}
+
+static unsigned long long idxSnapshot(void)
+{
+   unsigned i;
+
+   for (i = 0; i < idxCount; i++)
+      sink += idxList[i]->bytes + idxList[i]->packets;
+   return idxCount;
+}
+
+static void idxDone(void)
+{
+   unsigned i;
+
+   for (i = 0; i < idxCount; i++)
+      free(idxList[i]);
+   free(idxIndex);
+   free(idxList);
+}
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timerheap.h"
+
+int timerheap_init(TimerHeap *h, unsigned size)
+{
+   memset(h, 0, sizeof(TimerHeap));
+   if (size < 16)
+      size = 16;
+   h->nodes = (TimerNode **)malloc((size + 1) * sizeof(TimerNode *));
+   if (h->nodes == NULL)
+      return 0;
+   h->size = size;
+   return 1;
+}
+
+static void place(TimerHeap *h, TimerNode *n, unsigned i)
+{
+   h->nodes[i] = n;
+   n->idx = i;
+}
+
+/* moves the node at slot i up or down until the heap holds again */
+static void fix(TimerHeap *h, unsigned i)
+{
+   TimerNode   *n = h->nodes[i];
+   unsigned    c;
+
+   while (i > 1 && h->nodes[i / 2]->due > n->due) {
+      place(h, h->nodes[i / 2], i);
+      i /= 2;
+   }
+   while ((c = i * 2) <= h->count) {
+      if (c < h->count && h->nodes[c + 1]->due < h->nodes[c]->due)
+         c++;
+      if (h->nodes[c]->due >= n->due)
+         break;
+      place(h, h->nodes[c], i);
+      i = c;
+   }
+   place(h, n, i);
+}
+
+/* queues n for 'due', or moves it there if it's already queued */
+int timerheap_set(TimerHeap *h, TimerNode *n, unsigned long long due)
+{
+   TimerNode   **nodes;
+
+   n->due = due;
+   if (n->idx == 0) {
+      if (h->count == h->size) {
+         nodes = (TimerNode **)realloc(h->nodes,
+                                       (h->size * 2 + 1) * sizeof(TimerNode *));
+         if (nodes == NULL)
+            return 0;
+         h->nodes = nodes;
+         h->size *= 2;
+      }
+      place(h, n, ++h->count);
+   }
+   fix(h, n->idx);
+   return 1;
+}
+
+void timerheap_del(TimerHeap *h, TimerNode *n)
+{
+   unsigned    i = n->idx;
+
+   if (i == 0)
+      return;
+   n->idx = 0;
+   if (i == h->count--)
+      return;
+   place(h, h->nodes[h->count + 1], i);
+   fix(h, i);
+}
+
+/* earliest node, NULL if nothing is queued */
+TimerNode *timerheap_top(TimerHeap *h)
+{
+   return h->count ? h->nodes[1] : NULL;
+}
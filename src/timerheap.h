@@ -0,0 +1,28 @@
+#ifndef __TIMERHEAP_H__
+#define __TIMERHEAP_H__
+
+/*
+ * Binary min-heap of deadlines.  A TimerNode lives inside whatever it
+ * times and remembers its place in the heap, so rescheduling or removing
+ * it is O(log n) without a search.  'idx' is 0 while the node is not
+ * queued.
+ */
+typedef struct _TimerNode {
+   unsigned long long   due;        /* ns, nsclock_now() time base */
+   unsigned             idx;        /* 1 based heap slot, 0 = idle */
+   void                 *data;
+} TimerNode;
+
+typedef struct _TimerHeap {
+   TimerNode            **nodes;    /* nodes[1..count] */
+   unsigned             count;
+   unsigned             size;
+} TimerHeap;
+
+extern int        timerheap_init(TimerHeap *h, unsigned size);
+extern int        timerheap_set(TimerHeap *h, TimerNode *n,
+                                unsigned long long due);
+extern void       timerheap_del(TimerHeap *h, TimerNode *n);
+extern TimerNode  *timerheap_top(TimerHeap *h);
+
+#endif
@@ -1,6 +1,10 @@
+#ifdef linux
+#define _GNU_SOURCE     /* pthread_setaffinity_np */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "tthread.h"
 
@@ -28,6 +32,29 @@ int thread_create(Thread *thr, ThreadRunFunc runfunc, void *funcdata)
    return 1;
 }
 
+/* pins the calling thread to a cpu, wrapping around the online cpus */
+int thread_bindcpu(int cpu)
+{
+#ifdef linux
+   cpu_set_t   set;
+   long        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   int         err;
+
+   if (ncpu < 1)
+      ncpu = 1;
+   CPU_ZERO(&set);
+   CPU_SET(cpu % ncpu, &set);
+   err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+   if (err) {
+      thread_printerr("pthread_setaffinity_np", err);
+      return 0;
+   }
+   return 1;
+#else
+   return 0;
+#endif
+}
+
 int mutex_create(Mutex *m)
 {
    int err = pthread_mutex_init(m, NULL);
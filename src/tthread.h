@@ -10,6 +10,7 @@ typedef pthread_t       Thread;
 typedef void *          (*ThreadRunFunc)(void *);
 
 extern int  thread_create(Thread *thr, ThreadRunFunc runfunc, void *funcdata);
+extern int  thread_bindcpu(int cpu);
 extern void thread_printerr(const char *string, int err);
 extern int  mutex_create(Mutex *);
 extern int  mutex_destroy(Mutex *);
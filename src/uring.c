@@ -0,0 +1,243 @@
+/* uring.c - io_uring on raw syscalls, no liburing needed */
+
+#ifdef linux
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define ACQUIRE(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RELEASE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+   return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags,
+                       NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+   return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+/*------------------------------------------------------------------------
+ * uring_init - set up and map the rings, 0 if io_uring is not available
+ *              (old kernel, seccomp, kernel.io_uring_disabled) so the
+ *              caller can fall back to plain sockets
+ *------------------------------------------------------------------------
+ */
+int uring_init(Uring *u, unsigned entries)
+{
+   struct io_uring_params  p;
+   char                    *sq, *cq;
+
+   memset(u, 0, sizeof(Uring));
+   memset(&p, 0, sizeof(p));
+   u->fd = sys_setup(entries, &p);
+   if (u->fd < 0)
+      return 0;
+
+   u->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   u->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (u->cqringsz > u->sqringsz)
+         u->sqringsz = u->cqringsz;
+      u->cqringsz = u->sqringsz;
+   }
+   u->sqring = mmap(NULL, u->sqringsz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+   if (u->sqring == MAP_FAILED)
+      goto fail;
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      u->cqring = u->sqring;
+   else {
+      u->cqring = mmap(NULL, u->cqringsz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+      if (u->cqring == MAP_FAILED)
+         goto fail;
+   }
+   u->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+   u->sqes = mmap(NULL, u->sqessz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+   if (u->sqes == MAP_FAILED)
+      goto fail;
+
+   sq = (char *)u->sqring;
+   cq = (char *)u->cqring;
+   u->sqhead = (unsigned *)(sq + p.sq_off.head);
+   u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+   u->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+   u->sqarray = (unsigned *)(sq + p.sq_off.array);
+   u->cqhead = (unsigned *)(cq + p.cq_off.head);
+   u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+   u->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+   u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+   return 1;
+
+fail:
+   uring_exit(u);
+   return 0;
+}
+
+/* unmaps the rings and closes the ring fd, after uring_init or in it */
+void uring_exit(Uring *u)
+{
+   if (u->sqes && u->sqes != MAP_FAILED)
+      munmap(u->sqes, u->sqessz);
+   if (u->cqring && u->cqring != MAP_FAILED && u->cqring != u->sqring)
+      munmap(u->cqring, u->cqringsz);
+   if (u->sqring && u->sqring != MAP_FAILED)
+      munmap(u->sqring, u->sqringsz);
+   close(u->fd);
+   memset(u, 0, sizeof(Uring));
+   u->fd = -1;
+}
+
+/* next free submission entry, NULL when the ring is full */
+struct io_uring_sqe *uring_sqe(Uring *u)
+{
+   unsigned             tail = *u->sqtail + u->sqpending;
+   struct io_uring_sqe  *sqe;
+
+   if (tail - ACQUIRE(u->sqhead) > *u->sqmask)
+      return NULL;
+   sqe = &u->sqes[tail & *u->sqmask];
+   memset(sqe, 0, sizeof(struct io_uring_sqe));
+   u->sqarray[tail & *u->sqmask] = tail & *u->sqmask;
+   u->sqpending++;
+   return sqe;
+}
+
+/* publishes everything queued with one syscall, optionally waiting */
+int uring_submit(Uring *u, unsigned wait)
+{
+   unsigned n = u->sqpending;
+   int      ret;
+
+   RELEASE(u->sqtail, *u->sqtail + n);
+   u->sqpending = 0;
+   do {
+      ret = sys_enter(u->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+   } while (ret < 0 && errno == EINTR);
+   return ret;
+}
+
+/* oldest unseen completion, NULL if none are ready */
+struct io_uring_cqe *uring_cqe(Uring *u)
+{
+   unsigned head = *u->cqhead;
+
+   if (head == ACQUIRE(u->cqtail))
+      return NULL;
+   return &u->cqes[head & *u->cqmask];
+}
+
+void uring_cqe_seen(Uring *u)
+{
+   RELEASE(u->cqhead, *u->cqhead + 1);
+}
+
+/*------------------------------------------------------------------------
+ * uring_bufring - register nbufs (power of 2) buffers of bufsize bytes as
+ *                 provided buffer group bgid, for IOSQE_BUFFER_SELECT
+ *------------------------------------------------------------------------
+ */
+int uring_bufring(Uring *u, unsigned nbufs, unsigned bufsize,
+                  unsigned short bgid)
+{
+   struct io_uring_buf_reg reg;
+   size_t                  ringsz = nbufs * sizeof(struct io_uring_buf);
+   void                    *mem;
+   unsigned                i;
+
+   mem = mmap(NULL, ringsz, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mem == MAP_FAILED)
+      return 0;
+   if (posix_memalign((void **)&u->bufs, 4096, (size_t)nbufs * bufsize)) {
+      munmap(mem, ringsz);
+      return 0;
+   }
+   u->bufring = (struct io_uring_buf_ring *)mem;
+   u->nbufs = nbufs;
+   u->bufsize = bufsize;
+   u->bgid = bgid;
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (unsigned long)mem;
+   reg.ring_entries = nbufs;
+   reg.bgid = bgid;
+   if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      free(u->bufs);
+      munmap(mem, ringsz);
+      u->bufring = NULL;
+      return 0;
+   }
+   for (i = 0; i < nbufs; i++)
+      uring_buf_recycle(u, i);
+   return 1;
+}
+
+char *uring_buf(Uring *u, unsigned bid)
+{
+   return u->bufs + (size_t)bid * u->bufsize;
+}
+
+/* hands buffer bid back to the kernel */
+void uring_buf_recycle(Uring *u, unsigned bid)
+{
+   unsigned short       tail = u->bufring->tail;
+   struct io_uring_buf  *b = &u->bufring->bufs[tail & (u->nbufs - 1)];
+
+   b->addr = (unsigned long)uring_buf(u, bid);
+   b->len = u->bufsize;
+   b->bid = bid;
+   RELEASE(&u->bufring->tail, (unsigned short)(tail + 1));
+}
+
+/* multishot recvmsg into the provided buffers, msg is only a template */
+void uring_recvmsg_multi(Uring *u, int sock, struct msghdr *msg,
+                         unsigned long long data)
+{
+   struct io_uring_sqe *sqe;
+
+   while ((sqe = uring_sqe(u)) == NULL)
+      uring_submit(u, 0);
+   sqe->opcode = IORING_OP_RECVMSG;
+   sqe->fd = sock;
+   sqe->addr = (unsigned long)msg;
+   sqe->len = 1;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = u->bgid;
+   sqe->user_data = data;
+}
+
+/* msg must stay put until its completion shows up */
+void uring_sendmsg(Uring *u, int sock, struct msghdr *msg,
+                   unsigned long long data)
+{
+   struct io_uring_sqe *sqe;
+
+   while ((sqe = uring_sqe(u)) == NULL)
+      uring_submit(u, 0);
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->fd = sock;
+   sqe->addr = (unsigned long)msg;
+   sqe->len = 1;
+   sqe->user_data = data;
+}
+#endif
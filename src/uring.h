@@ -0,0 +1,54 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef linux
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on the raw syscalls: one submission and one
+ * completion ring, plus an optional provided buffer ring registered with
+ * the kernel for multishot receives.
+ */
+typedef struct _Uring {
+   int                     fd;
+   unsigned                *sqhead;
+   unsigned                *sqtail;
+   unsigned                *sqmask;
+   unsigned                *sqarray;
+   struct io_uring_sqe     *sqes;
+   unsigned                sqpending;  /* queued, not yet submitted */
+   unsigned                *cqhead;
+   unsigned                *cqtail;
+   unsigned                *cqmask;
+   struct io_uring_cqe     *cqes;
+   void                    *sqring;
+   void                    *cqring;
+   unsigned                sqringsz;
+   unsigned                cqringsz;
+   unsigned                sqessz;
+
+   struct io_uring_buf_ring *bufring;  /* provided buffers */
+   char                    *bufs;
+   unsigned                bufsize;
+   unsigned                nbufs;
+   unsigned short          bgid;
+} Uring;
+
+extern int     uring_init(Uring *u, unsigned entries);
+extern void    uring_exit(Uring *u);
+extern struct io_uring_sqe *uring_sqe(Uring *u);
+extern int     uring_submit(Uring *u, unsigned wait);
+extern struct io_uring_cqe *uring_cqe(Uring *u);
+extern void    uring_cqe_seen(Uring *u);
+extern int     uring_bufring(Uring *u, unsigned nbufs, unsigned bufsize,
+                             unsigned short bgid);
+extern char    *uring_buf(Uring *u, unsigned bid);
+extern void    uring_buf_recycle(Uring *u, unsigned bid);
+extern void    uring_recvmsg_multi(Uring *u, int sock, struct msghdr *msg,
+                                   unsigned long long data);
+extern void    uring_sendmsg(Uring *u, int sock, struct msghdr *msg,
+                             unsigned long long data);
+#endif
+
+#endif